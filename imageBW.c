@@ -24,18 +24,81 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
 #include "instrumentation.h"
 
 // The data structure
 //
-// A BW image is stored in a structure containing 3 fields:
-// Two integers store the image width and height.
-// The other field is a pointer to an array that stores the pointers
-// to the RLE compressed image rows.
+// A BW image is stored in a structure containing the image width and height
+// and an arena buffer holding the run lengths of all the RLE compressed
+// image rows, stored back to back in row order.
+// A per-row table gives the arena and the position in it where each row
+// starts, the number of runs in the row and the color of its first run,
+// so creating or destroying an image takes a constant number of
+// allocations, row-order sweeps read the arena sequentially, and the length
+// of a row is known in O(1).
+//
+// Rows are immutable once written, and arenas are reference counted,
+// so images may share them: ImageNEG and ImageReplicateAtBottom only build
+// a new row table that points into the arenas of their operands (NEG just
+// flips the colors in the table), and the mirrors are views that share
+// the row table too, read in another orientation.
+// An arena is freed when the last image using it is destroyed.
+//
+// Consecutive equal rows (e.g., blank margins) are stored once: a row
+// equal to the row above shares its runs, and, once an image is built, each
+// vertical span of rows with the same descriptor may become a single entry
+// of the row table (see ImageSetRowSpans).  Operations read the operands
+// span by span, and compute each pair of spans once.
+//
+// Optionally (see ImageSetRowInterning), rows are also hash-consed:
+// while an image is built, each new row is looked up by the hash of its
+// runs in a dictionary of the rows already in its arena, and an identical
+// row is stored only once.  Rows of the same image then compare equal by
+// address.  Independently of that mode, the boolean operations compute each
+// distinct pair of operand rows only once.
+//
+// Pattern images (solid, chessboard, stripes, grid) are procedural: they
+// keep only their parameters and have no row table.  Their few distinct
+// rows (at most two, independent of the height) are generated into
+// arena[0] the first time a row is read, and the row descriptor of any
+// row i is computed from i.  So a huge pattern costs O(1) memory, and it
+// still combines with stored images in any operation.
+//
+// No run can be longer than the image width, so run lengths are stored
+// with the smallest unsigned type that holds the width: 1, 2 or 4 bytes.
+// For a 1728 pixel wide fax page that is a quarter of the space of an int.
+//
+// Dense rows (e.g., halftones or noise), whose runs would take more space
+// than their pixels, are stored as bitsets instead (see ImageSetBitsetRows):
+// whole 64-bit words of pixels, in the byte order of PBM files (the first
+// pixel in the most significant bit of the first byte), with the padding
+// after the width WHITE.  The pixels are stored XORed with the first pixel,
+// so the color of a row is still that of its first pixel, and negating it
+// still flips just that.  Each row descriptor records the form of its row;
+// the boolean operations combine bitset rows a word at a time (with SIMD
+// instructions, where available), and build each result row in the form
+// that takes less space.
+//
+// Optionally (see ImageSetEdgeRows), rows are stored by the ends of their
+// runs instead of their lengths: the absolute positions where the color
+// changes, followed by the width.  They take the same space, but the pixel
+// at any x is then found by binary search, and the boolean operations merge
+// the transitions of two rows directly (XOR is the symmetric difference of
+// the two sets of transitions).
 //
 // Clients should use images only through variables of type Image,
 // which are pointers to the image structure, and should not access the
@@ -44,16 +107,140 @@
 // Constant value --- Use them throughout your code
 // const uint8 BLACK = 1;  // Black pixel value, defined on .h
 // const uint8 WHITE = 0;  // White pixel value, defined on .h
-const int EOR = -1; // Stored as the last element of a RLE row
+const int EOR = -1; // Printed as the last element of a RLE row
+
+// Internal structure for a reference counted arena of runs
+struct arena
+{
+  uint32 refs;     // number of images using the arena
+  uint32 last;     // row committed last, while an image is built (or NO_ROW)
+  size_t used;     // number of runs in use in the arena
+  size_t capacity; // number of runs allocated for the arena
+  size_t size;     // number of bytes allocated for the runs
+  uint8 *runs;     // runs of the rows, one after the other
+};
+
+// Internal structure describing a RLE row stored in an arena
+struct rowinfo
+{
+  size_t offset;   // arena index of the first run of the row
+  uint32 num_runs; // number of runs in the row
+  uint16 arena;    // index of the arena, in the arena list of the image
+  uint8 color;     // pixel value of the first run
+  uint8 form;      // how the row is stored: ROW_RUNS or ROW_BITS
+};
+
+// Forms of a stored row
+// (The runs of a row may be stored as they are, or by their ends, or the row
+// may be stored as a bitset: BitsUnits() run-sized units that hold the
+// pixels, see above.  num_runs is the number of runs of the row either way.)
+#define ROW_RUNS 0
+#define ROW_BITS 1
+#define ROW_EDGES 2 // run k ends at pixel edges[k] (the last end is the width)
+
+// Internal structure for a reference counted row table
+// (shared by an image and its orientation views)
+// The table has an entry per row, or, once the image is built, an entry
+// per vertical span of rows with the same descriptor, when that takes at
+// most half the space: then entry s describes the rows [end[s-1], end[s]).
+struct rowtable
+{
+  uint32 refs;           // number of images using the table
+  uint32 capacity;       // number of entries allocated
+  uint32 num_spans;      // number of entries by span (0: an entry per row)
+  uint32 max_spans;      // number of span ends allocated
+  uint32 *end;           // end[s]: the row after the span of entry s
+  uint64 *hash;          // hash[2*s], hash[2*s+1]: the fingerprints of the
+                         // runs of entry s, read forwards and backwards
+                         // (NULL until computed, see ImageHash)
+  uint32 *mark;          // mark[e]: the index in marks of the first mark of
+                         // entry e (NO_ROW if not computed, see MarkRowRuns;
+                         // NULL until a row is marked)
+  uint32 *marks;         // the marks of the entries of runs, one after the
+                         // other: the end of every MARK_STEP-th run
+  size_t num_marks;      // number of marks in use
+  size_t max_marks;      // number of marks allocated
+  struct rowinfo row[];  // the entries
+};
 
 // Internal structure for storing RLE BW images
 struct image
 {
   uint32 width;
   uint32 height;
-  int **row; // pointer to an array of pointers referencing the compressed rows
+  uint8 run_size;        // number of bytes used to store each run length
+  uint16 num_arenas;     // number of arenas used by the image
+  uint16 max_arenas;     // number of arenas the arena list has room for
+  struct arena **arena;  // arenas holding the rows (new rows go to arena[0])
+  size_t num_runs;       // total number of runs in the rows of the image
+  struct rowtable *table; // the row table (NULL for patterns)
+  struct rowinfo *row;   // table->row: row[i] describes where row i (or the
+                         // span i) is, its length and color
+  uint8 flip;            // orientation of a view (see FLIP_ROWS, FLIP_RUNS)
+  struct rowdict *dict;  // rows of arena[0], while the image is built (or NULL)
+  uint64 hash;           // fingerprint of the pixels (see ImageHash)
+  uint8 hashed;          // was it computed (since the pixels last changed)?
+
+  // Parameters of pattern images (pattern == STORED for all other images)
+  uint8 pattern;         // kind of pattern
+  uint8 value;           // color of the first pixel (of the lines, for GRID)
+  uint32 period;         // square edge, stripe width or grid spacing
+  uint32 thickness;      // thickness of the grid lines
+  struct rowinfo prow[2]; // the distinct rows, once generated
 };
 
+// Orientations of stored images
+// An image may be a view of the rows of another one, sharing its row
+// table and arenas, read in another orientation:
+#define FLIP_ROWS 1 // row i is the row height-1-i of the table (top-bottom)
+#define FLIP_RUNS 2 // the runs of each row are read backwards (left-right)
+
+// Kinds of images: stored row by row, or generated from a pattern
+enum pattern
+{
+  STORED = 0, // rows in the row table
+  SOLID,      // all pixels of the same color
+  CHESSBOARD, // squares of alternating colors
+  HSTRIPES,   // horizontal stripes of alternating colors
+  VSTRIPES,   // vertical stripes of alternating colors
+  GRID,       // grid lines over a background of the opposite color
+};
+
+// Internal hash table to find rows seen before, keyed by a 64-bit hash.
+// Each entry keeps the index of a row where the key was seen;
+// the user of the table checks whether that row really matches.
+struct rowdict
+{
+  size_t mask;    // number of entries - 1 (a power of 2 minus 1)
+  size_t count;   // number of rows stored
+  uint64 *hash;   // hash of each entry
+  uint32 *row;    // row index of each entry (NO_ROW if the entry is empty)
+};
+
+#define NO_ROW UINT32_MAX
+
+// Row interning (hash-consing) mode, see ImageSetRowInterning()
+static int InternRows = 0;
+
+// Memory-mapped loading mode, see ImageSetMappedLoad()
+static int MappedLoad = 1;
+
+// Number of threads for row-parallel operations, see ImageSetThreads()
+#define MAX_THREADS 64
+static int Threads = 1;
+
+// Block pooling mode, see ImageSetPooling()
+static int Pooling = 1;
+
+// Vertical span mode, see ImageSetRowSpans()
+static int RowSpans = 1;
+
+// Bitset row mode, see ImageSetBitsetRows()
+static int BitsetRows = 1;
+
+// Transition row mode, see ImageSetEdgeRows()
+static int EdgeRows = 0;
+
 // This module follows "design-by-contract" principles.
 // Read `Design-by-Contract.md` for more details.
 
@@ -88,1026 +275,6147 @@ void ImageInit(void)
   InstrName[1] = "numruns";  // InstrCount[1] will count the number of runs in an image
   InstrName[2] = "memspace"; // InstrCount[2] will keep track of memory space an image ocuppies
   InstrName[3] = "numops";   // InstrCount[3] will keep track of pixelwise operations in ImageAND()
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  ImageSetThreads(cpus > 0 ? (int)cpus : 1);
 }
 
+// The counters of the calling thread:
+// InstrCount for the thread(s) of the program, and a private array
+// for each pool thread, which is added to InstrCount after each job.
+static _Thread_local unsigned long *Counters = InstrCount;
+
 // Macros to simplify accessing instrumentation counters:
-#define PIXMEM InstrCount[0]
+#define PIXMEM Counters[0]
 // Add more macros here...
-#define NUMRUNS InstrCount[1]
-#define MEMSPACE InstrCount[2]
-#define NUMOPS InstrCount[3]
+#define NUMRUNS Counters[1]
+#define MEMSPACE Counters[2]
+#define NUMOPS Counters[3]
 
 // TIP: Search for PIXMEM or InstrCount to see where it is incremented!
 
-/// Auxiliary (static) functions
+/// Row interning (hash-consing).
+/// When enabled, every image built afterwards stores each distinct row
+/// only once, and repeated rows refer to that single copy.
+void ImageSetRowInterning(int enable)
+{ ///
+  InternRows = (enable != 0);
+}
 
-/// Create the header of an image data structure
-/// And allocate the array of pointers to RLE rows
-static Image AllocateImageHeader(uint32 width, uint32 height)
-{
-  assert(width > 0 && height > 0);
-  Image newHeader = malloc(sizeof(struct image));
-  check(newHeader != NULL, "malloc");
+/// Memory-mapped loading.
+/// When enabled, ImageLoad maps regular files and decodes the rows
+/// straight from the mapping; otherwise, it reads them with stdio.
+void ImageSetMappedLoad(int enable)
+{ ///
+  MappedLoad = (enable != 0);
+}
 
-  newHeader->width = width;
-  newHeader->height = height;
+/// Row-parallel execution.
+/// Sets the number of threads that operations split their rows across
+/// (n <= 1: all operations run on the calling thread).
+void ImageSetThreads(int n)
+{ ///
+  Threads = n < 1 ? 1 : n > MAX_THREADS ? MAX_THREADS : n;
+}
 
-  // Allocating the array of pointers to RLE rows
-  newHeader->row = malloc(height * sizeof(int *));
-  check(newHeader->row != NULL, "malloc");
+/// Block pooling.
+/// When enabled, the memory blocks of destroyed images are kept for the
+/// images built afterwards; otherwise, they are freed right away.
+void ImageSetPooling(int enable)
+{ ///
+  Pooling = (enable != 0);
+  if (!Pooling)
+  {
+    ImageTrimPool();
+  }
+}
 
-  return newHeader;
+/// Vertical spans.
+/// When enabled, a row equal to the row above it shares its runs, and
+/// the row table of each image built afterwards stores each span of equal
+/// rows as a single entry (when that saves space); operations then compute
+/// each span once.
+void ImageSetRowSpans(int enable)
+{ ///
+  RowSpans = (enable != 0);
 }
 
-/// Allocate an array to store a RLE row with n elements
-static int *AllocateRLERowArray(uint32 n)
-{
-  assert(n > 2);
-  int *newArray = malloc(n * sizeof(int));
-  check(newArray != NULL, "malloc");
+/// Bitset rows.
+/// When enabled, the rows of the images built afterwards whose runs would
+/// take more space than their pixels are stored as bitsets; otherwise,
+/// all new rows are stored as runs.
+void ImageSetBitsetRows(int enable)
+{ ///
+  BitsetRows = (enable != 0);
+}
 
-  return newArray;
+/// Transition rows.
+/// When enabled, the rows of the images built afterwards that are not
+/// stored as bitsets are stored by the ends of their runs (the positions of
+/// their color transitions) instead of their lengths.
+void ImageSetEdgeRows(int enable)
+{ ///
+  EdgeRows = (enable != 0);
 }
 
-/// Compute the number of runs of a non-compressed (RAW) image row
-static uint32 GetNumRunsInRAWRow(uint32 image_width, const uint8 *RAW_row)
+/// Thread pool
+
+// Row-parallel operations split the rows [0, n) across W workers:
+// the calling thread (worker 0) and W-1 persistent pool threads.
+// Each worker starts with an equal slice of the rows and takes chunks of
+// `grain` rows from its front; a worker whose slice is empty steals the
+// upper half of the slice of another worker. (Rows have very different
+// costs, so equal slices alone would leave workers idle.)
+// Each slice is a (lo, hi) pair, packed in an atomic 64-bit word.
+
+// Function run on a range of rows [lo, hi) by worker w
+typedef void (*RangeFn)(void *ctx, uint32 lo, uint32 hi, int w);
+
+// Minimum number of rows for each worker
+#define MIN_ROWS_PER_WORKER 64
+
+static struct
 {
-  assert(image_width > 0);
-  assert(RAW_row != NULL);
+  pthread_mutex_t lock;
+  pthread_cond_t wake;     // a new job was posted
+  pthread_cond_t done;     // the pool threads finished the job
+  int started;             // pool threads created so far
+  unsigned long job;       // number of jobs posted
+  int workers;             // workers in the current job (with the caller)
+  int pending;             // pool threads still working on the current job
+  RangeFn fn;              // the current job
+  void *ctx;
+  uint32 grain;
+  _Atomic uint64 slice[MAX_THREADS]; // rows left to each worker: lo | hi << 32
+} Pool = {.lock = PTHREAD_MUTEX_INITIALIZER,
+          .wake = PTHREAD_COND_INITIALIZER,
+          .done = PTHREAD_COND_INITIALIZER};
+
+static inline uint64 PackSlice(uint32 lo, uint32 hi)
+{
+  return lo | (uint64)hi << 32;
+}
 
-  // How many runs?
-  uint32 num_runs = 1;
-  for (uint32 i = 1; i < image_width; i++)
+/// Run the current job, as worker w, until no rows are left anywhere
+static void RunWorker(int w)
+{
+  uint32 grain = Pool.grain;
+  for (;;)
   {
-    if (RAW_row[i] != RAW_row[i - 1])
+    // Take a chunk from the front of the own slice
+    uint64 s = atomic_load(&Pool.slice[w]);
+    uint32 lo = (uint32)s, hi = (uint32)(s >> 32);
+    if (lo < hi)
+    {
+      uint32 end = (hi - lo > grain) ? lo + grain : hi;
+      if (atomic_compare_exchange_weak(&Pool.slice[w], &s, PackSlice(end, hi)))
+      {
+        Pool.fn(Pool.ctx, lo, end, w);
+      }
+      continue;
+    }
+
+    // Steal the upper half of the slice of another worker
+    int stolen = 0;
+    for (int k = 1; k < Pool.workers && !stolen; k++)
+    {
+      int v = (w + k) % Pool.workers;
+      uint64 t = atomic_load(&Pool.slice[v]);
+      uint32 vlo = (uint32)t, vhi = (uint32)(t >> 32);
+      while (vlo < vhi && !stolen)
+      {
+        uint32 mid = vlo + (vhi - vlo) / 2; // the victim keeps [vlo, mid)
+        if (atomic_compare_exchange_weak(&Pool.slice[v], &t, PackSlice(vlo, mid)))
+        {
+          atomic_store(&Pool.slice[w], PackSlice(mid, vhi));
+          stolen = 1;
+        }
+        vlo = (uint32)t;
+        vhi = (uint32)(t >> 32);
+      }
+    }
+    if (!stolen)
     {
-      num_runs++;
+      return; // all rows were taken
     }
   }
-
-  return num_runs;
 }
 
-/// Get the number of runs of a compressed RLE image row
-static uint32 GetNumRunsInRLERow(const int *RLE_row)
+/// Body of a pool thread
+static void *PoolThread(void *arg)
 {
-  assert(RLE_row != NULL);
-
-  // Go through the RLE_row until EOR is found
-  // Discard RLE_row[0], since it is a pixel color
-
-  uint32 num_runs = 0;
-  uint32 i = 1;
-  while (RLE_row[i] != EOR)
+  int w = (int)(intptr_t)arg;
+  unsigned long counters[NUMCOUNTERS] = {0};
+  Counters = counters;
+
+  // A thread is created while its first job is being posted (which it
+  // must join), and that job cannot end before the thread takes the lock.
+  pthread_mutex_lock(&Pool.lock);
+  unsigned long job = Pool.job - 1;
+  for (;;)
   {
-    num_runs++;
-    i++;
-  }
+    while (Pool.job == job)
+    {
+      pthread_cond_wait(&Pool.wake, &Pool.lock);
+    }
+    job = Pool.job;
+    if (w >= Pool.workers)
+    {
+      continue; // not needed for this job
+    }
+    pthread_mutex_unlock(&Pool.lock);
+    RunWorker(w);
+    pthread_mutex_lock(&Pool.lock);
 
-  return num_runs;
+    // Aggregate the counters of this thread
+    for (int c = 0; c < NUMCOUNTERS; c++)
+    {
+      InstrCount[c] += counters[c];
+      counters[c] = 0;
+    }
+    if (--Pool.pending == 0)
+    {
+      pthread_cond_signal(&Pool.done);
+    }
+  }
+  return NULL;
 }
 
-/// Get the number of elements of an array storing a compressed RLE image row
-static uint32 GetSizeRLERowArray(const int *RLE_row)
+/// Number of workers to use for an operation on n rows
+/// (Builders that intern rows share a single dictionary: they run serially.)
+static int PlanWorkers(uint32 n)
 {
-  assert(RLE_row != NULL);
-
-  // Go through the array until EOR is found
-  uint32 i = 0;
-  while (RLE_row[i] != EOR)
+  uint32 w = n / MIN_ROWS_PER_WORKER;
+  if (InternRows || w < 2)
   {
-    i++;
+    return 1;
   }
-
-  return (i + 1);
+  return (w < (uint32)Threads) ? (int)w : Threads;
 }
 
-/// Compress into RLE format a RAW image row
-/// Allocates and returns the array storing the image row in RLE format
-static int *CompressRow(uint32 image_width, const uint8 *RAW_row)
+/// Run fn over the rows [0, n), split across the given number of workers
+/// (from PlanWorkers); returns when all rows were processed.
+static void ParallelFor(uint32 n, int workers, RangeFn fn, void *ctx)
 {
-  assert(image_width > 0);
-  assert(RAW_row != NULL);
+  if (workers <= 1)
+  {
+    fn(ctx, 0, n, 0);
+    return;
+  }
 
-  // How many runs?
-  uint32 num_runs = GetNumRunsInRAWRow(image_width, RAW_row);
+  pthread_mutex_lock(&Pool.lock);
+  while (Pool.started < workers - 1)
+  {
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, PoolThread,
+                             (void *)(intptr_t)(Pool.started + 1));
+    errno = err;
+    check(err == 0, "pthread_create");
+    pthread_detach(thread);
+    Pool.started++;
+  }
+  Pool.fn = fn;
+  Pool.ctx = ctx;
+  Pool.workers = workers;
+  Pool.grain = n / (32 * workers) + 1; // small chunks, to balance the load
+  for (int w = 0; w < workers; w++)
+  {
+    uint32 lo = (uint32)((uint64)n * w / workers);
+    uint32 hi = (uint32)((uint64)n * (w + 1) / workers);
+    atomic_store(&Pool.slice[w], PackSlice(lo, hi));
+  }
+  Pool.pending = workers - 1;
+  Pool.job++;
+  pthread_cond_broadcast(&Pool.wake);
+  pthread_mutex_unlock(&Pool.lock);
+
+  // (While the pool threads add their counters to InstrCount,
+  // the caller counts in a private array too.)
+  unsigned long *shared = Counters;
+  unsigned long counters[NUMCOUNTERS] = {0};
+  Counters = counters;
+  RunWorker(0);
+  Counters = shared;
+
+  pthread_mutex_lock(&Pool.lock);
+  while (Pool.pending > 0)
+  {
+    pthread_cond_wait(&Pool.done, &Pool.lock);
+  }
+  pthread_mutex_unlock(&Pool.lock);
+  for (int c = 0; c < NUMCOUNTERS; c++)
+  {
+    Counters[c] += counters[c];
+  }
+}
 
-  // Allocate the RLE row array ->> could have used AllocateRLERowArray() function
-  int *RLE_row = malloc((num_runs + 2) * sizeof(int));
-  check(RLE_row != NULL, "malloc");
+/// Auxiliary (static) functions
 
-  // Go through the RAW_row
-  RLE_row[0] = (int)RAW_row[0]; // Initial pixel value
-  uint32 index = 1;
-  int num_pixels = 1;
-  for (uint32 i = 1; i < image_width; i++)
+/// Number of bytes needed to store runs of an image with the given width
+static uint8 RunSizeForWidth(uint32 width)
+{
+  if (width <= UINT8_MAX)
   {
-    if (RAW_row[i] != RAW_row[i - 1])
-    {
-      RLE_row[index++] = num_pixels;
-      num_pixels = 0;
-    }
-    num_pixels++;
-    NUMOPS++; // increment to account for the comparison made
+    return sizeof(uint8);
   }
-  RLE_row[index++] = num_pixels;
-  RLE_row[index] = EOR; // Reached the end of the row
-
-  return RLE_row;
+  if (width <= UINT16_MAX)
+  {
+    return sizeof(uint16);
+  }
+  return sizeof(uint32);
 }
 
-static uint8 *UncompressRow(uint32 image_width, const int *RLE_row)
+/// Get run k of an array of runs stored with run_size bytes each
+/// (When run_size is a constant, the switch is resolved at compile time.)
+static inline uint32 GetRun(const uint8 *runs, uint8 run_size, size_t k)
 {
-  assert(image_width > 0);
-  assert(RLE_row != NULL);
-
-  // The uncompressed row
-  uint8 *row = (uint8 *)malloc(image_width * sizeof(uint8));
-  check(row != NULL, "malloc");
-
-  // Go through the RLE_row until EOR is found
-  int pixel_value = RLE_row[0];
-  uint32 i = 1;
-  uint32 dest_i = 0;
-  while (RLE_row[i] != EOR)
+  switch (run_size)
   {
-    // For each run
-    for (int aux = 0; aux < RLE_row[i]; aux++)
-    {
-      row[dest_i++] = (uint8)pixel_value;
-      NUMOPS++; // increment to account for pixel assignments
-    }
-    // Next run
-    i++;
-    pixel_value ^= 1;
+  case sizeof(uint8):
+    return runs[k];
+  case sizeof(uint16):
+    return ((const uint16 *)runs)[k];
+  default:
+    return ((const uint32 *)runs)[k];
   }
-
-  return row;
 }
 
-// Add your auxiliary functions here...
-static uint32 lineIsEqual(int *line1, int *line2, uint32 size)
+/// Set run k of an array of runs stored with run_size bytes each
+static inline void SetRun(uint8 *runs, uint8 run_size, size_t k, uint32 len)
 {
-  for (uint32 i = 0; i < size; i++)
+  switch (run_size)
   {
-    if (line1[i] != line2[i])
-    {
-      return 1;
-    }
+  case sizeof(uint8):
+    runs[k] = (uint8)len;
+    break;
+  case sizeof(uint16):
+    ((uint16 *)runs)[k] = (uint16)len;
+    break;
+  default:
+    ((uint32 *)runs)[k] = len;
+    break;
   }
-  return 0;
 }
 
-// this version computes the logical operation AND between 2 encoded rows using RLE
-static int *rowAND(int *arr1, int *arr2, uint32 size)
+/// Copy n runs, converting them from src_size to dst_size bytes if needed
+static void CopyRuns(uint8 *dst, uint8 dst_size, const uint8 *src,
+                     uint8 src_size, size_t n)
 {
-  int *rslt = AllocateRLERowArray(size + 2); // allocate for worst case
-  uint32 index1 = 2, index2 = 2, rslt_index = 1;
-  int value1 = arr1[0];
-  int value2 = arr2[0];
-  int len1 = arr1[1];
-  int len2 = arr2[1];
-  int prev_value;
+  if (dst_size == src_size)
+  {
+    memcpy(dst, src, n * src_size);
+    return;
+  }
+  for (size_t k = 0; k < n; k++)
+  {
+    SetRun(dst, dst_size, k, GetRun(src, src_size, k));
+  }
+}
 
-  // calculate first pixel value of rslt
-  rslt[0] = value1 & value2;
+/// Turn n runs (stored with rs bytes each) into the ends of the runs,
+/// their prefix sums, in place
+static void RunsToEdges(uint8 *runs, uint8 rs, uint32 n)
+{
+  uint32 x = 0;
+  for (uint32 k = 0; k < n; k++)
+  {
+    x += GetRun(runs, rs, k);
+    SetRun(runs, rs, k, x);
+  }
+}
 
-  while (len1 > 0 && len2 > 0)
+/// Turn the ends of n runs (stored with rs bytes each) back into the runs,
+/// their differences, in place
+static void EdgesToRuns(uint8 *edges, uint8 rs, uint32 n)
+{
+  for (uint32 k = n; k-- > 1;)
   {
-    int newValue = value1 & value2;
-    NUMOPS++;
-    int minlen = (len1 < len2) ? len1 : len2;
+    SetRun(edges, rs, k, GetRun(edges, rs, k) - GetRun(edges, rs, k - 1));
+  }
+}
 
-    if (rslt_index == 1 || (newValue != prev_value))
+/// Find the first of n ascending ends of runs (stored with rs bytes each)
+/// that is past pixel x, by binary search
+/// Returns its index, or n if there is none.
+static uint32 FindEdge(const uint8 *edges, uint8 rs, uint32 n, uint32 x)
+{
+  uint32 lo = 0, hi = n;
+  while (lo < hi)
+  {
+    uint32 mid = lo + (hi - lo) / 2;
+    if (GetRun(edges, rs, mid) > x)
     {
-      // append new run only if different from the last run
-      rslt[rslt_index++] = minlen;
-      // comparison between 2 pixel values -> increment NUMOPS
-      NUMOPS++;
+      hi = mid;
     }
     else
     {
-      // extend the last run if equal to last run
-      rslt[rslt_index - 1] += minlen;
-      // comparison between 2 pixel values -> increment NUMOPS
-      NUMOPS++;
+      lo = mid + 1;
     }
+  }
+  return lo;
+}
 
-    // update lengths
-    len1 -= minlen;
-    len2 -= minlen;
+/// Hash n bytes (64-bit multiply-xorshift, processing 8 bytes at a time)
+static uint64 HashBytes(const uint8 *bytes, size_t n, uint64 seed)
+{
+  const uint64 m = 0x9E3779B97F4A7C15ull;
+  uint64 h = seed ^ (n * m);
+  size_t k = 0;
+  for (; k + 8 <= n; k += 8)
+  {
+    uint64 word;
+    memcpy(&word, bytes + k, 8);
+    h = (h ^ word) * m;
+    h ^= h >> 29;
+  }
+  uint64 tail = 0;
+  memcpy(&tail, bytes + k, n - k);
+  h = (h ^ tail) * m;
+  return h ^ (h >> 32);
+}
 
-    // if one run is exhausted, move to the next
-    if (len1 == 0 && arr1[index1] != EOR)
-    {
-      value1 ^= 1;
-      NUMOPS++; // pixel value toggle
-      len1 = arr1[index1++];
-    }
-    if (len2 == 0 && arr2[index2] != EOR)
-    {
-      value2 ^= 1;
-      NUMOPS++; // pixel value toggle
-      len2 = arr2[index2++];
-    }
+/// Allocate a row dictionary with room for (at least) n rows
+static struct rowdict *AllocateRowDict(uint32 n)
+{
+  struct rowdict *d = malloc(sizeof(struct rowdict));
+  check(d != NULL, "malloc");
 
-    prev_value = newValue;
+  // Keep the load factor at most 1/2, so probe sequences are short
+  size_t size = 4;
+  while (size < 2 * (size_t)n)
+  {
+    size *= 2;
+  }
+  d->mask = size - 1;
+  d->count = 0;
+  d->hash = malloc(size * sizeof(uint64));
+  d->row = malloc(size * sizeof(uint32));
+  check(d->hash != NULL && d->row != NULL, "malloc");
+  for (size_t k = 0; k < size; k++)
+  {
+    d->row[k] = NO_ROW;
   }
+  return d;
+}
 
-  rslt[rslt_index++] = EOR;
+static void DestroyRowDict(struct rowdict *d)
+{
+  free(d->hash);
+  free(d->row);
+  free(d);
+}
 
-  // resize the result array to match its actual size
-  int *temp = realloc(rslt, rslt_index * sizeof(int));
-  assert(rslt != NULL);
-  rslt = temp; // to make sure rslt is not overwritten if realloc fails
+/// Get the next row stored with the given hash.
+/// *pos is the probe position, which must start at (hash & d->mask).
+/// Returns NO_ROW when no more rows with that hash exist.
+static uint32 RowDictNext(const struct rowdict *d, uint64 hash, size_t *pos)
+{
+  while (d->row[*pos] != NO_ROW)
+  {
+    size_t k = *pos;
+    *pos = (k + 1) & d->mask; // linear probing
+    if (d->hash[k] == hash)
+    {
+      return d->row[k];
+    }
+  }
+  return NO_ROW;
+}
 
-  return rslt;
+/// Store row with the given hash at probe position pos,
+/// the position where RowDictNext stopped returning rows.
+static void RowDictInsert(struct rowdict *d, uint64 hash, size_t pos, uint32 row)
+{
+  assert(d->row[pos] == NO_ROW);
+  d->hash[pos] = hash;
+  d->row[pos] = row;
+  d->count++;
 }
 
-// this version computes the logical OR operation directly into RLE compressed rows
-static int *rowOR(int *arr1, int *arr2, uint32 size)
+/// Is the dictionary at its maximum load factor (1/2)?
+/// (Then no more rows should be inserted.)
+static int RowDictIsFull(const struct rowdict *d)
 {
-  int *rslt = AllocateRLERowArray(size + 2); // allocate for worst case
-  uint32 index1 = 2, index2 = 2, rslt_index = 1;
-  int value1 = arr1[0];
-  int value2 = arr2[0];
-  int len1 = arr1[1];
-  int len2 = arr2[1];
-  int prev_value;
+  return 2 * (d->count + 1) > d->mask + 1;
+}
 
-  // calculate first pixel value of rslt
-  rslt[0] = value1 | value2;
+// Scratch dictionaries, one for each worker, kept from call to call
+// (so operations repeated on images of the same size allocate no tables)
+static struct rowdict *Scratch[MAX_THREADS];
 
-  while (len1 > 0 && len2 > 0)
+/// Get the (empty) scratch dictionary of worker w,
+/// with room for (at least) n rows
+static struct rowdict *ScratchRowDict(int w, uint32 n)
+{
+  struct rowdict *d = Scratch[w];
+  if (d == NULL || 2 * (size_t)n > d->mask + 1)
   {
-    int newValue = value1 | value2;
-    int minlen = (len1 < len2) ? len1 : len2;
-
-    if (rslt_index == 1 || (newValue != prev_value))
+    if (d != NULL)
     {
-      // append new run only if different from the last run
-      rslt[rslt_index++] = minlen;
+      DestroyRowDict(d);
     }
-    else
+    d = Scratch[w] = AllocateRowDict(n);
+    return d;
+  }
+  if (d->count > 0)
+  {
+    for (size_t k = 0; k <= d->mask; k++)
     {
-      // extend the last run if equal to last run
-      rslt[rslt_index - 1] += minlen;
+      d->row[k] = NO_ROW;
     }
+    d->count = 0;
+  }
+  return d;
+}
 
-    // update lengths
-    len1 -= minlen;
-    len2 -= minlen;
+/// Bitset rows
 
-    // if one run is exhausted, move to the next
-    if (len1 == 0 && arr1[index1] != EOR)
-    {
-      value1 ^= 1;
-      len1 = arr1[index1++];
-    }
-    if (len2 == 0 && arr2[index2] != EOR)
-    {
-      value2 ^= 1;
-      len2 = arr2[index2++];
-    }
+// Scratch row buffers of each worker, kept from call to call (like the
+// scratch dictionaries): the runs decoded from a bitset row and the bitset
+// built from a row of runs, for each of two operands, a result bitset,
+// and the rows merged by the morphology operations
+enum rowbuffer
+{
+  RUNS_BUFFER = 0, // (and RUNS_BUFFER + 1)
+  BITS_BUFFER = 2, // (and BITS_BUFFER + 1)
+  RSLT_BUFFER = 4,
+  MORPH_BUFFER = 5, // (and MORPH_BUFFER + 1)
+  ROW_BUFFERS = 7
+};
+static uint8 *RowBuffer[MAX_THREADS][ROW_BUFFERS];
+static size_t RowBufferSize[MAX_THREADS][ROW_BUFFERS];
 
-    prev_value = newValue;
+/// Get scratch row buffer b of worker w, with room for (at least) n bytes
+static uint8 *ScratchRowBuffer(int w, int b, size_t n)
+{
+  if (RowBufferSize[w][b] < n)
+  {
+    free(RowBuffer[w][b]);
+    RowBuffer[w][b] = malloc(n);
+    check(RowBuffer[w][b] != NULL, "malloc");
+    RowBufferSize[w][b] = n;
   }
+  return RowBuffer[w][b];
+}
 
-  rslt[rslt_index++] = EOR;
+/// Number of 64-bit words of a bitset row of the given width
+static inline uint32 BitsWords(uint32 width)
+{
+  return (width + 64 - 1) / 64;
+}
 
-  // resize the result array to match its actual size
-  int *temp = realloc(rslt, rslt_index * sizeof(int));
-  assert(rslt != NULL);
-  rslt = temp; // to make sure rslt is not overwritten if realloc fails
+/// Number of run-sized units taken by a bitset row of an image
+static inline uint32 BitsUnits(const Image img)
+{
+  return BitsWords(img->width) * 8 / img->run_size;
+}
 
-  return rslt;
+/// Is a new row of an image with num_runs runs stored as a bitset?
+/// (Yes, if its runs would take more space than its bitset.)
+static inline int IsDenseRow(const Image img, uint32 num_runs)
+{
+  return BitsetRows && num_runs > BitsUnits(img);
+}
+
+/// Number of run-sized units taken by a row of an image, given its
+/// descriptor
+static inline uint32 GetRowUnits(const Image img, struct rowinfo row)
+{
+  return row.form == ROW_BITS ? BitsUnits(img) : row.num_runs;
 }
 
-// this version computes the logical OR operation directly into RLE compressed rows
-static int *rowXOR(int *arr1, int *arr2, uint32 size)
+/// Load 8 bytes of a packed (PBM) row as a 64-bit word
+/// whose most significant bit is the first pixel
+static inline uint64 LoadPackedWord(const uint8 *bytes)
 {
-  int *rslt = AllocateRLERowArray(size + 2); // allocate for worst case
-  uint32 index1 = 2, index2 = 2, rslt_index = 1;
-  int value1 = arr1[0];
-  int value2 = arr2[0];
-  int len1 = arr1[1];
-  int len2 = arr2[1];
-  int prev_value;
+  uint64 word;
+  memcpy(&word, bytes, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  word = __builtin_bswap64(word);
+#endif
+  return word;
+}
 
-  // calculate first pixel value of rslt
-  rslt[0] = value1 ^ value2;
+/// Store a 64-bit word whose most significant bit is the first pixel
+/// as 8 bytes of a packed (PBM) row
+static inline void StorePackedWord(uint8 *bytes, uint64 word)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  word = __builtin_bswap64(word);
+#endif
+  memcpy(bytes, &word, sizeof(word));
+}
 
-  while (len1 > 0 && len2 > 0)
+/// Set the pixels [x, end) of a packed (PBM) row
+/// The bytes in between are filled whole, with memset, and only
+/// the bytes at the ends are masked.
+static inline void SetPackedPixels(uint8 *bytes, uint32 x, uint32 end)
+{
+  assert(x < end);
+  uint32 first = x / 8;
+  uint32 last = (end - 1) / 8;
+  uint8 head = 0xFF >> (x % 8);
+  uint8 tail = 0xFF << (7 - (end - 1) % 8);
+  if (first == last)
+  {
+    bytes[first] |= head & tail;
+  }
+  else
   {
-    int newValue = value1 ^ value2;
-    int minlen = (len1 < len2) ? len1 : len2;
+    bytes[first] |= head;
+    memset(bytes + first + 1, 0xFF, last - first - 1);
+    bytes[last] |= tail;
+  }
+}
 
-    if (rslt_index == 1 || (newValue != prev_value))
+/// Find the runs of a packed (PBM) row of the given width
+/// The run boundaries are found directly in the packed bits, one 64-bit word
+/// at a time: a bit of (word ^ (word >> 1)) is set where the pixel differs
+/// from its left neighbour, and those bits are scanned with clz.
+/// bytes is read in whole 64-bit words (the bits after the width are
+/// ignored), and runs must have room for a run per pixel.
+/// Returns the number of runs written, or 0 as soon as more than max_runs
+/// runs are found.
+static uint32 PackedRowRuns(const uint8 *bytes, uint32 width, uint8 *runs,
+                            uint8 rs, uint32 max_runs)
+{
+  uint64 prev = bytes[0] >> 7; // the pixel before the first one has its color
+  uint32 index = 0;
+  uint32 start = 0; // first pixel of the current run
+  for (uint32 base = 0; base < width; base += 64)
+  {
+    uint64 word = LoadPackedWord(bytes + base / 8);
+    uint64 edges = word ^ (word >> 1 | prev << 63);
+    prev = word & 1;
+    if (width - base < 64)
     {
-      // append new run only if different from the last run
-      rslt[rslt_index++] = minlen;
+      edges &= ~(~(uint64)0 >> (width - base)); // ignore the padding
     }
-    else
+    while (edges != 0)
     {
-      // extend the last run if equal to last run
-      rslt[rslt_index - 1] += minlen;
+      uint32 x = base + __builtin_clzll(edges);
+      SetRun(runs, rs, index++, x - start);
+      start = x;
+      edges ^= (uint64)1 << 63 >> (x - base); // clear that boundary
     }
-
-    // update lengths
-    len1 -= minlen;
-    len2 -= minlen;
-
-    // if one run is exhausted, move to the next
-    if (len1 == 0 && arr1[index1] != EOR)
+    NUMOPS++; // increment to account for the word processed
+    if (index >= max_runs)
     {
-      value1 ^= 1;
-      len1 = arr1[index1++];
+      return 0; // (the last run is still open)
     }
-    if (len2 == 0 && arr2[index2] != EOR)
+  }
+  SetRun(runs, rs, index++, width - start); // Reached the end of the row
+  return index;
+}
+
+/// Build the bitset of a row of n runs (read backwards if rev) of the given
+/// width: the bits of the pixels that differ from the first one are set
+static void EncodeBitsRow(const uint8 *runs, uint32 n, uint8 rs, int rev,
+                          uint32 width, uint8 *bits)
+{
+  memset(bits, 0, BitsWords(width) * 8);
+  uint32 x = 0;
+  for (uint32 k = 0; k < n; k++)
+  {
+    uint32 len = GetRun(runs, rs, rev ? n - 1 - k : k);
+    if (k % 2 == 1)
     {
-      value2 ^= 1;
-      len2 = arr2[index2++];
+      SetPackedPixels(bits, x, x + len);
     }
-
-    prev_value = newValue;
+    x += len;
   }
+  NUMOPS += n;
+}
 
-  rslt[rslt_index++] = EOR;
+// The word kernels are written once, and compiled for each instruction set
+// by the target-specific functions below (chosen at run time).
+#define WORD_KERNEL static inline __attribute__((always_inline))
 
-  // resize the result array to match its actual size
-  int *temp = realloc(rslt, rslt_index * sizeof(int));
-  assert(rslt != NULL);
-  rslt = temp; // to make sure rslt is not overwritten if realloc fails
+// Count the runs of a bitset row of the given width: one more than the
+// number of pixels that differ from their left neighbour
+WORD_KERNEL uint32 CountBitsRunsKernel(const uint8 *bits, uint32 width)
+{
+  uint32 words = BitsWords(width);
+  uint32 n = 1;
+  uint64 prev = 0; // (the first bit is 0)
+  for (uint32 k = 0; k < words; k++)
+  {
+    uint64 word = LoadPackedWord(bits + 8 * k);
+    n += __builtin_popcountll(word ^ (word >> 1 | prev << 63));
+    prev = word & 1;
+  }
+  if (width % 64 != 0)
+  {
+    // (a BLACK last bit differs from the padding after it)
+    n -= (bits[(width - 1) / 8] >> (7 - (width - 1) % 8)) & 1;
+  }
+  return n;
+}
 
-  return rslt;
+// Combine the words [k, words) of bitsets a and b into r: the result bit
+// for bits (x, y) is set where the mask m[2*x + y] is (m[0] must be 0)
+WORD_KERNEL void BitsBoolOpKernel(const uint8 *a, const uint8 *b, uint8 *r,
+                                  uint32 k, uint32 words, const uint64 m[4])
+{
+  for (; k < words; k++)
+  {
+    uint64 x, y;
+    memcpy(&x, a + 8 * k, 8);
+    memcpy(&y, b + 8 * k, 8);
+    uint64 z = (~x & y & m[1]) | (x & ~y & m[2]) | (x & y & m[3]);
+    memcpy(r + 8 * k, &z, 8);
+  }
 }
 
-/// Image management functions
+// Count the bits set in bitsets a and b of a row of the given width, and
+// in both: n[0] = |a|, n[1] = |b|, n[2] = |a & b| (b may be NULL: then
+// only n[0] is counted)
+WORD_KERNEL void CountBitsSetKernel(const uint8 *a, const uint8 *b,
+                                    uint32 width, uint32 n[3])
+{
+  uint32 words = BitsWords(width);
+  n[0] = n[1] = n[2] = 0;
+  for (uint32 k = 0; k < words; k++)
+  {
+    uint64 x, y;
+    memcpy(&x, a + 8 * k, 8);
+    n[0] += __builtin_popcountll(x);
+    if (b != NULL)
+    {
+      memcpy(&y, b + 8 * k, 8);
+      n[1] += __builtin_popcountll(y);
+      n[2] += __builtin_popcountll(x & y);
+    }
+  }
+}
 
-/// Create a new BW image, either BLACK or WHITE.
-///   width, height : the dimensions of the new image.
-///   val: the pixel color (BLACK or WHITE).
-/// Requires: width and height must be non-negative, val is either BLACK or
-/// WHITE.
-///
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-Image ImageCreate(uint32 width, uint32 height, uint8 val)
+#ifdef __x86_64__
+__attribute__((target("popcnt"))) static uint32
+CountBitsRunsPOPCNT(const uint8 *bits, uint32 width)
 {
-  assert(width > 0 && height > 0);
-  assert(val == WHITE || val == BLACK);
+  return CountBitsRunsKernel(bits, width);
+}
 
-  Image newImage = AllocateImageHeader(width, height);
+__attribute__((target("popcnt"))) static void
+CountBitsSetPOPCNT(const uint8 *a, const uint8 *b, uint32 width, uint32 n[3])
+{
+  CountBitsSetKernel(a, b, width, n);
+}
 
-  // All image pixels have the same value
-  int pixel_value = (int)val;
+__attribute__((target("popcnt"))) static uint32
+BitsBoolOpSSE2(const uint8 *a, const uint8 *b, uint8 *r, uint32 width,
+               const uint64 m[4])
+{
+  uint32 words = BitsWords(width);
+  uint32 k = 0;
+  __m128i m1 = _mm_set1_epi64x((long long)m[1]);
+  __m128i m2 = _mm_set1_epi64x((long long)m[2]);
+  __m128i m3 = _mm_set1_epi64x((long long)m[3]);
+  for (; k + 2 <= words; k += 2)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i *)(a + 8 * k));
+    __m128i y = _mm_loadu_si128((const __m128i *)(b + 8 * k));
+    __m128i z = _mm_or_si128(
+        _mm_or_si128(_mm_and_si128(_mm_andnot_si128(x, y), m1),
+                     _mm_and_si128(_mm_andnot_si128(y, x), m2)),
+        _mm_and_si128(_mm_and_si128(x, y), m3));
+    _mm_storeu_si128((__m128i *)(r + 8 * k), z);
+  }
+  BitsBoolOpKernel(a, b, r, k, words, m);
+  return CountBitsRunsKernel(r, width);
+}
 
-  // Creating the image rows, each row has just 1 run of pixels
-  // Each row is represented by an array of 3 elements [value,length,EOR]
-  for (uint32 i = 0; i < height; i++)
+__attribute__((target("avx2,popcnt"))) static uint32
+BitsBoolOpAVX2(const uint8 *a, const uint8 *b, uint8 *r, uint32 width,
+               const uint64 m[4])
+{
+  uint32 words = BitsWords(width);
+  uint32 k = 0;
+  __m256i m1 = _mm256_set1_epi64x((long long)m[1]);
+  __m256i m2 = _mm256_set1_epi64x((long long)m[2]);
+  __m256i m3 = _mm256_set1_epi64x((long long)m[3]);
+  for (; k + 4 <= words; k += 4)
   {
-    newImage->row[i] = AllocateRLERowArray(3);
-    newImage->row[i][0] = pixel_value;
-    newImage->row[i][1] = (int)width;
-    newImage->row[i][2] = EOR;
+    __m256i x = _mm256_loadu_si256((const __m256i *)(a + 8 * k));
+    __m256i y = _mm256_loadu_si256((const __m256i *)(b + 8 * k));
+    __m256i z = _mm256_or_si256(
+        _mm256_or_si256(_mm256_and_si256(_mm256_andnot_si256(x, y), m1),
+                        _mm256_and_si256(_mm256_andnot_si256(y, x), m2)),
+        _mm256_and_si256(_mm256_and_si256(x, y), m3));
+    _mm256_storeu_si256((__m256i *)(r + 8 * k), z);
   }
+  BitsBoolOpKernel(a, b, r, k, words, m);
+  return CountBitsRunsKernel(r, width);
+}
+#endif
 
-  return newImage;
+/// Count the runs of a bitset row of the given width
+static uint32 CountBitsRuns(const uint8 *bits, uint32 width)
+{
+#ifdef __x86_64__
+  if (__builtin_cpu_supports("popcnt"))
+  {
+    return CountBitsRunsPOPCNT(bits, width);
+  }
+#endif
+  return CountBitsRunsKernel(bits, width);
 }
 
-/// Create a new BW image, with a perfect CHESSBOARD pattern.
-///   width, height : the dimensions of the new image.
-///   square_edge : the lenght of the edges of the sqares making up the
-///   chessboard pattern.
-///   first_value: the pixel color (BLACK or WHITE) of the
-///   first image pixel.
-/// Requires: width and height must be non-negative, val is either BLACK or
-/// WHITE.
-/// Requires: for the squares, width and height must be multiples of the
-/// edge lenght of the squares
-///
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-Image ImageCreateChessboard(uint32 width, uint32 height, uint32 square_edge,
-                            uint8 first_value)
+/// Count the bits set in bitsets a and b of a row of the given width, and
+/// in both (see CountBitsSetKernel)
+static void CountBitsSet(const uint8 *a, const uint8 *b, uint32 width,
+                         uint32 n[3])
 {
-  assert(width > 0 && height > 0);
-  assert(first_value == WHITE || first_value == BLACK);
-  // assert(width % square_edge == 0 && height % square_edge == 0);
-
-  Image newImage = AllocateImageHeader(width, height);
-
-  // number of rows considering the squares as base measurement
-  uint32 n_square_cols = (width + square_edge - 1) / square_edge; // ceiling division to account for images where width is not multiple of square_edge
-  int pixel_value = (int)first_value;
-
-  // fill up the rows
-  for (uint32 i = 0; i < height; i++)
+  NUMOPS += BitsWords(width);
+#ifdef __x86_64__
+  if (__builtin_cpu_supports("popcnt"))
   {
-    newImage->row[i] = AllocateRLERowArray(2 + n_square_cols);
-    MEMSPACE += (2 + n_square_cols) * sizeof(int);
-
-    newImage->row[i][0] = pixel_value;
-
-    // fill up runs
-    for (uint8 k = 1; k <= n_square_cols; k++)
-    {
-
-      uint32 runlen;
-      if (k == n_square_cols && width % square_edge != 0)
-      {
-        runlen = width % square_edge;
-      }
-      else
-      {
-        runlen = square_edge;
-      }
-
-      newImage->row[i][k] = runlen;
-      NUMRUNS++; // incrememnt number of runs in image
-    }
-
-    newImage->row[i][1 + n_square_cols] = EOR; // 2 + n_cols - 1
+    CountBitsSetPOPCNT(a, b, width, n);
+    return;
+  }
+#endif
+  CountBitsSetKernel(a, b, width, n);
+}
 
-    // if i is multiple of square_edge -> toggle pixel_value
-    if ((i + 1) % square_edge == 0) // i+1 to avoid toggling when i = 0;
+/// Combine the bitsets a and b of a row of the given width into r, a word
+/// at a time: the result bit for bits (x, y) is set where the mask
+/// m[2*x + y] is (m[0] must be 0, so the padding stays 0)
+/// Returns the number of runs of r.
+static uint32 BitsBoolOp(const uint8 *a, const uint8 *b, uint8 *r,
+                         uint32 width, const uint64 m[4])
+{
+  assert(m[0] == 0);
+  NUMOPS += BitsWords(width);
+#ifdef __x86_64__
+  if (__builtin_cpu_supports("popcnt"))
+  {
+    if (__builtin_cpu_supports("avx2"))
     {
-      pixel_value ^= 1;
+      return BitsBoolOpAVX2(a, b, r, width, m);
     }
+    return BitsBoolOpSSE2(a, b, r, width, m); // (SSE2 is in every x86-64)
   }
-
-  return newImage;
+#endif
+  BitsBoolOpKernel(a, b, r, 0, BitsWords(width), m);
+  return CountBitsRunsKernel(r, width);
 }
 
-/// Destroy the image pointed to by (*imgp).
-///   imgp : address of an Image variable.
-/// If (*imgp)==NULL, no operation is performed.
-/// Ensures: (*imgp)==NULL.
-/// Should never fail.
-void ImageDestroy(Image *imgp)
+/// Block pool
+
+// Images are built and destroyed all the time (e.g., the temporaries of
+// an expression), and so are their memory blocks: headers, row tables,
+// arena lists, arenas and runs.
+// Instead of going back to malloc, freed blocks are kept in free lists by
+// size class, and reused by the next blocks of the same class.
+// There are 4 classes per power of 2: 64, 80, 96, 112, 128, 160, 192, ...
+// bytes, so a block wastes less than 25% of its size.
+// Each thread caches a few small blocks of each class, taken and returned
+// without locking; the other freed blocks go to a shared pool, which holds
+// up to POOL_LIMIT bytes (beyond that, they are freed).
+// Blocks larger than the largest class are not pooled.
+
+#define NUM_CLASSES 80             // the largest class has 56 MiB
+#define LOCAL_BLOCKS 8             // blocks cached by a thread in each class
+#define LOCAL_MAX_SIZE (64 << 10)  // size of the largest blocks cached
+#define POOL_LIMIT ((size_t)256 << 20)
+
+// A free block starts with a link to the next one in its list
+struct freeblock
 {
-  assert(imgp != NULL);
+  struct freeblock *next;
+};
 
-  Image img = *imgp;
+// The blocks cached by the calling thread
+static _Thread_local struct
+{
+  struct freeblock *head;
+  uint32 count;
+} Cache[NUM_CLASSES];
 
-  for (uint32 i = 0; i < img->height; i++)
+// The shared pool
+static struct
+{
+  pthread_mutex_t lock;
+  struct freeblock *head[NUM_CLASSES];
+  size_t held; // bytes in the lists
+} Blocks = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Statistics, see ImageGetPoolStats()
+static _Atomic unsigned long PoolHits;
+static _Atomic unsigned long PoolMisses;
+static _Atomic size_t PoolHeld;
+
+/// Size of the blocks of class c
+static inline size_t ClassSize(int c)
+{
+  return (size_t)(4 + c % 4) << (c / 4 + 4);
+}
+
+/// Class of the smallest blocks with (at least) n bytes
+/// (n must not exceed the largest class)
+static inline int ClassOf(size_t n)
+{
+  if (n <= 64)
   {
-    free(img->row[i]);
+    return 0;
   }
-  free(img->row);
-  free(img);
-
-  *imgp = NULL;
+  int b = 63 - __builtin_clzll(n - 1); // 2^b < n <= 2^(b+1)
+  int q = (int)((n - 1) >> (b - 2)) - 3; // n <= (4 + q) * 2^(b-2), q in 1..4
+  return 4 * (b - 6) + q;
 }
 
-/// Printing on the console
-
-/// Output the raw BW image
-void ImageRAWPrint(const Image img)
+/// Size of the block that PoolAlloc gives for n bytes
+static size_t PoolBlockSize(size_t n)
 {
-  assert(img != NULL);
-
-  printf("width = %d height = %d\n", img->width, img->height);
-  printf("RAW image:\n");
+  if (n > ClassSize(NUM_CLASSES - 1))
+  {
+    return (n + 15) & ~(size_t)15;
+  }
+  return ClassSize(ClassOf(n));
+}
 
-  // Print the pixels of each image row
-  for (uint32 i = 0; i < img->height; i++)
+/// Allocate a block of (at least) *size bytes
+/// Sets *size to the size of the block (see PoolBlockSize).
+static void *PoolAlloc(size_t *size)
+{
+  *size = PoolBlockSize(*size);
+  struct freeblock *b = NULL;
+  if (*size <= ClassSize(NUM_CLASSES - 1))
   {
-    // The value of the first pixel in the current row
-    int pixel_value = img->row[i][0];
-    for (uint32 j = 1; img->row[i][j] != EOR; j++)
+    int c = ClassOf(*size);
+    b = Cache[c].head;
+    if (b != NULL)
     {
-      // Print the current run of pixels
-      for (int k = 0; k < img->row[i][j]; k++)
+      Cache[c].head = b->next;
+      Cache[c].count--;
+    }
+    else
+    {
+      pthread_mutex_lock(&Blocks.lock);
+      b = Blocks.head[c];
+      if (b != NULL)
       {
-        printf("%d", pixel_value);
+        Blocks.head[c] = b->next;
+        Blocks.held -= *size;
       }
-      // Switch (XOR) to the pixel value for the next run, if any
-      pixel_value ^= 1;
+      pthread_mutex_unlock(&Blocks.lock);
     }
-    // At current row end
-    printf("\n");
   }
-  printf("\n");
+  if (b != NULL)
+  {
+    PoolHits++;
+    PoolHeld -= *size;
+    return b;
+  }
+  PoolMisses++;
+  void *p = malloc(*size);
+  check(p != NULL, "malloc");
+  return p;
 }
 
-/// Output the compressed RLE image
-void ImageRLEPrint(const Image img)
+/// Free a block from PoolAlloc
+/// size may be the size requested for the block or its actual size.
+static void PoolFree(void *p, size_t size)
 {
-  assert(img != NULL);
-
-  printf("width = %d height = %d\n", img->width, img->height);
-  printf("RLE encoding:\n");
-
-  // Print the compressed rows information
-  for (uint32 i = 0; i < img->height; i++)
+  if (p == NULL)
   {
-    uint32 j;
-    for (j = 0; img->row[i][j] != EOR; j++)
-    {
-      printf("%d ", img->row[i][j]);
-    }
-    printf("%d\n", img->row[i][j]);
+    return;
   }
-  printf("\n");
+  if (!Pooling || size > ClassSize(NUM_CLASSES - 1))
+  {
+    free(p);
+    return;
+  }
+  int c = ClassOf(size);
+  size = ClassSize(c);
+  struct freeblock *b = p;
+  if (size <= LOCAL_MAX_SIZE && Cache[c].count < LOCAL_BLOCKS)
+  {
+    b->next = Cache[c].head;
+    Cache[c].head = b;
+    Cache[c].count++;
+    PoolHeld += size;
+    return;
+  }
+  pthread_mutex_lock(&Blocks.lock);
+  int kept = (Blocks.held + size <= POOL_LIMIT);
+  if (kept)
+  {
+    b->next = Blocks.head[c];
+    Blocks.head[c] = b;
+    Blocks.held += size;
+  }
+  pthread_mutex_unlock(&Blocks.lock);
+  if (kept)
+  {
+    PoolHeld += size;
+    return;
+  }
+  free(p);
 }
 
-/// PBM BW file operations
+/// Statistics of the block pool.
+/// Sets the number of blocks allocated from the pool (hits), and from
+/// malloc (misses), and the number of bytes it holds, since ImageInit.
+void ImageGetPoolStats(unsigned long *hits, unsigned long *misses, size_t *held)
+{ ///
+  *hits = PoolHits;
+  *misses = PoolMisses;
+  *held = PoolHeld;
+}
 
-// See PBM format specification: http://netpbm.sourceforge.net/doc/pbm.html
+/// Free the blocks held by the shared pool and by the calling thread.
+void ImageTrimPool(void)
+{ ///
+  for (int c = 0; c < NUM_CLASSES; c++)
+  {
+    while (Cache[c].head != NULL)
+    {
+      struct freeblock *b = Cache[c].head;
+      Cache[c].head = b->next;
+      PoolHeld -= ClassSize(c);
+      free(b);
+    }
+    Cache[c].count = 0;
 
-// Auxiliary function
-static void unpackBits(int nbytes, const uint8 bytes[], uint8 raw_row[])
-{
-  // bitmask starts at top bit
-  int offset = 0;
-  uint8 mask = 1 << (7 - offset);
-  while (offset < 8)
-  { // or (mask > 0)
-    for (int b = 0; b < nbytes; b++)
+    pthread_mutex_lock(&Blocks.lock);
+    struct freeblock *list = Blocks.head[c];
+    Blocks.head[c] = NULL;
+    pthread_mutex_unlock(&Blocks.lock);
+    while (list != NULL)
     {
-      raw_row[8 * b + offset] = (bytes[b] & mask) != 0;
+      struct freeblock *b = list;
+      list = b->next;
+      pthread_mutex_lock(&Blocks.lock);
+      Blocks.held -= ClassSize(c);
+      pthread_mutex_unlock(&Blocks.lock);
+      PoolHeld -= ClassSize(c);
+      free(b);
     }
-    mask >>= 1;
-    offset++;
   }
 }
 
-// Auxiliary function
-static void packBits(int nbytes, uint8 bytes[], const uint8 raw_row[])
+/// Allocate an arena with room for (at least) `capacity` runs of
+/// run_size bytes
+static struct arena *AllocateArena(size_t capacity, uint8 run_size)
 {
-  // bitmask starts at top bit
-  int offset = 0;
-  uint8 mask = 1 << (7 - offset);
-  while (offset < 8)
-  { // or (mask > 0)
-    for (int b = 0; b < nbytes; b++)
-    {
-      if (offset == 0)
-        bytes[b] = 0;
-      bytes[b] |= raw_row[8 * b + offset] ? mask : 0;
-    }
-    mask >>= 1;
-    offset++;
-  }
+  assert(capacity > 0);
+  size_t size = sizeof(struct arena);
+  struct arena *newArena = PoolAlloc(&size);
+
+  newArena->size = capacity * run_size;
+  newArena->runs = PoolAlloc(&newArena->size);
+  newArena->refs = 0;
+  newArena->last = NO_ROW;
+  newArena->used = 0;
+  newArena->capacity = newArena->size / run_size; // (the whole block)
+  MEMSPACE += newArena->size;
+
+  return newArena;
 }
 
-// Match and skip 0 or more comment lines in file f.
-// Comments start with a # and continue until the end-of-line, inclusive.
-// Returns the number of comments skipped.
-static int skipComments(FILE *f)
+/// Move the runs of an arena to a new block of (at least) `capacity` runs
+static void ResizeArena(struct arena *a, size_t capacity, uint8 run_size)
 {
-  char c;
-  int i = 0;
-  while (fscanf(f, "#%*[^\n]%c", &c) == 1 && c == '\n')
+  assert(capacity >= a->used);
+  size_t size = capacity * run_size;
+  uint8 *runs = PoolAlloc(&size);
+  memcpy(runs, a->runs, a->used * run_size);
+  PoolFree(a->runs, a->size);
+  MEMSPACE += size;
+  MEMSPACE -= a->size;
+  a->runs = runs;
+  a->size = size;
+  a->capacity = size / run_size;
+}
+
+/// Drop a reference to an arena, freeing it when no image uses it anymore
+static void ReleaseArena(struct arena *a)
+{
+  assert(a->refs > 0);
+  if (--a->refs == 0)
   {
-    i++;
+    PoolFree(a->runs, a->size);
+    PoolFree(a, sizeof(struct arena));
   }
-  return i;
 }
 
-/// Load a raw PBM file.
-/// Only binary PBM files are accepted.
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-Image ImageLoad(const char *filename)
-{ ///
-  int w, h;
-  char c;
-  FILE *f = NULL;
-  Image img = NULL;
+/// Create the header of an image data structure
+/// And allocate a list for up to max_arenas arenas
+/// (The image gets no arenas: they are attached with AttachArena;
+/// and no row table: stored images get one with AllocateRowTable.)
+static Image NewImageHeader(uint32 width, uint32 height, uint32 max_arenas,
+                            uint8 pattern)
+{
+  assert(width > 0 && height > 0);
+  assert(max_arenas > 0 && max_arenas <= UINT16_MAX);
+  size_t size = sizeof(struct image);
+  Image newHeader = PoolAlloc(&size);
 
-  check((f = fopen(filename, "rb")) != NULL, "Open failed");
-  // Parse PBM header
-  check(fscanf(f, "P%c ", &c) == 1 && c == '4', "Invalid file format");
-  skipComments(f);
-  check(fscanf(f, "%d ", &w) == 1 && w >= 0, "Invalid width");
-  skipComments(f);
-  check(fscanf(f, "%d", &h) == 1 && h >= 0, "Invalid height");
-  check(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected");
+  newHeader->width = width;
+  newHeader->height = height;
+  newHeader->run_size = RunSizeForWidth(width);
+  newHeader->num_runs = 0;
+  newHeader->dict = NULL;
+  newHeader->hashed = 0;
+  newHeader->pattern = pattern;
+
+  newHeader->table = NULL;
+  newHeader->row = NULL;
+  newHeader->flip = 0;
+
+  // Allocating the arena list
+  size = max_arenas * sizeof(struct arena *);
+  newHeader->arena = PoolAlloc(&size);
+  newHeader->num_arenas = 0;
+  newHeader->max_arenas = max_arenas;
 
-  // Allocate image
-  img = AllocateImageHeader(w, h);
+  return newHeader;
+}
 
-  // Read pixels
-  int nbytes = (w + 8 - 1) / 8; // number of bytes for each row
-  // using VLAs...
-  uint8 bytes[nbytes];
-  uint8 raw_row[nbytes * 8];
-  for (uint32 i = 0; i < img->height; i++)
+/// Allocate a new row table, with room for n entries, for an image
+static void AllocateRowTable(Image img, uint32 n)
+{
+  assert(img->table == NULL);
+  size_t size = sizeof(struct rowtable) + n * sizeof(struct rowinfo);
+  img->table = PoolAlloc(&size);
+  img->table->refs = 1;
+  img->table->capacity = n;
+  img->table->num_spans = 0;
+  img->table->max_spans = 0;
+  img->table->end = NULL;
+  img->table->hash = NULL;
+  img->table->mark = NULL;
+  img->table->marks = NULL;
+  img->table->num_marks = 0;
+  img->table->max_marks = 0;
+  img->row = img->table->row;
+}
+
+/// Drop the fingerprints and the marks of the entries of a row table, if
+/// any (when its entries change, or move)
+static void ForgetRowCaches(struct rowtable *t)
+{
+  if (t->hash != NULL)
   {
-    check(fread(bytes, sizeof(uint8), nbytes, f) == (size_t)nbytes,
-          "Reading pixels");
-    unpackBits(nbytes, bytes, raw_row);
-    img->row[i] = CompressRow(w, raw_row);
+    PoolFree(t->hash, 2 * (size_t)t->capacity * sizeof(uint64));
+    t->hash = NULL;
+  }
+  if (t->mark != NULL)
+  {
+    PoolFree(t->mark, t->capacity * sizeof(uint32));
+    PoolFree(t->marks, t->max_marks * sizeof(uint32));
+    t->mark = NULL;
+    t->marks = NULL;
+    t->num_marks = 0;
+    t->max_marks = 0;
   }
-
-  fclose(f);
-  return img;
 }
 
-/// Save image to PBM file.
-/// On success, returns nonzero.
-/// On failure, returns 0, and
-/// a partial and invalid file may be left in the system.
-int ImageSave(const Image img, const char *filename)
-{ ///
-  assert(img != NULL);
-  int w = img->width;
-  int h = img->height;
-  FILE *f = NULL;
-
-  check((f = fopen(filename, "wb")) != NULL, "Open failed");
-  check(fprintf(f, "P4\n%d %d\n", w, h) > 0, "Writing header failed");
-
-  // Write pixels
-  int nbytes = (w + 8 - 1) / 8; // number of bytes for each row
-  // using VLAs...
-  uint8 bytes[nbytes];
-  // unit8 raw_row[nbytes*8];
-  for (uint32 i = 0; i < img->height; i++)
+/// Drop the reference of an image to its row table, freeing it when no
+/// image uses it anymore
+static void ReleaseRowTable(Image img)
+{
+  struct rowtable *t = img->table;
+  if (t != NULL && --t->refs == 0)
   {
-    // UncompressRow...
-    uint8 *raw_row = UncompressRow(nbytes * 8, img->row[i]);
-    // Fill padding pixels with WHITE
-    memset(raw_row + w, WHITE, nbytes * 8 - w);
-    packBits(nbytes, bytes, raw_row);
-    check(fwrite(bytes, sizeof(uint8), nbytes, f) == (size_t)nbytes,
-          "Writing pixels failed");
-    free(raw_row);
+    ForgetRowCaches(t);
+    if (t->end != NULL)
+    {
+      PoolFree(t->end, t->max_spans * sizeof(uint32));
+    }
+    PoolFree(t, sizeof(struct rowtable) + t->capacity * sizeof(struct rowinfo));
   }
-
-  // Cleanup
-  fclose(f);
-  return 0;
+  img->table = NULL;
+  img->row = NULL;
 }
 
-/// Information queries
+/// Move the row table of an image (of its own) to a new block with room
+/// for n entries
+static void ResizeRowTable(Image img, uint32 n)
+{
+  struct rowtable *t = img->table;
+  uint32 used = t->num_spans > 0 ? t->num_spans : img->height;
+  assert(t->refs == 1 && n >= used);
+  ForgetRowCaches(t);
+  size_t size = sizeof(struct rowtable) + n * sizeof(struct rowinfo);
+  struct rowtable *newTable = PoolAlloc(&size);
+  memcpy(newTable, t, sizeof(struct rowtable) + used * sizeof(struct rowinfo));
+  newTable->capacity = n;
+  PoolFree(t, sizeof(struct rowtable) + t->capacity * sizeof(struct rowinfo));
+  img->table = newTable;
+  img->row = newTable->row;
+}
 
-/// Get image width
-int ImageWidth(const Image img)
+/// Make sure a row table has room for n span ends
+/// (A table keeps that room when its rows are rebuilt.)
+static void ReserveSpans(struct rowtable *t, uint32 n)
 {
-  assert(img != NULL);
-  return img->width;
+  if (t->max_spans < n)
+  {
+    if (t->end != NULL)
+    {
+      PoolFree(t->end, t->max_spans * sizeof(uint32));
+    }
+    size_t size = n * sizeof(uint32);
+    t->end = PoolAlloc(&size);
+    t->max_spans = (uint32)(size / sizeof(uint32));
+  }
 }
 
-/// Get image height
-int ImageHeight(const Image img)
+/// Make sure an image has a row table of its own for (at least) n rows,
+/// with an entry per row:
+/// its table is kept if no other image uses it and it is large enough
+static void ReserveRowTable(Image img, uint32 n)
 {
-  assert(img != NULL);
-  return img->height;
+  if (img->table == NULL || img->table->refs > 1 || img->table->capacity < n)
+  {
+    ReleaseRowTable(img);
+    AllocateRowTable(img, n);
+  }
+  ForgetRowCaches(img->table);
+  img->table->num_spans = 0;
 }
 
-/// Image comparison
+/// Do two row descriptors describe the same row?
+static inline int IsSameRowInfo(struct rowinfo a, struct rowinfo b)
+{
+  return a.offset == b.offset && a.arena == b.arena &&
+         a.num_runs == b.num_runs && a.color == b.color && a.form == b.form;
+}
 
-// returns 1 if equal, 0 otherwise
-int ImageIsEqual(const Image img1, const Image img2)
+/// Store the row table of an image (of its own, with an entry per row) by
+/// vertical spans, if the entry and the end of each span take at most half
+/// the space of the entries of the rows
+/// (Rows are in the same span when they have the same descriptor: equal
+/// rows are made to share their runs as they are built, see CommitRLERow.)
+static void CompactRowTable(Image img)
 {
-  assert(img1 != NULL && img2 != NULL);
+  struct rowtable *t = img->table;
+  assert(t != NULL && t->refs == 1);
+  uint32 height = img->height;
+  if (!RowSpans || t->num_spans > 0)
+  {
+    return;
+  }
 
-  // first we check if width and height of images are the same -> otherwise already know they're different
-  if ((img1->height != img2->height) || (img1->width != img2->width))
+  uint32 n = 1; // number of spans
+  for (uint32 i = 1; i < height; i++)
   {
-    return 0;
+    n += !IsSameRowInfo(t->row[i - 1], t->row[i]);
+  }
+  if ((size_t)n * (sizeof(struct rowinfo) + sizeof(uint32)) >
+      (size_t)height * sizeof(struct rowinfo) / 2)
+  {
+    return;
   }
 
-  // check row by row if encoding is equal
-  for (uint32 i = 0; i < img1->height; i++)
+  // (Entry s is written over an entry already read: s <= i.)
+  ForgetRowCaches(t);
+  ReserveSpans(t, n);
+  uint32 s = 0;
+  for (uint32 i = 1; i < height; i++)
   {
-    if (lineIsEqual(img1->row[i], img2->row[i], GetSizeRLERowArray(img1->row[i])) != 0)
+    if (!IsSameRowInfo(t->row[s], t->row[i]))
     {
-      return 0;
+      t->end[s++] = i;
+      t->row[s] = t->row[i];
     }
   }
-
-  return 1;
+  t->end[s++] = height;
+  assert(s == n);
+  t->num_spans = n;
 }
 
-int ImageIsDifferent(const Image img1, const Image img2)
+/// Release the space of the row table of a new image that was left unused
+/// (moving it to a smaller block, if that saves at least half of a block)
+static void TrimRowTable(Image img)
 {
-  assert(img1 != NULL && img2 != NULL);
-  return !ImageIsEqual(img1, img2);
+  struct rowtable *t = img->table;
+  uint32 used = t->num_spans > 0 ? t->num_spans : img->height;
+  size_t size = sizeof(struct rowtable) + t->capacity * sizeof(struct rowinfo);
+  if (PoolBlockSize(sizeof(struct rowtable) + used * sizeof(struct rowinfo)) <=
+      PoolBlockSize(size) / 2)
+  {
+    ResizeRowTable(img, used);
+  }
 }
 
-/// Boolean Operations on image pixels
-
-/// These functions apply boolean operations to images,
-/// returning a new image as a result.
-///
-/// Operand images are left untouched and must be of the same size.
-///
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-
-Image ImageNEG(const Image img)
+/// Copy the row table of src (entries, spans and their fingerprints) to the
+/// row table of dst (of its own, with room for them)
+static void CopyRowTable(Image dst, const Image src)
 {
-  assert(img != NULL);
-
-  uint32 width = img->width;
-  uint32 height = img->height;
-
-  Image newImage = AllocateImageHeader(width, height);
-
-  // Directly copying the rows, one by one
-  // And changing the value of row[i][0]
-
-  for (uint32 i = 0; i < height; i++)
+  const struct rowtable *t = src->table;
+  uint32 n = t->num_spans > 0 ? t->num_spans : src->height;
+  assert(dst->table->refs == 1 && dst->table->capacity >= n);
+  ForgetRowCaches(dst->table);
+  memcpy(dst->row, t->row, n * sizeof(struct rowinfo));
+  dst->table->num_spans = t->num_spans;
+  if (t->num_spans > 0)
   {
-    uint32 num_elems = GetSizeRLERowArray(img->row[i]);
-    newImage->row[i] = AllocateRLERowArray(num_elems);
-    memcpy(newImage->row[i], img->row[i], num_elems * sizeof(int));
-    newImage->row[i][0] ^= 1; // Just negate the value of the first pixel run
+    ReserveSpans(dst->table, n);
+    memcpy(dst->table->end, t->end, n * sizeof(uint32));
+  }
+  if (t->hash != NULL)
+  {
+    size_t size = 2 * (size_t)dst->table->capacity * sizeof(uint64);
+    dst->table->hash = PoolAlloc(&size);
+    memcpy(dst->table->hash, t->hash, 2 * (size_t)n * sizeof(uint64));
   }
-
-  return newImage;
 }
 
-// This is the optimized version of the algorithm
-Image ImageAND(const Image img1, const Image img2)
+/// Make an image share the row table of another one
+static void ShareRowTable(Image img, const Image src)
 {
-  assert(img1 != NULL && img2 != NULL);
-  assert((img1->height == img2->height) && (img1->width == img2->width));
-
-  // allocate memory for the resulting image
-  Image rslt = AllocateImageHeader(img1->width, img1->height);
+  assert(img->table == NULL && src->table != NULL);
+  img->table = src->table;
+  img->table->refs++;
+  img->row = img->table->row;
+}
 
-  for (uint32 row_index = 0; row_index < img1->height; row_index++)
+/// Give an image a copy of its row table, if it shares it with other
+/// images, so that it may change its rows (copy on write)
+static void UnshareRowTable(Image img)
+{
+  if (img->table != NULL && img->table->refs > 1)
   {
-    rslt->row[row_index] = rowAND(img1->row[row_index], img2->row[row_index], img1->width);
+    struct image src = *img; // (the table stays alive, used by the others)
+    uint32 n = src.table->num_spans > 0 ? src.table->num_spans : img->height;
+    ReleaseRowTable(img);
+    AllocateRowTable(img, n);
+    CopyRowTable(img, &src);
   }
-
-  return rslt;
 }
 
-// This is the non-optimized version of imageAND()
-// Image ImageAND(const Image img1, const Image img2)
-// {
-//   assert(img1 != NULL && img2 != NULL);
-//   assert((img1->height == img2->height) && (img1->width == img2->width));
+/// Make an image reference an arena, if it does not already
+/// Returns the index of the arena in the arena list of the image.
+/// (The arena list must have room for it.)
+static uint16 AttachArena(Image img, struct arena *a)
+{
+  for (uint16 k = 0; k < img->num_arenas; k++)
+  {
+    if (img->arena[k] == a)
+    {
+      return k;
+    }
+  }
+  a->refs++;
+  img->arena[img->num_arenas] = a;
+  return img->num_arenas++;
+}
 
-//   // allocate memory for the resulting image
-//   Image rslt = AllocateImageHeader(img1->width, img1->height);
+// Bound on the number of arenas of an image built by sharing the arenas of
+// others: a result that would have more (as when images are stacked again
+// and again) gets its rows copied into an arena of its own (see
+// CompactArenas), so that the arena index of a row never wraps.
+#define MAX_SHARED_ARENAS (2 * MAX_THREADS)
+
+/// Make an image reference all the arenas of src, after its own (none of
+/// which may be one of them), keeping their order
+/// Returns the index of the first of them in the arena list of the image.
+/// (The arena list must have room for them.)
+static uint16 ShareArenas(Image img, const Image src)
+{
+  uint16 first = img->num_arenas;
+  assert(first + src->num_arenas <= img->max_arenas);
+  for (uint16 k = 0; k < src->num_arenas; k++)
+  {
+    src->arena[k]->refs++;
+    img->arena[first + k] = src->arena[k];
+  }
+  img->num_arenas += src->num_arenas;
+  return first;
+}
 
-//   for (uint32 row_index = 0; row_index < img1->height; row_index++)
-//   {
-//     uint8 *row1 = UncompressRow(img1->width, img1->row[row_index]);
-//     uint8 *row2 = UncompressRow(img2->width, img2->row[row_index]);
+/// Make an image reference the arenas of src it does not reference yet,
+/// and get in map[k] the index of arena k of src in its arena list
+/// (The arenas are found by hashing their addresses, not by searching the
+/// arena list; the arena list must have room for them.)
+static void MapArenas(Image img, const Image src, uint16 *map)
+{
+  uint16 own = img->num_arenas;
+  uint32 n = own + src->num_arenas;
+  uint32 size = 1;
+  while (size < 2 * n)
+  {
+    size *= 2; // (a power of 2, at least half empty)
+  }
+  uint16 slot[size]; // the index of an arena in the list of img (or
+                     // UINT16_MAX, for an empty slot)
+  for (uint32 p = 0; p < size; p++)
+  {
+    slot[p] = UINT16_MAX;
+  }
+  for (uint32 k = 0; k < n; k++)
+  {
+    struct arena *a = k < own ? img->arena[k] : src->arena[k - own];
+    uint32 p = (uint32)HashBytes((const uint8 *)&a, sizeof(a), 0) & (size - 1);
+    while (slot[p] != UINT16_MAX && img->arena[slot[p]] != a)
+    {
+      p = (p + 1) & (size - 1);
+    }
+    if (slot[p] == UINT16_MAX)
+    {
+      if (k >= own)
+      {
+        assert(img->num_arenas < img->max_arenas);
+        a->refs++;
+        img->arena[img->num_arenas] = a;
+      }
+      slot[p] = k < own ? (uint16)k : img->num_arenas++;
+    }
+    if (k >= own)
+    {
+      map[k - own] = slot[p];
+    }
+  }
+}
 
-//     uint8 *rslt_row = (uint8 *)malloc(img1->width * sizeof(uint8));
-//     check(rslt_row != NULL, "malloc");
+/// Create the header of an image data structure to be built by `workers`
+/// workers in parallel
+/// And allocate the row table and a new arena for each worker, where the
+/// rows it builds will be appended (arena[k] for worker k), with room for
+/// `capacity` runs overall
+static Image AllocateWorkerImageHeader(uint32 width, uint32 height,
+                                       size_t capacity, int workers)
+{
+  assert(workers > 0);
+  Image newHeader = NewImageHeader(width, height, workers, STORED);
+  AllocateRowTable(newHeader, height);
+  capacity = capacity / workers + 1; // (+1: an estimate may be 0 for pattern images)
+  for (int k = 0; k < workers; k++)
+  {
+    AttachArena(newHeader, AllocateArena(capacity, newHeader->run_size));
+  }
+  if (InternRows)
+  {
+    assert(workers == 1); // (see PlanWorkers)
+    newHeader->dict = AllocateRowDict(height);
+  }
+  return newHeader;
+}
 
-//     // perform and operation pixelwise
-//     for (uint32 j = 0; j < img1->width; j++)
-//     {
-//       rslt_row[j] = row1[j] & row2[j];
-//       NUMOPS++; // increment due to logic and operation
-//     }
+/// Create the header of an image data structure
+/// And allocate the row table and a new arena for `capacity` runs,
+/// where the rows of the image will be appended
+static Image AllocateImageHeader(uint32 width, uint32 height, size_t capacity)
+{
+  return AllocateWorkerImageHeader(width, height, capacity, 1);
+}
 
-//     int *aux = CompressRow(img1->width, rslt_row);
-//     rslt->row[row_index] = aux;
+/// Reset an image, to be rebuilt as a stored image of the given size
+/// Up to `keep` of its arenas are kept, emptied, if no other image uses
+/// them; its other arenas are released.
+/// The arena list gets room for (at least) max_arenas arenas.
+/// (Its row table is left as it is: see ReserveRowTable.)
+static void ResetImage(Image img, uint32 width, uint32 height, uint16 keep,
+                       uint32 max_arenas)
+{
+  assert(width > 0 && height > 0);
+  assert(max_arenas > 0 && max_arenas <= UINT16_MAX);
+  assert(img->dict == NULL);
+  uint8 run_size = RunSizeForWidth(width);
 
-//     free(rslt_row);
-//     free(row1);
-//     free(row2);
-//     // we don't free aux as it is being assigned to rlst->row. Therefore it will only be freed when calling imageDestroy
-//   }
+  uint16 kept = 0;
+  for (uint16 k = 0; k < img->num_arenas; k++)
+  {
+    struct arena *a = img->arena[k];
+    if (a->refs == 1 && kept < keep)
+    {
+      a->capacity = a->size / run_size;
+      a->used = 0;
+      a->last = NO_ROW;
+      img->arena[kept++] = a;
+    }
+    else
+    {
+      ReleaseArena(a);
+    }
+  }
+  img->num_arenas = kept;
+  if (img->max_arenas < max_arenas)
+  {
+    size_t size = max_arenas * sizeof(struct arena *);
+    struct arena **arena = PoolAlloc(&size);
+    memcpy(arena, img->arena, kept * sizeof(struct arena *));
+    PoolFree(img->arena, img->max_arenas * sizeof(struct arena *));
+    img->arena = arena;
+    img->max_arenas = max_arenas;
+  }
 
-//   return rslt;
-// }
+  img->width = width;
+  img->height = height;
+  img->run_size = run_size;
+  img->num_runs = 0;
+  img->flip = 0;
+  img->hashed = 0;
+  img->pattern = STORED;
+}
 
-Image ImageOR(const Image img1, const Image img2)
+/// Get an image to build a result in, to be built by `workers` workers:
+/// dst, reset and reusing its own arenas and row table, or a new image
+/// if dst is NULL
+/// (see AllocateWorkerImageHeader).
+static Image PrepareResult(Image dst, uint32 width, uint32 height,
+                           size_t capacity, int workers)
 {
-  assert(img1 != NULL && img2 != NULL);
-  assert((img1->height == img2->height) && (img1->width == img2->width));
-
-  Image rslt = AllocateImageHeader(img1->width, img1->height);
-
-  for (uint32 row_index = 0; row_index < img1->height; row_index++)
+  if (dst == NULL)
+  {
+    return AllocateWorkerImageHeader(width, height, capacity, workers);
+  }
+  ResetImage(dst, width, height, workers, workers);
+  ReserveRowTable(dst, height);
+  while (dst->num_arenas < workers)
+  {
+    AttachArena(dst, AllocateArena(capacity / workers + 1, dst->run_size));
+  }
+  if (InternRows)
   {
-    rslt->row[row_index] = rowOR(img1->row[row_index], img2->row[row_index], img1->width);
+    assert(workers == 1); // (see PlanWorkers)
+    dst->dict = AllocateRowDict(height);
   }
+  return dst;
+}
 
-  return rslt;
+/// Get an image to build a result sharing the rows of other images in:
+/// dst, reset, with no arenas, or a new image if dst is NULL.
+/// The arena list has room for max_arenas arenas.
+static Image PrepareSharedResult(Image dst, uint32 width, uint32 height,
+                                 uint32 max_arenas)
+{
+  if (dst == NULL)
+  {
+    dst = NewImageHeader(width, height, max_arenas, STORED);
+    AllocateRowTable(dst, height);
+    return dst;
+  }
+  ResetImage(dst, width, height, 0, max_arenas);
+  ReserveRowTable(dst, height);
+  return dst;
+}
 
-  return NULL;
+/// Make dst (or a new image, if dst is NULL) a view of the rows of a
+/// stored image, in the orientation of img changed by flip
+/// The view shares the row table and the arenas of img: it takes O(1)
+/// time (per arena), whatever the size of the image.
+/// The arenas of its own that dst had are kept, emptied, after those of img,
+/// for the next results built in dst.
+static Image NewView(Image dst, const Image img, uint8 flip)
+{
+  assert(img->pattern == STORED && dst != img);
+  uint16 n = img->num_arenas;
+  uint16 kept = 0;
+  if (dst == NULL)
+  {
+    dst = NewImageHeader(img->width, img->height, n, STORED);
+  }
+  else
+  {
+    ResetImage(dst, img->width, img->height, dst->num_arenas,
+               n + dst->num_arenas);
+    ReleaseRowTable(dst);
+    kept = dst->num_arenas;
+    memmove(dst->arena + n, dst->arena, kept * sizeof(struct arena *));
+  }
+  for (uint16 k = 0; k < n; k++)
+  {
+    dst->arena[k] = img->arena[k]; // (same indices as in img)
+    dst->arena[k]->refs++;
+  }
+  dst->num_arenas = n + kept;
+  ShareRowTable(dst, img);
+  dst->num_runs = img->num_runs;
+  dst->flip = img->flip ^ flip;
+  return dst;
 }
 
-Image ImageXOR(Image img1, Image img2)
+/// Move the contents of src into dst, and destroy src
+/// (The former contents of dst are destroyed with it.)
+static void MoveImage(Image dst, Image src)
 {
-  assert(img1 != NULL && img2 != NULL);
-  assert((img1->height == img2->height) && (img1->width == img2->width));
+  struct image old = *dst;
+  *dst = *src;
+  *src = old;
+  ImageDestroy(&src);
+}
 
-  Image rslt = AllocateImageHeader(img1->width, img1->height);
+static struct rowinfo GetPatternRowInfo(const Image img, uint32 i);
+static uint32 GetPatternSpanEnd(const Image img, uint32 i);
 
-  for (uint32 row_index = 0; row_index < img1->height; row_index++)
+/// Get the entry of a row table stored by spans for the row i of the table
+/// (binary search of the first span ending after row i)
+static inline uint32 FindSpan(const struct rowtable *t, uint32 i)
+{
+  uint32 lo = 0, hi = t->num_spans - 1;
+  while (lo < hi)
   {
-    rslt->row[row_index] = rowXOR(img1->row[row_index], img2->row[row_index], img1->width);
+    uint32 mid = lo + (hi - lo) / 2;
+    if (t->end[mid] > i)
+    {
+      hi = mid;
+    }
+    else
+    {
+      lo = mid + 1;
+    }
   }
+  return lo;
+}
 
-  return rslt;
+/// Get the index of the entry of the row table of a stored image that
+/// describes its row i
+static inline uint32 RowEntry(const Image img, uint32 i)
+{
+  const struct rowtable *t = img->table;
+  uint32 j = (img->flip & FLIP_ROWS) ? img->height - 1 - i : i;
+  return t->num_spans > 0 ? FindSpan(t, j) : j;
+}
 
-  return NULL;
+/// Get the descriptor of row i of an image
+/// (In a view with FLIP_RUNS, it describes the runs as stored, backwards.)
+static inline struct rowinfo GetRowInfo(const Image img, uint32 i)
+{
+  assert(i < img->height);
+  if (img->row == NULL)
+  {
+    return GetPatternRowInfo(img, i);
+  }
+  return img->row[RowEntry(img, i)];
 }
 
-/// Geometric transformations
+/// Get the descriptor of row i of an image, and the end of its vertical
+/// span: the rows [i, *next) all have that descriptor.
+/// (Without spans in the row table, the span of a row is the row itself.)
+static inline struct rowinfo GetRowSpan(const Image img, uint32 i, uint32 *next)
+{
+  assert(i < img->height);
+  if (img->row == NULL)
+  {
+    *next = GetPatternSpanEnd(img, i);
+    return GetPatternRowInfo(img, i);
+  }
+  const struct rowtable *t = img->table;
+  uint32 j = (img->flip & FLIP_ROWS) ? img->height - 1 - i : i;
+  if (t->num_spans == 0)
+  {
+    *next = i + 1;
+    return img->row[j];
+  }
+  uint32 s = FindSpan(t, j);
+  if (img->flip & FLIP_ROWS)
+  {
+    *next = img->height - (s > 0 ? t->end[s - 1] : 0); // (read bottom-up)
+  }
+  else
+  {
+    *next = t->end[s];
+  }
+  return img->row[s];
+}
 
-/// These functions apply geometric transformations to an image,
-/// returning a new image as a result.
-///
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
+/// Get the runs of a row of an image, given its descriptor (as stored)
+static inline const uint8 *GetRowRuns(const Image img, struct rowinfo row)
+{
+  return img->arena[row.arena]->runs + row.offset * img->run_size;
+}
 
-/// Mirror an image = flip top-bottom.
-/// Returns a mirrored version of the image.
-/// Ensures: The original img is not modified.
-///
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-Image ImageHorizontalMirror(const Image img)
+/// Get the pixel value of the first pixel of a row of an image, given its
+/// descriptor (the value of the last run stored, in a view with FLIP_RUNS)
+static inline uint8 GetRowColor(const Image img, struct rowinfo row)
 {
-  assert(img != NULL);
+  if (img->flip & FLIP_RUNS)
+  {
+    return row.color ^ ((row.num_runs - 1) % 2);
+  }
+  return row.color;
+}
 
-  uint32 width = img->width;
-  uint32 height = img->height;
+/// Decode a bitset row or a row of transitions of an image, given its
+/// descriptor, into runs (as stored); runs must have room for a run per pixel
+static void DecodeRowRuns(const Image img, struct rowinfo row, uint8 *runs)
+{
+  const uint8 *stored = GetRowRuns(img, row);
+  if (row.form == ROW_EDGES)
+  {
+    memcpy(runs, stored, (size_t)row.num_runs * img->run_size);
+    EdgesToRuns(runs, img->run_size, row.num_runs);
+    return;
+  }
+  assert(row.form == ROW_BITS);
+  uint32 n = PackedRowRuns(stored, img->width, runs, img->run_size, UINT32_MAX);
+  assert(n == row.num_runs);
+  (void)n;
+}
 
-  Image newImage = AllocateImageHeader(width, height);
+/// Get the runs of a row of an image, given its descriptor, as stored
+/// (backwards, in a view with FLIP_RUNS): the runs of a bitset row or of a
+/// row of transitions are decoded into the scratch buffer of operand j of
+/// worker w
+static const uint8 *GetDecodedRuns(const Image img, struct rowinfo row, int w,
+                                   int j)
+{
+  if (row.form == ROW_RUNS)
+  {
+    return GetRowRuns(img, row);
+  }
+  uint8 *runs = ScratchRowBuffer(w, RUNS_BUFFER + j,
+                                 (size_t)img->width * img->run_size);
+  DecodeRowRuns(img, row, runs);
+  return runs;
+}
 
-  // Iterates through each row in the original image, in reverse order.
-  for (uint32 i = 0; i < height; i++)
+/// Get the ends of the runs of a row of an image, given its descriptor, as
+/// stored: those of a row of runs are computed into the scratch buffer of
+/// operand j of worker w (a bitset row has no runs stored)
+static const uint8 *GetRowEdges(const Image img, struct rowinfo row, int w,
+                                int j)
+{
+  assert(row.form != ROW_BITS);
+  if (row.form == ROW_EDGES)
   {
-    int size = GetSizeRLERowArray(img->row[height - i - 1]); // Gets the size of the row (RLE compressed).
-    newImage->row[i] = AllocateRLERowArray(size);            // Allocates memory for the new row.
+    return GetRowRuns(img, row);
+  }
+  uint8 *edges = ScratchRowBuffer(w, RUNS_BUFFER + j,
+                                  (size_t)img->width * img->run_size);
+  memcpy(edges, GetRowRuns(img, row), (size_t)row.num_runs * img->run_size);
+  RunsToEdges(edges, img->run_size, row.num_runs);
+  return edges;
+}
 
-    // Copies the data from the original image row to the new row.
-    for (int j = 0; j < size; j++)
+/// Get the ends of the runs of a row of an image, given its descriptor, in
+/// reading order (forwards, even in a view with FLIP_RUNS): those stored,
+/// or those computed into the scratch buffer of operand j of worker w
+/// (the runs of a bitset row are decoded first)
+static const uint8 *GetReadingEdges(const Image img, struct rowinfo row, int w,
+                                    int j)
+{
+  uint8 rs = img->run_size;
+  if (!(img->flip & FLIP_RUNS))
+  {
+    if (row.form != ROW_BITS)
     {
-      newImage->row[i][j] = img->row[height - i - 1][j];
+      return GetRowEdges(img, row, w, j);
     }
+    uint8 *edges = ScratchRowBuffer(w, RUNS_BUFFER + j,
+                                    (size_t)img->width * rs);
+    DecodeRowRuns(img, row, edges);
+    RunsToEdges(edges, rs, row.num_runs);
+    return edges;
+  }
+  // The runs as stored, reversed (in place, if they were decoded there)
+  uint32 n = row.num_runs;
+  const uint8 *runs = GetDecodedRuns(img, row, w, j);
+  uint8 *edges = ScratchRowBuffer(w, RUNS_BUFFER + j, (size_t)img->width * rs);
+  for (uint32 k = 0; k < (n + 1) / 2; k++)
+  {
+    uint32 first = GetRun(runs, rs, k);
+    uint32 last = GetRun(runs, rs, n - 1 - k);
+    SetRun(edges, rs, k, last);
+    SetRun(edges, rs, n - 1 - k, first);
   }
+  RunsToEdges(edges, rs, n);
+  return edges;
+}
 
-  return newImage;
+/// Get the pixels of a row of an image, given its descriptor, as a bitset
+/// in reading order (forwards, even in a view with FLIP_RUNS): the bitset
+/// stored, or one built into the scratch buffer of operand j of worker w
+static const uint8 *GetRowBits(const Image img, struct rowinfo row, int w,
+                               int j)
+{
+  int rev = (img->flip & FLIP_RUNS) != 0;
+  if (row.form == ROW_BITS && !rev)
+  {
+    return GetRowRuns(img, row);
+  }
+  const uint8 *runs = GetDecodedRuns(img, row, w, j);
+  uint8 *bits = ScratchRowBuffer(w, BITS_BUFFER + j,
+                                 (size_t)BitsWords(img->width) * 8);
+  EncodeBitsRow(runs, row.num_runs, img->run_size, rev, img->width, bits);
+  return bits;
 }
 
-/// Mirror an image = flip left-right.
-/// Returns a mirrored version of the image.
-/// Ensures: The original img is not modified.
-///
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-Image ImageVerticalMirror(const Image img)
+/// Get the runs of the RLE row i of an image, as stored
+/// (backwards, in a view with FLIP_RUNS)
+static inline const uint8 *GetStoredRLERow(const Image img, uint32 i)
 {
-  assert(img != NULL);
+  return GetRowRuns(img, GetRowInfo(img, i));
+}
 
-  uint32 width = img->width;
-  uint32 height = img->height;
+/// Get the runs of the RLE row i of an image
+/// (Readers that do not read runs backwards resolve views with FLIP_RUNS
+/// first, see ResolveRuns.)
+static inline const uint8 *GetRLERow(const Image img, uint32 i)
+{
+  assert(!(img->flip & FLIP_RUNS));
+  return GetStoredRLERow(img, i);
+}
+
+/// Get the number of runs of the compressed RLE row i of an image
+static inline uint32 GetNumRunsInRLERow(const Image img, uint32 i)
+{
+  return GetRowInfo(img, i).num_runs;
+}
 
-  Image newImage = AllocateImageHeader(width, height);
+/// Get the pixel value of the first run of the RLE row i of an image
+/// (the last run stored, in a view with FLIP_RUNS)
+static inline uint8 GetRLERowColor(const Image img, uint32 i)
+{
+  return GetRowColor(img, GetRowInfo(img, i));
+}
 
-  // Iterates through each row in the original image.
-  for (uint32 i = 0; i < height; i++)
+/// Reserve space for a RLE row with (at most) n runs at the end of arena[k]
+/// Returns the address where the runs should be written.
+/// The address is only valid until the next reservation.
+static uint8 *ReserveRLERow(Image img, uint16 k, size_t n)
+{
+  assert(n > 0 && k < img->num_arenas);
+  struct arena *a = img->arena[k];
+  assert(a->refs == 1); // rows shared with other images are immutable
+  if (a->used + n > a->capacity)
   {
-    int num_runs = GetNumRunsInRLERow(img->row[i]);       // Gets the number of RLE runs in the row.
-    newImage->row[i] = AllocateRLERowArray(num_runs + 2); // Allocates memory for the new row.
-
-    // Handles the first RLE run differently based on its parity.
-    if (num_runs % 2 != 0)
-    {
-      newImage->row[i][0] = img->row[i][0];
-    }
-    else
+    // Grow geometrically, so that appending rows takes amortized O(1)
+    size_t capacity = 2 * a->capacity;
+    if (capacity < a->used + n)
     {
-      newImage->row[i][0] = img->row[i][0] ^ 1; // Flips the first run's parity.
+      capacity = a->used + n;
     }
+    ResizeArena(a, capacity, img->run_size);
+  }
+  return a->runs + a->used * img->run_size;
+}
 
-    // Reverses the order of the runs for the new image.
-    for (int j = 1; j <= num_runs; j++)
+/// Make the last space reserved in arena[k], holding a row of num_runs runs
+/// starting with the given color, stored in the given form, become row i of
+/// the image
+/// A row identical to the row above it, when that was the last row
+/// committed to arena[k], is not kept: row i refers to the runs of the row
+/// above (see ImageSetRowSpans).
+/// When interning, a row identical to one already in arena[0] is not kept:
+/// row i just refers to the existing copy.
+/// (Workers building an image in parallel commit to their own arenas only.)
+static void CommitRow(Image img, uint32 i, uint16 k, uint8 color,
+                      uint32 num_runs, uint8 form)
+{
+  struct arena *a = img->arena[k];
+  uint32 units = (form == ROW_BITS) ? BitsUnits(img) : num_runs;
+  assert(i < img->height);
+  assert(color == WHITE || color == BLACK);
+  assert(num_runs > 0 && a->used + units <= a->capacity);
+  img->row[i].num_runs = num_runs;
+  img->row[i].arena = k;
+  img->row[i].color = color;
+  img->row[i].form = form;
+
+  // A row equal to the row above (committed just before) shares its runs
+  const uint8 *runs = a->runs + a->used * img->run_size;
+  size_t nbytes = units * img->run_size;
+  uint32 last = a->last;
+  a->last = i;
+  if (RowSpans && last != NO_ROW && last + 1 == i &&
+      img->row[last].num_runs == num_runs && img->row[last].form == form &&
+      memcmp(a->runs + img->row[last].offset * img->run_size, runs, nbytes) == 0)
+  {
+    img->row[i].offset = img->row[last].offset;
+    return;
+  }
+
+  if (img->dict != NULL && k == 0)
+  {
+    uint64 hash = HashBytes(runs, nbytes, 0);
+    size_t pos = hash & img->dict->mask;
+    uint32 j;
+    while ((j = RowDictNext(img->dict, hash, &pos)) != NO_ROW)
     {
-      newImage->row[i][j] = img->row[i][num_runs + 1 - j];
+      const struct rowinfo *r = &img->row[j];
+      if (r->num_runs == num_runs && r->form == form &&
+          memcmp(a->runs + r->offset * img->run_size, runs, nbytes) == 0)
+      {
+        img->row[i].offset = r->offset; // share the existing copy
+        return;
+      }
     }
-
-    newImage->row[i][num_runs + 1] = -1; // End marker for the row.
+    RowDictInsert(img->dict, hash, pos, i);
   }
 
-  return newImage;
+  img->row[i].offset = a->used;
+  a->used += units;
 }
 
-/// Replicate img2 at the bottom of imag1, creating a larger image
-/// Requires: the width of the two images must be the same.
-/// Returns the new larger image.
-/// Ensures: The original images are not modified.
-///
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-Image ImageReplicateAtBottom(const Image img1, const Image img2)
+/// Make the last space reserved in arena[k], holding num_runs runs
+/// starting with the given color, become row i of the image (see CommitRow)
+/// A dense row (see IsDenseRow) is stored as a bitset, over its runs;
+/// in transition mode, other rows are stored by the ends of their runs.
+static void CommitRLERow(Image img, uint32 i, uint16 k, uint8 color,
+                         uint32 num_runs)
 {
-  assert(img1 != NULL && img2 != NULL);
-  assert(img1->width == img2->width);
-
-  uint32 new_width = img1->width;
-  uint32 new_height = img1->height + img2->height;
-
-  Image newImage = AllocateImageHeader(new_width, new_height);
-
-  // Copies the rows of the first image (img1) into the new image.
-  for (uint32 i = 0; i < img1->height; i++)
+  struct arena *a = img->arena[k];
+  uint8 *runs = a->runs + a->used * img->run_size;
+  if (!IsDenseRow(img, num_runs))
   {
-    // Allocates memory for the RLE row array for the current row of img1.
-    newImage->row[i] = AllocateRLERowArray(GetSizeRLERowArray(img1->row[i]));
-
-    // Copies each element of the current RLE row from img1 into the new image.
-    for (uint32 j = 0; j < GetSizeRLERowArray(img1->row[i]); j++)
+    if (EdgeRows)
     {
-      newImage->row[i][j] = img1->row[i][j];
+      RunsToEdges(runs, img->run_size, num_runs);
     }
+    CommitRow(img, i, k, color, num_runs, EdgeRows ? ROW_EDGES : ROW_RUNS);
+    return;
   }
+  size_t nbytes = (size_t)BitsWords(img->width) * 8;
+  uint8 *bits = ScratchRowBuffer(k, RSLT_BUFFER, nbytes);
+  EncodeBitsRow(runs, num_runs, img->run_size, 0, img->width, bits);
+  memcpy(runs, bits, nbytes); // (the bitset is shorter than the runs)
+  CommitRow(img, i, k, color, num_runs, ROW_BITS);
+}
 
-  // Copies the rows of the second image (img2) into the new image, starting after img1's rows.
-  for (uint32 i = 0; i < img2->height; i++)
+/// Finish building the rows of an image: count their runs, store its row
+/// table by vertical spans (if that saves space), and release the row
+/// dictionary, if any
+static void FinishRows(Image img)
+{
+  img->num_runs = 0;
+  for (uint32 i = 0; i < img->height; i++)
+  {
+    img->num_runs += img->row[i].num_runs;
+  }
+  CompactRowTable(img);
+  if (img->dict != NULL)
   {
-    // Allocates memory for the RLE row array for the current row of img2.
-    newImage->row[img1->height + i] = AllocateRLERowArray(GetSizeRLERowArray(img2->row[i]));
+    DestroyRowDict(img->dict);
+    img->dict = NULL;
+  }
+}
 
-    // Copies each element of the current RLE row from img2 into the new image.
-    for (uint32 j = 0; j < GetSizeRLERowArray(img2->row[i]); j++)
+/// Finish building an image: release the space of its arenas that was
+/// allocated but left unused (moving their runs to smaller blocks, if that
+/// saves at least half of a block), and finish its rows
+static void FinishImage(Image img)
+{
+  for (uint16 k = 0; k < img->num_arenas; k++)
+  {
+    struct arena *a = img->arena[k];
+    assert(a->refs == 1);
+    size_t used = (a->used > 0) ? a->used : 1; // (a worker may build no rows)
+    if (PoolBlockSize(used * img->run_size) <= a->size / 2)
     {
-      newImage->row[img1->height + i][j] = img2->row[i][j];
+      ResizeArena(a, used, img->run_size);
     }
   }
-
-  return newImage;
+  FinishRows(img);
+  TrimRowTable(img);
 }
 
-/// Replicate img2 to the right of imag1, creating a larger image
-/// Requires: the height of the two images must be the same.
-/// Returns the new larger image.
-/// Ensures: The original images are not modified.
-///
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-Image ImageReplicateAtRight(const Image img1, const Image img2)
+/// Finish building a result from PrepareResult
+/// A new image is trimmed (FinishImage); a reused destination keeps the
+/// room of its arenas, for the next results built in it.
+static void FinishResult(Image rslt, Image dst)
 {
-  assert(img1 != NULL && img2 != NULL);
-  assert(img1->height == img2->height);
-
-  uint32 new_width = img1->width + img2->width;
-  uint32 new_height = img1->height;
-
-  Image newImage = AllocateImageHeader(new_width, new_height);
-
-  for (uint32 i = 0; i < new_height; i++)
+  if (dst == NULL)
   {
-    uint32 num_runs_img1 = GetNumRunsInRLERow(img1->row[i]);
-    uint32 num_runs_img2 = GetNumRunsInRLERow(img2->row[i]);
+    FinishImage(rslt);
+  }
+  else
+  {
+    FinishRows(rslt);
+  }
+}
+
+/// Finish building a result from PrepareSharedResult, whose row table
+/// was filled with the descriptors of the rows (and num_runs set):
+/// store the table by spans, trimming it if the result is a new image
+static void FinishSharedResult(Image rslt, Image dst)
+{
+  CompactRowTable(rslt);
+  if (dst == NULL)
+  {
+    TrimRowTable(rslt);
+  }
+}
+
+/// Resolve the orientation of a view with FLIP_RUNS, the first time its
+/// rows are read by a reader that reads runs forwards only:
+/// the runs of its rows are stored again in reading order, in a new arena,
+/// and indexed by a new row table (also in reading order).
+/// (Like the generation of pattern rows, this changes how img is stored,
+/// not the image, so img may be const; it must not be done while other
+/// threads read img.)
+/// Rows stored once for several rows of img are copied once.
+static void ResolveRuns(const Image img)
+{
+  if (!(img->flip & FLIP_RUNS))
+  {
+    return;
+  }
+  uint32 height = img->height;
+  uint8 rs = img->run_size;
+  struct image old = *img; // the view, read from its former storage
+  Image newImage = (Image)img;
+  struct arena *a = AllocateArena(img->num_runs, rs);
+  newImage->table = NULL;
+  AllocateRowTable(newImage, height);
+
+  struct rowdict *seen = ScratchRowDict(0, height); // the rows copied
+  // (Interned rows of different colors share their runs: compare all fields)
+  for (uint32 i = 0, next; i < height; i = next)
+  {
+    struct rowinfo row = GetRowSpan(&old, i, &next);
+
+    // Was this row copied already?
+    size_t key[3] = {row.arena, row.offset,
+                     (size_t)row.num_runs << 2 | row.form << 1 | row.color};
+    uint64 hash = HashBytes((const uint8 *)key, sizeof(key), 0);
+    size_t pos = hash & seen->mask;
+    uint32 j;
+    while ((j = RowDictNext(seen, hash, &pos)) != NO_ROW)
+    {
+      if (IsSameRowInfo(GetRowInfo(&old, j), row))
+      {
+        break;
+      }
+    }
+    if (j != NO_ROW)
+    {
+      newImage->row[i] = newImage->row[j];
+    }
+    else
+    {
+      RowDictInsert(seen, hash, pos, i);
+      const uint8 *runs = GetDecodedRuns(&old, row, 0, 0);
+      uint8 *new_runs = a->runs + a->used * rs;
+      if (row.form == ROW_BITS)
+      {
+        // (the reversed row is just as dense)
+        EncodeBitsRow(runs, row.num_runs, rs, 1, img->width, new_runs);
+      }
+      else
+      {
+        for (uint32 k = 0; k < row.num_runs; k++)
+        {
+          SetRun(new_runs, rs, k, GetRun(runs, rs, row.num_runs - 1 - k));
+        }
+        if (row.form == ROW_EDGES)
+        {
+          RunsToEdges(new_runs, rs, row.num_runs);
+        }
+      }
+      newImage->row[i].offset = a->used;
+      newImage->row[i].num_runs = row.num_runs;
+      newImage->row[i].arena = 0;
+      newImage->row[i].color = GetRowColor(&old, row);
+      newImage->row[i].form = row.form;
+      a->used += GetRowUnits(&old, row);
+    }
+    for (uint32 r = i + 1; r < next; r++)
+    {
+      newImage->row[r] = newImage->row[i]; // the rest of the span
+    }
+  }
+
+  if (PoolBlockSize(a->used * rs) <= a->size / 2)
+  {
+    ResizeArena(a, a->used, rs); // (many rows were shared)
+  }
+
+  // Replace the shared storage by the new one
+  for (uint16 k = 0; k < old.num_arenas; k++)
+  {
+    ReleaseArena(old.arena[k]);
+  }
+  ReleaseRowTable(&old);
+  newImage->num_arenas = 0;
+  AttachArena(newImage, a);
+  newImage->flip = 0;
+  CompactRowTable(newImage);
+  TrimRowTable(newImage);
+}
+
+/// Copy the rows of an image, shared from too many arenas (see
+/// MAX_SHARED_ARENAS), into an arena of its own, releasing the others
+/// The rows are copied as they are stored (in the same form), and the runs
+/// stored once for several entries of its row table are copied once.
+static void CompactArenas(Image img)
+{
+  struct rowtable *t = img->table;
+  assert(t->refs == 1);
+  uint8 rs = img->run_size;
+  uint32 n = t->num_spans > 0 ? t->num_spans : img->height;
+  size_t units = 0;
+  for (uint32 e = 0; e < n; e++)
+  {
+    units += GetRowUnits(img, t->row[e]);
+  }
+  struct arena *a = AllocateArena(units, rs);
+
+  struct rowdict *seen = ScratchRowDict(0, n); // the entries copied
+  struct rowinfo *old = malloc(n * sizeof(struct rowinfo));
+  check(old != NULL, "malloc");
+  memcpy(old, t->row, n * sizeof(struct rowinfo));
+  for (uint32 e = 0; e < n; e++)
+  {
+    struct rowinfo row = old[e];
+
+    // Were its runs copied already?
+    size_t key[3] = {row.arena, row.offset,
+                     (size_t)row.num_runs << 2 | row.form};
+    uint64 hash = HashBytes((const uint8 *)key, sizeof(key), 0);
+    size_t pos = hash & seen->mask;
+    uint32 j;
+    while ((j = RowDictNext(seen, hash, &pos)) != NO_ROW)
+    {
+      if (old[j].arena == row.arena && old[j].offset == row.offset &&
+          old[j].num_runs == row.num_runs && old[j].form == row.form)
+      {
+        break;
+      }
+    }
+    if (j != NO_ROW)
+    {
+      t->row[e].offset = t->row[j].offset;
+    }
+    else
+    {
+      RowDictInsert(seen, hash, pos, e);
+      uint32 k = GetRowUnits(img, row);
+      memcpy(a->runs + a->used * rs, GetRowRuns(img, row), (size_t)k * rs);
+      t->row[e].offset = a->used;
+      a->used += k;
+    }
+    t->row[e].arena = 0;
+  }
+  free(old);
+
+  if (PoolBlockSize(a->used * rs) <= a->size / 2)
+  {
+    ResizeArena(a, a->used, rs); // (many rows were shared)
+  }
+  for (uint16 k = 0; k < img->num_arenas; k++)
+  {
+    ReleaseArena(img->arena[k]);
+  }
+  img->num_arenas = 0;
+  AttachArena(img, a);
+}
+
+/// Pattern images
+
+/// Create a pattern image: only the parameters are stored
+static Image NewPatternImage(uint32 width, uint32 height, uint8 pattern,
+                             uint8 value, uint32 period, uint32 thickness)
+{
+  assert(value == WHITE || value == BLACK);
+  assert(period > 0);
+  Image newImage = NewImageHeader(width, height, 1, pattern);
+  newImage->value = value;
+  newImage->period = period;
+  newImage->thickness = thickness;
+  return newImage;
+}
+
+/// Number of runs of a row alternating runs of lengths a and b, up to width
+static uint32 GetNumRunsInPeriodicRow(uint32 width, uint32 a, uint32 b)
+{
+  uint32 pairs = width / (a + b);
+  uint32 rest = width % (a + b);
+  return 2 * pairs + (rest > a) + (rest > 0);
+}
+
+/// Append a row alternating runs of lengths a and b, up to width, to arena[0]
+/// Returns the descriptor of the new row (its color is left unset).
+static struct rowinfo AppendPeriodicRow(Image img, uint32 a, uint32 b)
+{
+  assert(a > 0 && b > 0);
+  uint32 num_runs = GetNumRunsInPeriodicRow(img->width, a, b);
+  uint8 *row = ReserveRLERow(img, 0, num_runs);
+  uint32 x = 0;
+  for (uint32 k = 0; k < num_runs; k++)
+  {
+    uint32 len = (k % 2 == 0) ? a : b;
+    if (x + len > img->width)
+    {
+      len = img->width - x; // the last run may be cut at the image border
+    }
+    SetRun(row, img->run_size, k, len);
+    x += len;
+    NUMRUNS++;
+  }
+
+  struct arena *ar = img->arena[0];
+  struct rowinfo info = {ar->used, num_runs, 0, 0, ROW_RUNS};
+  ar->used += num_runs;
+  img->num_runs += num_runs;
+  return info;
+}
+
+/// Generate the distinct rows of a pattern image, if not done yet
+/// (The image is logically unchanged, so this is allowed on const images.)
+static void GeneratePatternRows(const Image img)
+{
+  assert(img->pattern != STORED);
+  if (img->num_arenas > 0)
+  {
+    return; // already generated
+  }
+
+  Image pat = (Image)img;
+  uint32 w = pat->width;
+
+  // Each distinct row alternates runs of lengths a[k] and b[k]
+  uint32 a[2], b[2];
+  int n = 1;
+  switch (pat->pattern)
+  {
+  case CHESSBOARD:
+  case VSTRIPES:
+    a[0] = b[0] = pat->period;
+    break;
+  case GRID:
+    // row 0: crossing the vertical lines; row 1: along a horizontal line
+    a[0] = pat->thickness;
+    b[0] = pat->period - pat->thickness;
+    a[1] = b[1] = w;
+    n = 2;
+    break;
+  default:
+    a[0] = b[0] = w; // a single run
+    break;
+  }
+
+  size_t capacity = 0;
+  for (int k = 0; k < n; k++)
+  {
+    capacity += GetNumRunsInPeriodicRow(w, a[k], b[k]);
+  }
+  AttachArena(pat, AllocateArena(capacity, pat->run_size));
+  for (int k = 0; k < n; k++)
+  {
+    pat->prow[k] = AppendPeriodicRow(pat, a[k], b[k]);
+  }
+}
+
+/// Get the descriptor of row i of a pattern image
+static struct rowinfo GetPatternRowInfo(const Image img, uint32 i)
+{
+  GeneratePatternRows(img);
+  struct rowinfo row = img->prow[0];
+  switch (img->pattern)
+  {
+  case CHESSBOARD:
+  case HSTRIPES:
+    // the color toggles every period rows
+    row.color = img->value ^ ((i / img->period) & 1);
+    break;
+  case GRID:
+    if (i % img->period < img->thickness)
+    {
+      row = img->prow[1];
+    }
+    row.color = img->value;
+    break;
+  default:
+    row.color = img->value;
+    break;
+  }
+  return row;
+}
+
+/// Get the end of the vertical span of row i of a pattern image:
+/// the rows [i, end) all have the descriptor of row i
+static uint32 GetPatternSpanEnd(const Image img, uint32 i)
+{
+  uint32 p = img->period;
+  uint64 end = img->height;
+  switch (img->pattern)
+  {
+  case CHESSBOARD:
+  case HSTRIPES:
+    end = ((uint64)i / p + 1) * p;
+    break;
+  case GRID:
+    end = (uint64)i - i % p + (i % p < img->thickness ? img->thickness : p);
+    break;
+  default:
+    break;
+  }
+  return end < img->height ? (uint32)end : img->height;
+}
+
+/// Compress into RLE format a packed (PBM) image row
+/// Appends the image row in RLE format to arena[k] of img, as row i
+/// (see PackedRowRuns).  A dense row is stored as a bitset instead: as soon
+/// as it is found to have more runs than its bitset has units, its words are
+/// copied as they are, only XORed with the first pixel.
+/// bytes is read in whole 64-bit words; the bits after the width are
+/// ignored.
+static void CompressPackedRow(Image img, uint32 i, uint16 k, const uint8 *bytes)
+{
+  uint32 image_width = img->width;
+  uint8 rs = img->run_size;
+  assert(image_width > 0);
+  assert(bytes != NULL);
+
+  // Reserve room for the worst case: a run per pixel
+  uint8 *RLE_row = ReserveRLERow(img, k, image_width);
+
+  uint8 color = bytes[0] >> 7;
+  uint32 max_runs = BitsetRows ? BitsUnits(img) : image_width;
+  uint32 num_runs = PackedRowRuns(bytes, image_width, RLE_row, rs, max_runs);
+  if (num_runs > 0)
+  {
+    CommitRLERow(img, i, k, color, num_runs);
+    return;
+  }
+
+  // A dense row (the bitset is shorter than the width, in runs)
+  uint32 words = BitsWords(image_width);
+  uint64 flip = -(uint64)color;
+  for (uint32 n = 0; n < words; n++)
+  {
+    StorePackedWord(RLE_row + 8 * n, LoadPackedWord(bytes + 8 * n) ^ flip);
+  }
+  if (image_width % 64 != 0)
+  {
+    uint8 *last = RLE_row + 8 * (words - 1);
+    StorePackedWord(last, LoadPackedWord(last) & ~(~(uint64)0 >> image_width % 64));
+  }
+  NUMOPS += words;
+  CommitRow(img, i, k, color, CountBitsRuns(RLE_row, image_width), ROW_BITS);
+}
+
+/// Pack the row i of an image into nbytes bytes, PBM style
+/// (8 pixels per byte, first pixel in the most significant bit), as worker
+/// w (for its scratch buffers).
+/// The bytes of each BLACK run are filled whole, with memset, and only
+/// the bytes at the run ends are masked; padding pixels are left WHITE.
+/// A bitset row read forwards is just copied, and XORed with its color.
+static void PackRow(const Image img, uint32 i, uint8 *bytes, size_t nbytes,
+                    int w)
+{
+  assert(nbytes * 8 >= img->width);
+  struct rowinfo row = GetRowInfo(img, i);
+  int pixel_value = GetRowColor(img, row);
+  int rev = (img->flip & FLIP_RUNS) != 0;
+  if (row.form == ROW_BITS && !rev)
+  {
+    const uint8 *bits = GetRowRuns(img, row);
+    size_t used = ((size_t)img->width + 8 - 1) / 8;
+    uint8 flip = -(uint8)pixel_value;
+    for (size_t k = 0; k < used; k++)
+    {
+      bytes[k] = bits[k] ^ flip;
+    }
+    if (img->width % 8 != 0)
+    {
+      bytes[used - 1] &= 0xFF << (8 - img->width % 8); // the padding
+    }
+    memset(bytes + used, 0, nbytes - used);
+    NUMOPS += BitsWords(img->width);
+    return;
+  }
+
+  // Go through the num_runs runs of the RLE row
+  // (backwards, in a view with FLIP_RUNS)
+  memset(bytes, 0, nbytes); // all WHITE
+  const uint8 *RLE_row = GetDecodedRuns(img, row, w, 0);
+  uint32 num_runs = row.num_runs;
+  uint32 x = 0;
+  for (uint32 k = 0; k < num_runs; k++)
+  {
+    // For each run
+    uint32 len = GetRun(RLE_row, img->run_size, rev ? num_runs - 1 - k : k);
+    if (pixel_value == BLACK)
+    {
+      SetPackedPixels(bytes, x, x + len); // pixels [x, end) are set
+    }
+    x += len;
+    NUMOPS++; // increment to account for the run written
+    // Next run
+    pixel_value ^= 1;
+  }
+}
+
+// Add your auxiliary functions here...
+
+// returns 0 if row i of img1 and row i of img2 have the same encoding
+// (both images must have the same width, hence the same run size,
+// and the same FLIP_RUNS orientation: the runs are compared as stored;
+// a bitset row and a row of runs, which only images built in different
+// modes may have for the same row, are compared by their runs)
+static uint32 lineIsEqual(const Image img1, const Image img2, uint32 i)
+{
+  struct rowinfo r1 = GetRowInfo(img1, i);
+  struct rowinfo r2 = GetRowInfo(img2, i);
+  uint32 num_runs = r1.num_runs;
+  if (num_runs != r2.num_runs || GetRowColor(img1, r1) != GetRowColor(img2, r2))
+  {
+    return 1;
+  }
+  if (r1.form != r2.form)
+  {
+    const uint8 *row1 = GetDecodedRuns(img1, r1, 0, 0);
+    const uint8 *row2 = GetDecodedRuns(img2, r2, 0, 1);
+    return memcmp(row1, row2, num_runs * img1->run_size) != 0;
+  }
+  const uint8 *row1 = GetRowRuns(img1, r1);
+  const uint8 *row2 = GetRowRuns(img2, r2);
+  if (row1 == row2)
+  {
+    return 0; // the images share this row
+  }
+  return memcmp(row1, row2, GetRowUnits(img1, r1) * img1->run_size) != 0;
+}
+
+// The row kernels are written once for a generic run size rs, and are
+// specialized for each run size by the dispatchers below, so that they work
+// directly on the compact run arrays.
+#define ROW_KERNEL static inline __attribute__((always_inline))
+
+// Get run k of a row of n runs, read backwards if rev
+ROW_KERNEL uint32 GetRowRun(const uint8 *runs, uint8 rs, uint32 n, uint32 k,
+                            int rev)
+{
+  return GetRun(runs, rs, rev ? n - 1 - k : k);
+}
+
+// Generic run merge: combines 2 encoded rows with any boolean operator,
+// given by its truth table (bit (2*v1 + v2) is the result for pixels v1, v2).
+// rslt must have room for the worst case, num_runs1 + num_runs2 - 1 runs;
+// returns the number of runs written to rslt
+// (the result row starts with color bit (2*value1 + value2) of table)
+// The loop walks the union of the run boundaries of both rows, by their
+// end positions, and closes the current result run only where the result
+// value changes. To keep the loop free of unpredictable branches, both
+// rows load their next run at every step (only the row(s) ending at the
+// boundary add it), and the current result run is always written
+// (it is only kept if closed).
+// A row with rev set (from a view with FLIP_RUNS) is read backwards.
+ROW_KERNEL uint32 rowBoolOpKernel(const uint8 *arr1, uint32 num_runs1, int value1,
+                                  int rev1, const uint8 *arr2, uint32 num_runs2,
+                                  int value2, int rev2, uint8 *rslt, uint8 rs,
+                                  uint32 width, uint8 table)
+{
+  uint32 index1 = 1, index2 = 1, rslt_index = 0;
+  uint32 end1 = GetRowRun(arr1, rs, num_runs1, 0, rev1); // end of the current
+  uint32 end2 = GetRowRun(arr2, rs, num_runs2, 0, rev2); // run of each row
+  uint32 start = 0; // start of the current result run
+  uint32 value = (table >> (2 * value1 + value2)) & 1;
+  uint32 steps = 0;
+
+  uint32 next = (end1 < end2) ? end1 : end2; // the next boundary
+  while (next < width)
+  {
+    uint32 step1 = (end1 == next);
+    uint32 step2 = (end2 == next);
+
+    // move to the next run of the row(s) ending here
+    // (a row that already ended rereads its last run, and ignores it)
+    uint32 len1 = GetRowRun(arr1, rs, num_runs1,
+                            index1 < num_runs1 ? index1 : num_runs1 - 1, rev1);
+    uint32 len2 = GetRowRun(arr2, rs, num_runs2,
+                            index2 < num_runs2 ? index2 : num_runs2 - 1, rev2);
+    end1 += len1 & -step1;
+    end2 += len2 & -step2;
+    index1 += step1;
+    index2 += step2;
+    value1 ^= step1;
+    value2 ^= step2;
+
+    // close the current result run if the value changes
+    uint32 newValue = (table >> (2 * value1 + value2)) & 1;
+    uint32 change = newValue ^ value;
+    SetRun(rslt, rs, rslt_index, next - start);
+    rslt_index += change;
+    start = change ? next : start;
+    value = newValue;
+
+    next = (end1 < end2) ? end1 : end2;
+    steps++;
+  }
+  SetRun(rslt, rs, rslt_index++, width - start); // Reached the end of the row
+  NUMOPS += steps;
+
+  return rslt_index;
+}
+
+// Define a dispatcher that calls a row kernel specialized for the run size
+// (and for rows read forwards, the common case)
+#define ROW_OP_CALL(name, rs, rev1, rev2)                                     \
+  name##Kernel(arr1, num_runs1, value1, rev1, arr2, num_runs2, value2, rev2,  \
+               rslt, rs, width, table)
+#define DEFINE_ROW_OP(name)                                                   \
+  static uint32 name(const uint8 *arr1, uint32 num_runs1, int value1,         \
+                     int rev1, const uint8 *arr2, uint32 num_runs2,           \
+                     int value2, int rev2, uint8 *rslt, uint8 rs,             \
+                     uint32 width, uint8 table)                               \
+  {                                                                           \
+    switch (rs)                                                               \
+    {                                                                         \
+    case sizeof(uint8):                                                       \
+      return (rev1 | rev2) ? ROW_OP_CALL(name, sizeof(uint8), rev1, rev2)     \
+                           : ROW_OP_CALL(name, sizeof(uint8), 0, 0);          \
+    case sizeof(uint16):                                                      \
+      return (rev1 | rev2) ? ROW_OP_CALL(name, sizeof(uint16), rev1, rev2)    \
+                           : ROW_OP_CALL(name, sizeof(uint16), 0, 0);         \
+    default:                                                                  \
+      return (rev1 | rev2) ? ROW_OP_CALL(name, sizeof(uint32), rev1, rev2)    \
+                           : ROW_OP_CALL(name, sizeof(uint32), 0, 0);         \
+    }                                                                         \
+  }
+
+DEFINE_ROW_OP(rowBoolOp)
+
+// Transition merge: combines 2 rows stored by the ends of their runs
+// (the last end is the width) with any boolean operator, given by its
+// truth table, into the ends of the runs of the result.
+// rslt must have room for num_runs1 + num_runs2 - 1 ends; returns the
+// number of ends written to rslt (the number of runs of the result)
+// The ends of both rows are merged in order, as sorted sets: no run
+// lengths are added up.  As in rowBoolOpKernel, the loop is free of
+// unpredictable branches: the current position is always written, and only
+// kept where the result value changes.
+// XOR (and XNOR) is the symmetric difference of the two sets: a position
+// is kept where exactly one of the rows changes color, and the value of the
+// result is not even computed.
+ROW_KERNEL uint32 rowEdgesOpKernel(const uint8 *arr1, int value1,
+                                   const uint8 *arr2, int value2, uint8 *rslt,
+                                   uint8 rs, uint32 width, uint8 table)
+{
+  uint32 index1 = 0, index2 = 0, rslt_index = 0;
+  uint32 x1 = GetRun(arr1, rs, 0), x2 = GetRun(arr2, rs, 0);
+  uint32 x = (x1 < x2) ? x1 : x2; // the next transition
+  if (table == BOOL_XOR || table == BOOL_XNOR)
+  {
+    while (x < width)
+    {
+      SetRun(rslt, rs, rslt_index, x);
+      rslt_index += (x1 != x2);
+      index1 += (x1 == x);
+      index2 += (x2 == x);
+      x1 = GetRun(arr1, rs, index1); // (the width, once a row ended)
+      x2 = GetRun(arr2, rs, index2);
+      x = (x1 < x2) ? x1 : x2;
+    }
+    NUMOPS += index1 + index2;
+  }
+  else
+  {
+    uint32 value = (table >> (2 * value1 + value2)) & 1;
+    while (x < width)
+    {
+      uint32 step1 = (x1 == x);
+      uint32 step2 = (x2 == x);
+      value1 ^= step1;
+      value2 ^= step2;
+      uint32 newValue = (table >> (2 * value1 + value2)) & 1;
+      SetRun(rslt, rs, rslt_index, x);
+      rslt_index += newValue ^ value;
+      value = newValue;
+      index1 += step1;
+      index2 += step2;
+      x1 = GetRun(arr1, rs, index1);
+      x2 = GetRun(arr2, rs, index2);
+      x = (x1 < x2) ? x1 : x2;
+    }
+    NUMOPS += index1 + index2;
+  }
+  SetRun(rslt, rs, rslt_index++, width); // Reached the end of the row
+  return rslt_index;
+}
+
+// Call the transition merge specialized for the run size
+static uint32 rowEdgesOp(const uint8 *arr1, int value1, const uint8 *arr2,
+                         int value2, uint8 *rslt, uint8 rs, uint32 width,
+                         uint8 table)
+{
+  switch (rs)
+  {
+  case sizeof(uint8):
+    return rowEdgesOpKernel(arr1, value1, arr2, value2, rslt, sizeof(uint8),
+                            width, table);
+  case sizeof(uint16):
+    return rowEdgesOpKernel(arr1, value1, arr2, value2, rslt, sizeof(uint16),
+                            width, table);
+  default:
+    return rowEdgesOpKernel(arr1, value1, arr2, value2, rslt, sizeof(uint32),
+                            width, table);
+  }
+}
+
+// Transition count: counts the pixels of each pair of values of 2 rows
+// stored by the ends of their runs (the last end is the width), merging
+// their ends as in rowEdgesOpKernel: counts[2*v1 + v2] gets the number of
+// pixels that are v1 in the first row and v2 in the second.
+// Only the lengths between consecutive transitions are added up, to the
+// BLACK pixels of each row and of both (masked by the values, so that the
+// loop keeps its sums in registers, with no branches); the other counts
+// follow from those.
+ROW_KERNEL void rowEdgesCountKernel(const uint8 *arr1, int value1,
+                                    const uint8 *arr2, int value2,
+                                    uint32 counts[4], uint8 rs, uint32 width)
+{
+  uint32 index1 = 0, index2 = 0;
+  uint32 x1 = GetRun(arr1, rs, 0), x2 = GetRun(arr2, rs, 0);
+  uint32 x = (x1 < x2) ? x1 : x2; // the next transition
+  uint32 start = 0;               // the last one
+  uint32 black1 = 0, black2 = 0, both = 0;
+  for (;;)
+  {
+    uint32 len = x - start;
+    black1 += len & -(uint32)value1;
+    black2 += len & -(uint32)value2;
+    both += len & -(uint32)(value1 & value2);
+    if (x >= width)
+    {
+      break; // Reached the end of the row
+    }
+    start = x;
+    uint32 step1 = (x1 == x);
+    uint32 step2 = (x2 == x);
+    value1 ^= step1;
+    value2 ^= step2;
+    index1 += step1;
+    index2 += step2;
+    x1 = GetRun(arr1, rs, index1);
+    x2 = GetRun(arr2, rs, index2);
+    x = (x1 < x2) ? x1 : x2;
+  }
+  counts[0] = width - black1 - black2 + both;
+  counts[1] = black2 - both;
+  counts[2] = black1 - both;
+  counts[3] = both;
+  NUMOPS += index1 + index2 + 1;
+}
+
+// Call the transition count specialized for the run size
+static void rowEdgesCount(const uint8 *arr1, int value1, const uint8 *arr2,
+                          int value2, uint32 counts[4], uint8 rs, uint32 width)
+{
+  switch (rs)
+  {
+  case sizeof(uint8):
+    rowEdgesCountKernel(arr1, value1, arr2, value2, counts, sizeof(uint8),
+                        width);
+    break;
+  case sizeof(uint16):
+    rowEdgesCountKernel(arr1, value1, arr2, value2, counts, sizeof(uint16),
+                        width);
+    break;
+  default:
+    rowEdgesCountKernel(arr1, value1, arr2, value2, counts, sizeof(uint32),
+                        width);
+  }
+}
+
+/// Apply a boolean operator (given by its truth table) to row r1 of img1
+/// and row r2 of img2 as bitsets, a word at a time, and commit the result
+/// as row i of rslt, as worker w
+/// A row of runs is first turned into a bitset (in reading order), and
+/// the result is stored as a bitset if it is dense, or decoded into runs.
+static void BitsRowOp(const Image img1, struct rowinfo r1, const Image img2,
+                      struct rowinfo r2, uint8 table, Image rslt, uint32 i,
+                      int w)
+{
+  uint32 width = rslt->width;
+  const uint8 *bits1 = GetRowBits(img1, r1, w, 0);
+  const uint8 *bits2 = GetRowBits(img2, r2, w, 1);
+  uint8 value1 = GetRowColor(img1, r1);
+  uint8 value2 = GetRowColor(img2, r2);
+  uint8 color = (table >> (2 * value1 + value2)) & 1;
+
+  // The truth table for the bits (the pixels XOR the first pixel) of the
+  // operands, giving the bits of the result
+  uint64 m[4];
+  for (int v = 0; v < 4; v++)
+  {
+    uint8 pixel = (table >> (2 * ((v >> 1) ^ value1) + ((v & 1) ^ value2))) & 1;
+    m[v] = -(uint64)(pixel ^ color);
+  }
+
+  size_t nbytes = (size_t)BitsWords(width) * 8;
+  uint8 *bits = ScratchRowBuffer(w, RSLT_BUFFER, nbytes);
+  uint32 num_runs = BitsBoolOp(bits1, bits2, bits, width, m);
+  if (IsDenseRow(rslt, num_runs))
+  {
+    memcpy(ReserveRLERow(rslt, w, BitsUnits(rslt)), bits, nbytes);
+    CommitRow(rslt, i, w, color, num_runs, ROW_BITS);
+  }
+  else
+  {
+    uint8 *runs = ReserveRLERow(rslt, w, num_runs);
+    PackedRowRuns(bits, width, runs, rslt->run_size, UINT32_MAX);
+    CommitRow(rslt, i, w, color, num_runs, ROW_RUNS);
+  }
+}
+
+// The state of ImageRowOp, shared by its workers
+struct rowopjob
+{
+  Image img1, img2, rslt;
+  uint8 table;
+  struct rowdict *memo[MAX_THREADS]; // the row pairs seen by each worker
+};
+
+/// Apply the boolean operator of job to the rows [lo, hi), as worker w
+static void RowOpRange(void *ctx, uint32 lo, uint32 hi, int w)
+{
+  struct rowopjob *job = ctx;
+  Image img1 = job->img1, img2 = job->img2, rslt = job->rslt;
+  struct rowdict *memo = job->memo[w];
+  // The rows of views with FLIP_RUNS are read backwards, where they are
+  int rev1 = (img1->flip & FLIP_RUNS) != 0;
+  int rev2 = (img2->flip & FLIP_RUNS) != 0;
+
+  // Each pair of vertical spans of the operands is computed once
+  for (uint32 row_index = lo, next1, next2; row_index < hi;)
+  {
+    struct rowinfo r1 = GetRowSpan(img1, row_index, &next1);
+    struct rowinfo r2 = GetRowSpan(img2, row_index, &next2);
+    uint32 next = next1 < next2 ? next1 : next2;
+    next = next < hi ? next : hi;
+    const uint8 *row1 = GetRowRuns(img1, r1);
+    const uint8 *row2 = GetRowRuns(img2, r2);
+    uint32 num_runs1 = r1.num_runs;
+    uint32 num_runs2 = r2.num_runs;
+    uint8 value1 = GetRowColor(img1, r1);
+    uint8 value2 = GetRowColor(img2, r2);
+
+    // Was this pair of rows seen before (by this worker)?
+    uintptr_t key[3] = {(uintptr_t)row1, (uintptr_t)row2,
+                        (uintptr_t)num_runs1 << 2 | value1 << 1 | value2};
+    uint64 hash = HashBytes((const uint8 *)key, sizeof(key), 0);
+    size_t pos = hash & memo->mask;
+    uint32 j;
+    while ((j = RowDictNext(memo, hash, &pos)) != NO_ROW)
+    {
+      struct rowinfo o1 = GetRowInfo(img1, j);
+      struct rowinfo o2 = GetRowInfo(img2, j);
+      if (GetRowRuns(img1, o1) == row1 && GetRowRuns(img2, o2) == row2 &&
+          o1.num_runs == num_runs1 && o2.num_runs == num_runs2 &&
+          GetRowColor(img1, o1) == value1 && GetRowColor(img2, o2) == value2)
+      {
+        break;
+      }
+    }
+    if (j != NO_ROW)
+    {
+      rslt->row[row_index] = rslt->row[j]; // reuse the result of that pair
+    }
+    else
+    {
+      if (!RowDictIsFull(memo))
+      {
+        RowDictInsert(memo, hash, pos, row_index);
+      }
+
+      uint8 color = (job->table >> (2 * value1 + value2)) & 1;
+      if (r1.form == ROW_BITS || r2.form == ROW_BITS)
+      {
+        BitsRowOp(img1, r1, img2, r2, job->table, rslt, row_index, w);
+      }
+      else if ((r1.form == ROW_EDGES || r2.form == ROW_EDGES) && !rev1 && !rev2)
+      {
+        // Merge the transitions (those of a row of runs are computed)
+        const uint8 *edges1 = GetRowEdges(img1, r1, w, 0);
+        const uint8 *edges2 = GetRowEdges(img2, r2, w, 1);
+        uint8 *rslt_row = ReserveRLERow(rslt, w, num_runs1 + num_runs2 - 1);
+        uint32 num_runs = rowEdgesOp(edges1, value1, edges2, value2, rslt_row,
+                                     rslt->run_size, rslt->width, job->table);
+        if (EdgeRows && !IsDenseRow(rslt, num_runs))
+        {
+          CommitRow(rslt, row_index, w, color, num_runs, ROW_EDGES);
+        }
+        else
+        {
+          EdgesToRuns(rslt_row, rslt->run_size, num_runs);
+          CommitRLERow(rslt, row_index, w, color, num_runs);
+        }
+      }
+      else
+      {
+        // (the transitions of a row read backwards are decoded into runs)
+        row1 = GetDecodedRuns(img1, r1, w, 0);
+        row2 = GetDecodedRuns(img2, r2, w, 1);
+        uint8 *rslt_row = ReserveRLERow(rslt, w, num_runs1 + num_runs2 - 1);
+        uint32 num_runs = rowBoolOp(row1, num_runs1, value1, rev1, row2,
+                                    num_runs2, value2, rev2, rslt_row,
+                                    rslt->run_size, rslt->width, job->table);
+        CommitRLERow(rslt, row_index, w, color, num_runs);
+      }
+    }
+    for (uint32 r = row_index + 1; r < next; r++)
+    {
+      rslt->row[r] = rslt->row[row_index]; // the rest of the span
+    }
+    rslt->arena[w]->last = next - 1; // (the next row may share its runs)
+    row_index = next;
+  }
+}
+
+/// Apply a boolean operator to each pair of rows of img1 and img2
+/// The result for pixels (v1, v2) is bit (2*v1 + v2) of table.
+/// Each distinct pair of operand rows (same runs and colors) is computed
+/// only once (per worker): repeated pairs share the result row, and the
+/// rows of a pair of vertical spans are not even looked up.
+/// The result is built in dst (see PrepareResult), or in a new image.
+static Image ImageRowOp(Image dst, const Image img1, const Image img2, uint8 table)
+{
+  assert((img1->height == img2->height) && (img1->width == img2->width));
+  uint32 height = img1->height;
+  if (dst != NULL && (dst == img1 || dst == img2))
+  {
+    // the operands must not change while they are read
+    MoveImage(dst, ImageRowOp(NULL, img1, img2, table));
+    return dst;
+  }
+
+  // The rows of pattern operands are generated before the workers read them
+  if (img1->pattern != STORED)
+  {
+    GeneratePatternRows(img1);
+  }
+  if (img2->pattern != STORED)
+  {
+    GeneratePatternRows(img2);
+  }
+
+  // allocate memory for the resulting image
+  // (each result row is shorter than the two operand rows together)
+  int workers = PlanWorkers(height);
+  struct rowopjob job = {img1, img2, NULL, table, {NULL}};
+  job.rslt = PrepareResult(dst, img1->width, height,
+                           img1->num_runs + img2->num_runs, workers);
+  for (int w = 0; w < workers; w++)
+  {
+    job.memo[w] = ScratchRowDict(w, height / workers);
+  }
+
+  ParallelFor(height, workers, RowOpRange, &job);
+
+  FinishResult(job.rslt, dst);
+
+  return job.rslt;
+}
+
+// N-ary operations combine k images at once, with a k-way run merge.
+// The pixel function of the inputs is a small compiled expression:
+// either a reduction, computed from the number of BLACK inputs,
+// or a postfix program over the input pixels.
+
+// Opcodes of the postfix program (below them, an input index pushes
+// the pixel of that input)
+enum exprop
+{
+  OP_ZERO = 0xFFF0,
+  OP_ONE,
+  OP_NOT,
+  OP_AND,
+  OP_XOR,
+  OP_OR
+};
+
+#define NO_REDUCE 0xFF
+#define MAX_EXPR_DEPTH 64 // the evaluation stack is the bits of a uint64
+
+struct expr
+{
+  uint8 reduce; // REDUCE_* or NO_REDUCE
+  uint32 k;     // number of inputs
+  uint32 len;   // length of the program
+  uint16 *code; // the postfix program
+};
+
+// Recursive descent compiler for expressions, with C precedence:
+//   or := xor ('|' xor)* ; xor := and ('^' and)* ; and := not ('&' not)*
+//   not := '~' not | '(' or ')' | letter | '0' | '1'
+// Each function returns the stack depth its code needs, or 0 on error.
+struct exprparser
+{
+  const char *p; // next character
+  struct expr *e;
+};
+
+static int ParseExprOr(struct exprparser *ps);
+
+static char NextExprChar(struct exprparser *ps)
+{
+  while (isspace((unsigned char)*ps->p))
+  {
+    ps->p++;
+  }
+  return *ps->p;
+}
+
+static int ParseExprNot(struct exprparser *ps)
+{
+  char c = NextExprChar(ps);
+  ps->p++;
+  int depth;
+  if (c == '~')
+  {
+    depth = ParseExprNot(ps);
+    ps->e->code[ps->e->len++] = OP_NOT;
+  }
+  else if (c == '(')
+  {
+    depth = ParseExprOr(ps);
+    if (NextExprChar(ps) != ')')
+    {
+      return 0;
+    }
+    ps->p++;
+  }
+  else if (c >= 'A' && c < 'A' + (int)ps->e->k)
+  {
+    depth = 1;
+    ps->e->code[ps->e->len++] = c - 'A';
+  }
+  else if (c == '0' || c == '1')
+  {
+    depth = 1;
+    ps->e->code[ps->e->len++] = (c == '0') ? OP_ZERO : OP_ONE;
+  }
+  else
+  {
+    return 0;
+  }
+  return depth;
+}
+
+// Parse a left-associative chain of operands joined by the operator c
+static int ParseExprChain(struct exprparser *ps, char c, uint16 op,
+                          int (*operand)(struct exprparser *))
+{
+  int depth = operand(ps);
+  while (depth > 0 && NextExprChar(ps) == c)
+  {
+    ps->p++;
+    int right = operand(ps);
+    if (right == 0)
+    {
+      return 0;
+    }
+    depth = (right + 1 > depth) ? right + 1 : depth;
+    ps->e->code[ps->e->len++] = op;
+  }
+  return depth;
+}
+
+static int ParseExprAnd(struct exprparser *ps)
+{
+  return ParseExprChain(ps, '&', OP_AND, ParseExprNot);
+}
+
+static int ParseExprXor(struct exprparser *ps)
+{
+  return ParseExprChain(ps, '^', OP_XOR, ParseExprAnd);
+}
+
+static int ParseExprOr(struct exprparser *ps)
+{
+  return ParseExprChain(ps, '|', OP_OR, ParseExprXor);
+}
+
+/// Compile an expression over k inputs, named A, B, C, ...
+/// Returns 0 if expr is not a valid expression, nonzero otherwise.
+static int CompileExpr(struct expr *e, uint32 k, const char *expr)
+{
+  e->reduce = NO_REDUCE;
+  e->k = k;
+  e->len = 0;
+  e->code = malloc((strlen(expr) + 1) * sizeof(uint16)); // an op per char
+  check(e->code != NULL, "malloc");
+  struct exprparser ps = {expr, e};
+  int depth = ParseExprOr(&ps);
+  return depth > 0 && depth <= MAX_EXPR_DEPTH && NextExprChar(&ps) == '\0';
+}
+
+/// Evaluate an expression, given the pixels of the inputs
+/// (bit j of pixels is the pixel of input j, for expressions over
+/// at most 26 inputs) and the number of BLACK inputs (for reductions)
+static inline uint8 EvalExpr(const struct expr *e, uint32 pixels, uint32 count)
+{
+  switch (e->reduce)
+  {
+  case REDUCE_AND:
+    return count == e->k;
+  case REDUCE_OR:
+    return count > 0;
+  case REDUCE_XOR:
+    return count & 1;
+  case REDUCE_MAJORITY:
+    return 2 * count > e->k;
+  }
+  uint64 stack = 0; // the top is bit 0
+  for (uint32 n = 0; n < e->len; n++)
+  {
+    uint16 op = e->code[n];
+    switch (op)
+    {
+    case OP_ZERO:
+      stack <<= 1;
+      break;
+    case OP_ONE:
+      stack = stack << 1 | 1;
+      break;
+    case OP_NOT:
+      stack ^= 1;
+      break;
+    case OP_AND:
+      stack = (stack >> 1) & (stack | ~(uint64)1);
+      break;
+    case OP_XOR:
+      stack = (stack >> 1) ^ (stack & 1);
+      break;
+    case OP_OR:
+      stack = (stack >> 1) | (stack & 1);
+      break;
+    default:
+      stack = stack << 1 | ((pixels >> op) & 1);
+      break;
+    }
+  }
+  return stack & 1;
+}
+
+// Restore the heap property of a min-heap of input indices, keyed by
+// end[], after the key of the input at position pos grew
+static inline void SiftDown(uint32 *heap, uint32 n, const uint32 *end, uint32 pos)
+{
+  uint32 j = heap[pos];
+  for (;;)
+  {
+    uint32 child = 2 * pos + 1;
+    if (child >= n)
+    {
+      break;
+    }
+    if (child + 1 < n && end[heap[child + 1]] < end[heap[child]])
+    {
+      child++;
+    }
+    if (end[heap[child]] >= end[j])
+    {
+      break;
+    }
+    heap[pos] = heap[child];
+    pos = child;
+  }
+  heap[pos] = j;
+}
+
+/// Apply an expression to each k-tuple of rows of imgs, with a k-way merge
+/// Each row is merged in one of two ways:
+/// - sparse rows (few runs for the width) keep the inputs in a min-heap,
+///   by the end of their current run: at each run boundary, the input(s)
+///   ending there move to their next run;
+/// - dense rows first scatter the changes at each boundary (in the count
+///   of BLACK inputs, or in the input pixels) into an array indexed by
+///   position, which is then swept from left to right.
+/// Either way, a result run is closed where the expression value changes.
+/// When all input rows are the same as in the previous row (e.g., in
+/// vertical spans of all inputs, or repeated or pattern rows), the previous
+/// result row is shared.
+/// The result is built in dst (see PrepareResult), or in a new image.
+static Image ImageKWayOp(Image dst, const Image imgs[], uint32 k,
+                         const struct expr *e)
+{
+  uint32 width = imgs[0]->width;
+  uint32 height = imgs[0]->height;
+  uint8 rs = imgs[0]->run_size;
+  int reduce = (e->reduce != NO_REDUCE);
+
+  size_t capacity = 0;
+  for (uint32 j = 0; j < k; j++)
+  {
+    assert(imgs[j]->width == width && imgs[j]->height == height);
+    capacity += imgs[j]->num_runs;
+    if (dst != NULL && dst == imgs[j])
+    {
+      // the inputs must not change while they are read
+      MoveImage(dst, ImageKWayOp(NULL, imgs, k, e));
+      return dst;
+    }
+  }
+  for (uint32 j = 0; j < k; j++)
+  {
+    ResolveRuns(imgs[j]);
+  }
+  Image rslt = PrepareResult(dst, width, height, capacity, 1);
+
+  // The merge state of each input
+  const uint8 **runs = malloc(k * sizeof(const uint8 *));
+  struct rowinfo *row = malloc(k * sizeof(struct rowinfo));
+  uint32 *index = malloc(k * sizeof(uint32));
+  uint32 *end = malloc(k * sizeof(uint32));
+  uint32 *heap = malloc(k * sizeof(uint32));
+  // The runs decoded from the bitset rows and rows of transitions of each
+  // input (allocated when first needed)
+  uint8 **decoded = calloc(k, sizeof(uint8 *));
+  // The changes at each position, for dense rows (all zero between rows)
+  uint32 *change = calloc((size_t)width + 1, sizeof(uint32));
+  check(runs != NULL && row != NULL && index != NULL && end != NULL &&
+            heap != NULL && decoded != NULL && change != NULL,
+        "malloc");
+
+  uint32 span_end = 0; // end of the vertical spans of all inputs
+  for (uint32 i = 0; i < height; i++)
+  {
+    // Same input rows as the previous row?
+    if (i < span_end)
+    {
+      rslt->row[i] = rslt->row[i - 1]; // reuse the previous result row
+      rslt->arena[0]->last = i;
+      continue;
+    }
+    int same = (i > 0);
+    size_t max_runs = 1;
+    uint32 count = 0;  // number of BLACK inputs
+    uint32 pixels = 0; // pixel of each input (for expressions)
+    span_end = height;
+    for (uint32 j = 0; j < k; j++)
+    {
+      uint32 next;
+      struct rowinfo r = GetRowSpan(imgs[j], i, &next);
+      span_end = next < span_end ? next : span_end;
+      same = same && IsSameRowInfo(r, row[j]);
+      row[j] = r;
+      runs[j] = GetRowRuns(imgs[j], r);
+      count += r.color;
+      pixels |= reduce ? 0 : (uint32)r.color << j;
+      max_runs += r.num_runs - 1;
+    }
+    if (same)
+    {
+      rslt->row[i] = rslt->row[i - 1]; // reuse the previous result row
+      rslt->arena[0]->last = i;
+      continue;
+    }
+    for (uint32 j = 0; j < k; j++)
+    {
+      if (row[j].form != ROW_RUNS)
+      {
+        if (decoded[j] == NULL)
+        {
+          decoded[j] = malloc((size_t)width * rs);
+          check(decoded[j] != NULL, "malloc");
+        }
+        DecodeRowRuns(imgs[j], row[j], decoded[j]);
+        runs[j] = decoded[j];
+      }
+    }
+
+    uint8 *rslt_row = ReserveRLERow(rslt, 0, max_runs);
+    uint8 color = EvalExpr(e, pixels, count);
+    uint8 current = color;
+    uint32 num_runs = 0;
+    uint32 start = 0; // start of the current result run
+    if ((size_t)width <= 64 * max_runs)
+    {
+      // Dense row: scatter the changes at the run boundaries of each input
+      for (uint32 j = 0; j < k; j++)
+      {
+        uint32 x = 0;
+        uint32 black = row[j].color;
+        for (uint32 n = 0; n + 1 < row[j].num_runs; n++)
+        {
+          x += GetRun(runs[j], rs, n);
+          black ^= 1;
+          change[x] += reduce ? (black ? 1 : (uint32)-1) : (uint32)1 << j;
+        }
+        NUMOPS += row[j].num_runs;
+      }
+      // And sweep them
+      for (uint32 x = 1; x < width; x++)
+      {
+        if (change[x] == 0)
+        {
+          continue;
+        }
+        count += change[x];
+        pixels ^= change[x];
+        change[x] = 0;
+        uint8 newValue = EvalExpr(e, pixels, count);
+        if (newValue != current)
+        {
+          SetRun(rslt_row, rslt->run_size, num_runs++, x - start);
+          start = x;
+          current = newValue;
+        }
+      }
+    }
+    else
+    {
+      // Sparse row: build the heap of inputs, by the end of their current run
+      for (uint32 j = 0; j < k; j++)
+      {
+        index[j] = 1;
+        end[j] = GetRun(runs[j], rs, 0);
+        heap[j] = j;
+      }
+      for (uint32 pos = k / 2; pos-- > 0;)
+      {
+        SiftDown(heap, k, end, pos);
+      }
+      uint32 next;
+      while ((next = end[heap[0]]) < width)
+      {
+        // move every input ending here to its next run
+        do
+        {
+          uint32 j = heap[0];
+          uint32 black = ((row[j].color + index[j]) & 1); // of the next run
+          count += black ? 1 : -1;
+          pixels ^= reduce ? 0 : (uint32)1 << j;
+          end[j] += GetRun(runs[j], rs, index[j]++);
+          SiftDown(heap, k, end, 0);
+          NUMOPS++;
+        } while (end[heap[0]] == next);
+
+        // close the current result run if the value changes
+        uint8 newValue = EvalExpr(e, pixels, count);
+        if (newValue != current)
+        {
+          SetRun(rslt_row, rslt->run_size, num_runs++, next - start);
+          start = next;
+          current = newValue;
+        }
+      }
+    }
+    SetRun(rslt_row, rslt->run_size, num_runs++, width - start);
+    CommitRLERow(rslt, i, 0, color, num_runs);
+  }
+
+  for (uint32 j = 0; j < k; j++)
+  {
+    free(decoded[j]);
+  }
+  free(decoded);
+  free(change);
+  free(heap);
+  free(end);
+  free(index);
+  free(row);
+  free(runs);
+  FinishResult(rslt, dst);
+
+  return rslt;
+}
+
+/// Image management functions
+
+/// Create a new BW image, either BLACK or WHITE.
+///   width, height : the dimensions of the new image.
+///   val: the pixel color (BLACK or WHITE).
+/// Requires: width and height must be non-negative, val is either BLACK or
+/// WHITE.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageCreate(uint32 width, uint32 height, uint8 val)
+{
+  assert(width > 0 && height > 0);
+  assert(val == WHITE || val == BLACK);
+
+  // All image pixels have the same value:
+  // a single row, generated when first needed, is shared by all rows
+  return NewPatternImage(width, height, SOLID, val, 1, 0);
+}
+
+/// Create a new BW image, with a perfect CHESSBOARD pattern.
+///   width, height : the dimensions of the new image.
+///   square_edge : the lenght of the edges of the sqares making up the
+///   chessboard pattern.
+///   first_value: the pixel color (BLACK or WHITE) of the
+///   first image pixel.
+/// Requires: width and height must be non-negative, val is either BLACK or
+/// WHITE.
+/// Requires: for the squares, width and height must be multiples of the
+/// edge lenght of the squares
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageCreateChessboard(uint32 width, uint32 height, uint32 square_edge,
+                            uint8 first_value)
+{
+  assert(width > 0 && height > 0);
+  assert(first_value == WHITE || first_value == BLACK);
+  assert(square_edge > 0);
+  // width and height need not be multiples of square_edge:
+  // the squares at the right and bottom borders are cut.
+
+  // All rows have the same runs, and only the color of the first run
+  // changes, every square_edge rows: the row is generated when first needed.
+  return NewPatternImage(width, height, CHESSBOARD, first_value, square_edge, 0);
+}
+
+/// Create a new BW image, with a pattern of stripes of alternating colors.
+///   width, height : the dimensions of the new image.
+///   stripe_width : the width of each stripe.
+///   vertical : nonzero for vertical stripes, zero for horizontal stripes.
+///   first_value: the pixel color (BLACK or WHITE) of the first stripe.
+/// Requires: width, height and stripe_width must be positive,
+/// first_value is either BLACK or WHITE.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageCreateStripes(uint32 width, uint32 height, uint32 stripe_width,
+                         int vertical, uint8 first_value)
+{
+  assert(width > 0 && height > 0);
+  assert(first_value == WHITE || first_value == BLACK);
+  assert(stripe_width > 0);
+
+  return NewPatternImage(width, height, vertical ? VSTRIPES : HSTRIPES,
+                         first_value, stripe_width, 0);
+}
+
+/// Create a new BW image, with a grid of lines over a background
+/// of the opposite color.
+///   width, height : the dimensions of the new image.
+///   spacing : the distance between consecutive lines (of both directions).
+///   thickness : the thickness of the lines.
+///   line_value: the pixel color (BLACK or WHITE) of the lines.
+/// The first line of each direction starts at the first row/column.
+/// Requires: width and height must be positive, 0 < thickness < spacing,
+/// line_value is either BLACK or WHITE.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageCreateGrid(uint32 width, uint32 height, uint32 spacing,
+                      uint32 thickness, uint8 line_value)
+{
+  assert(width > 0 && height > 0);
+  assert(line_value == WHITE || line_value == BLACK);
+  assert(0 < thickness && thickness < spacing);
+
+  return NewPatternImage(width, height, GRID, line_value, spacing, thickness);
+}
+
+/// Destroy the image pointed to by (*imgp).
+///   imgp : address of an Image variable.
+/// If (*imgp)==NULL, no operation is performed.
+/// Ensures: (*imgp)==NULL.
+/// Should never fail.
+void ImageDestroy(Image *imgp)
+{
+  assert(imgp != NULL);
+
+  Image img = *imgp;
+  if (img == NULL)
+  {
+    return;
+  }
+
+  for (uint16 k = 0; k < img->num_arenas; k++)
+  {
+    ReleaseArena(img->arena[k]);
+  }
+  ReleaseRowTable(img);
+  PoolFree(img->arena, img->max_arenas * sizeof(struct arena *));
+  PoolFree(img, sizeof(struct image));
+
+  *imgp = NULL;
+}
+
+/// Printing on the console
+
+/// Output the raw BW image
+void ImageRAWPrint(const Image img)
+{
+  assert(img != NULL);
+  ResolveRuns(img);
+
+  printf("width = %d height = %d\n", img->width, img->height);
+  printf("RAW image:\n");
+
+  // Print the pixels of each image row
+  for (uint32 i = 0; i < img->height; i++)
+  {
+    struct rowinfo info = GetRowInfo(img, i);
+    const uint8 *row = GetDecodedRuns(img, info, 0, 0);
+    // The value of the first pixel in the current row
+    int pixel_value = info.color;
+    uint32 num_runs = info.num_runs;
+    for (uint32 j = 0; j < num_runs; j++)
+    {
+      // Print the current run of pixels
+      uint32 len = GetRun(row, img->run_size, j);
+      for (uint32 k = 0; k < len; k++)
+      {
+        printf("%d", pixel_value);
+      }
+      // Switch (XOR) to the pixel value for the next run, if any
+      pixel_value ^= 1;
+    }
+    // At current row end
+    printf("\n");
+  }
+  printf("\n");
+}
+
+/// Output the compressed RLE image
+void ImageRLEPrint(const Image img)
+{
+  assert(img != NULL);
+  ResolveRuns(img);
+
+  printf("width = %d height = %d\n", img->width, img->height);
+  printf("RLE encoding:\n");
+
+  // Print the compressed rows information
+  for (uint32 i = 0; i < img->height; i++)
+  {
+    struct rowinfo info = GetRowInfo(img, i);
+    const uint8 *row = GetDecodedRuns(img, info, 0, 0);
+    uint32 num_runs = info.num_runs;
+    printf("%d ", info.color);
+    for (uint32 j = 0; j < num_runs; j++)
+    {
+      printf("%u ", GetRun(row, img->run_size, j));
+    }
+    printf("%d\n", EOR);
+  }
+  printf("\n");
+}
+
+/// Native RLE file operations
+
+// Native RLE file format (.rle files)
+// The image is stored as it is laid out in memory, in the byte order
+// and struct layout of the host:
+//   struct rlefile header;
+//   struct rowinfo row[height];   the row table, all rows in arena 0
+//   uint8 runs[num_runs * run_size];
+// Rows shared within the image (repeated or interned rows) are stored once,
+// and rows are stored in their form: bitset rows as bitsets (num_runs counts
+// run-sized units), rows of transitions by the ends of their runs.
+// The row table is an index to the runs: any range of rows may be
+// read without reading the rest of the file.
+struct rlefile
+{
+  char magic[8];      // RLE_MAGIC
+  uint32 width;
+  uint32 height;
+  uint64 num_runs;    // number of runs stored
+  uint8 run_size;     // bytes per run
+  uint8 rowinfo_size; // sizeof(struct rowinfo), to reject foreign layouts
+  uint8 pad[6];
+};
+
+#define RLE_MAGIC "AEDRLE2"
+
+/// Does filename name a native RLE file (by its .rle extension)?
+static int IsRLEFileName(const char *filename)
+{
+  size_t n = strlen(filename);
+  return n >= 4 && strcmp(filename + n - 4, ".rle") == 0;
+}
+
+/// Save image to a native RLE file
+static int SaveRLEFile(const Image img, const char *filename)
+{
+  ResolveRuns(img);
+  uint32 height = img->height;
+  uint8 rs = img->run_size;
+  FILE *f = NULL;
+
+  // Build the row table of the file, with offsets into a single run array
+  // Rows sharing the same runs (same arena and offset) are stored once.
+  struct rowinfo *table = malloc((height + 1) * sizeof(struct rowinfo));
+  check(table != NULL, "malloc");
+  struct rowdict *seen = AllocateRowDict(height);
+  uint64 num_runs = 0;
+  for (uint32 i = 0, next = 0; i < height; i++)
+  {
+    if (i < next)
+    {
+      table[i] = table[i - 1]; // in the vertical span of row i-1
+      continue;
+    }
+    struct rowinfo row = GetRowSpan(img, i, &next);
+    uint64 key[3] = {row.arena, row.offset, (uint64)row.num_runs << 1 | row.form};
+    uint64 hash = HashBytes((const uint8 *)key, sizeof(key), 0);
+    size_t pos = hash & seen->mask;
+    uint32 j;
+    while ((j = RowDictNext(seen, hash, &pos)) != NO_ROW)
+    {
+      struct rowinfo other = GetRowInfo(img, j);
+      if (other.arena == row.arena && other.offset == row.offset &&
+          other.num_runs == row.num_runs && other.form == row.form)
+      {
+        break;
+      }
+    }
+    table[i] = row;
+    table[i].arena = 0;
+    if (j != NO_ROW)
+    {
+      table[i].offset = table[j].offset; // stored already
+      continue;
+    }
+    RowDictInsert(seen, hash, pos, i);
+    table[i].offset = num_runs;
+    num_runs += GetRowUnits(img, row);
+  }
+
+  struct rlefile header = {RLE_MAGIC, img->width, height, num_runs, rs,
+                           sizeof(struct rowinfo), {0}};
+  check((f = fopen(filename, "wb")) != NULL, "Open failed");
+  check(fwrite(&header, sizeof(header), 1, f) == 1, "Writing header failed");
+  check(fwrite(table, sizeof(struct rowinfo), height, f) == height,
+        "Writing row table failed");
+
+  // The runs of each stored row, in the order of their offsets
+  uint64 written = 0;
+  for (uint32 i = 0; i < height; i++)
+  {
+    if (table[i].offset == written)
+    {
+      struct rowinfo row = GetRowInfo(img, i);
+      uint32 n = GetRowUnits(img, row);
+      check(fwrite(GetRowRuns(img, row), rs, n, f) == n, "Writing runs failed");
+      written += n;
+    }
+  }
+  assert(written == num_runs);
+
+  // Cleanup
+  DestroyRowDict(seen);
+  free(table);
+  fclose(f);
+  return 0;
+}
+
+/// Load count rows of a native RLE file, starting at row first
+/// (count may be UINT32_MAX, to load all rows from first on)
+/// Are the stored runs of a row of an image (read from a file) valid?
+/// Runs must be positive and add up to the width, transitions must
+/// increase up to the width, and the padding bits of a bitset row must be
+/// 0 (and its runs as many as num_runs says).  Takes O(runs) time.
+static int IsValidStoredRow(const Image img, struct rowinfo row)
+{
+  const uint8 *runs = GetRowRuns(img, row);
+  uint8 rs = img->run_size;
+  uint32 width = img->width;
+  if (row.form == ROW_BITS)
+  {
+    size_t nbytes = (size_t)BitsWords(width) * 8;
+    if (width % 8 != 0 && (runs[width / 8] & (0xFF >> (width % 8))) != 0)
+    {
+      return 0;
+    }
+    for (size_t b = (width + 7) / 8; b < nbytes; b++)
+    {
+      if (runs[b] != 0)
+      {
+        return 0;
+      }
+    }
+    return CountBitsRuns(runs, width) == row.num_runs;
+  }
+  uint64 end = 0; // (the sum of the runs may overflow 32 bits)
+  for (uint32 k = 0; k < row.num_runs; k++)
+  {
+    uint64 run = GetRun(runs, rs, k);
+    if (row.form == ROW_EDGES)
+    {
+      if (run <= end)
+      {
+        return 0;
+      }
+      end = run;
+    }
+    else
+    {
+      if (run == 0)
+      {
+        return 0;
+      }
+      end += run;
+    }
+  }
+  return end == width;
+}
+
+static Image LoadRLEFile(const char *filename, uint32 first, uint32 count)
+{
+  FILE *f = NULL;
+  struct rlefile header;
+
+  check((f = fopen(filename, "rb")) != NULL, "Open failed");
+  check(fread(&header, sizeof(header), 1, f) == 1 &&
+            memcmp(header.magic, RLE_MAGIC, sizeof(header.magic)) == 0 &&
+            header.rowinfo_size == sizeof(struct rowinfo) &&
+            header.width > 0 &&
+            header.run_size == RunSizeForWidth(header.width),
+        "Invalid file format");
+  check(first <= header.height, "Invalid row range");
+  if (count > header.height - first)
+  {
+    check(count == UINT32_MAX, "Invalid row range");
+    count = header.height - first;
+  }
+  check(count > 0, "Invalid row range");
+
+  // Read the row table entries of the range
+  long table_pos = sizeof(header) + (long)first * sizeof(struct rowinfo);
+  Image img = NewImageHeader(header.width, count, 1, STORED);
+  AllocateRowTable(img, count);
+  check(fseek(f, table_pos, SEEK_SET) == 0, "Seek failed");
+  check(fread(img->row, sizeof(struct rowinfo), count, f) == count,
+        "Reading row table");
+
+  // The runs of the range lie between the lowest and the highest offsets
+  size_t lo = header.num_runs, hi = 0;
+  for (uint32 i = 0; i < count; i++)
+  {
+    struct rowinfo *row = &img->row[i];
+    check(row->arena == 0 && row->color <= 1 && row->form <= ROW_EDGES &&
+              row->num_runs > 0 && row->num_runs <= header.width,
+          "Invalid row table");
+    size_t units = GetRowUnits(img, *row);
+    check(row->offset + units <= header.num_runs, "Invalid row table");
+    if (row->offset < lo)
+    {
+      lo = row->offset;
+    }
+    if (row->offset + units > hi)
+    {
+      hi = row->offset + units;
+    }
+  }
+
+  // Read them into a new arena, as they are: no re-encoding
+  struct arena *a = AllocateArena(hi - lo, header.run_size);
+  AttachArena(img, a);
+  long runs_pos = sizeof(header) + (long)header.height * sizeof(struct rowinfo) +
+                  (long)lo * header.run_size;
+  check(fseek(f, runs_pos, SEEK_SET) == 0, "Seek failed");
+  check(fread(a->runs, header.run_size, hi - lo, f) == hi - lo, "Reading runs");
+  a->used = hi - lo;
+  for (uint32 i = 0; i < count; i++)
+  {
+    img->row[i].offset -= lo;
+    img->num_runs += img->row[i].num_runs;
+    check(IsValidStoredRow(img, img->row[i]), "Invalid runs");
+  }
+  NUMRUNS += hi - lo;
+  CompactRowTable(img);
+  TrimRowTable(img);
+
+  fclose(f);
+  return img;
+}
+
+/// Load a range of rows of a native RLE file.
+/// Only the row table entries and the runs of those rows are read.
+/// On success, a new image is returned, with the same width and count rows.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageLoadRLERows(const char *filename, uint32 first, uint32 count)
+{ ///
+  assert(filename != NULL);
+  return LoadRLEFile(filename, first, count);
+}
+
+/// PBM BW file operations
+
+// See PBM format specification: http://netpbm.sourceforge.net/doc/pbm.html
+
+// Match and skip 0 or more comment lines in file f.
+// Comments start with a # and continue until the end-of-line, inclusive.
+// Returns the number of comments skipped.
+static int skipComments(FILE *f)
+{
+  char c;
+  int i = 0;
+  while (fscanf(f, "#%*[^\n]%c", &c) == 1 && c == '\n')
+  {
+    i++;
+  }
+  return i;
+}
+
+// Match and skip 0 or more comment lines in the mapped bytes, from *pos.
+// Same rules as skipComments().
+// Returns the number of comments skipped.
+static int skipMappedComments(const uint8 *map, size_t size, size_t *pos)
+{
+  int i = 0;
+  while (*pos + 1 < size && map[*pos] == '#' && map[*pos + 1] != '\n')
+  {
+    const uint8 *eol = memchr(map + *pos, '\n', size - *pos);
+    if (eol == NULL)
+    {
+      break;
+    }
+    *pos = eol - map + 1;
+    i++;
+  }
+  return i;
+}
+
+// Skip whitespace in the mapped bytes, from *pos
+static void skipMappedSpaces(const uint8 *map, size_t size, size_t *pos)
+{
+  while (*pos < size && isspace(map[*pos]))
+  {
+    (*pos)++;
+  }
+}
+
+// Parse a non-negative decimal number in the mapped bytes, at *pos
+// (after optional whitespace, as fscanf's %d).
+// Returns 1 on success, 0 if there is no number or it overflows an int.
+static int parseMappedInt(const uint8 *map, size_t size, size_t *pos, int *value)
+{
+  skipMappedSpaces(map, size, pos);
+  if (*pos >= size || !isdigit(map[*pos]))
+  {
+    return 0;
+  }
+  long v = 0;
+  while (*pos < size && isdigit(map[*pos]))
+  {
+    v = 10 * v + (map[(*pos)++] - '0');
+    if (v > INT_MAX)
+    {
+      return 0;
+    }
+  }
+  *value = (int)v;
+  return 1;
+}
+
+// The state of LoadMappedPBM, shared by its workers
+struct mappedjob
+{
+  Image img;
+  const uint8 *map; // the mapped file
+  size_t size;      // of the mapping
+  size_t pos;       // of the first row
+  size_t nbytes;    // number of bytes for each row
+};
+
+/// Compress the mapped rows [lo, hi), as worker w
+static void LoadMappedRange(void *ctx, uint32 lo, uint32 hi, int w)
+{
+  const struct mappedjob *job = ctx;
+  size_t nbytes = job->nbytes;
+
+  // CompressPackedRow reads whole 64-bit words: rows that would be read
+  // past the end of the mapping are first copied to a zero padded buffer.
+  size_t span = ((size_t)job->img->width + 64 - 1) / 64 * 8; // bytes read for each row
+  uint8 *last = NULL;
+  for (uint32 i = lo; i < hi; i++)
+  {
+    const uint8 *bytes = job->map + job->pos + i * nbytes;
+    if (job->pos + i * nbytes + span > job->size)
+    {
+      if (last == NULL)
+      {
+        last = calloc(nbytes / 8 + 1, 8);
+        check(last != NULL, "calloc");
+      }
+      memcpy(last, bytes, nbytes);
+      bytes = last;
+    }
+    CompressPackedRow(job->img, i, w, bytes);
+  }
+  free(last);
+}
+
+// Load a raw PBM file through a memory mapping.
+// The rows are decoded straight from the mapped pages, with no copy,
+// except for the last few rows, whose words would be read past the mapping.
+// Returns NULL if the file cannot be mapped (not a regular file, or empty).
+static Image LoadMappedPBM(const char *filename)
+{
+  int w, h;
+  int fd = open(filename, O_RDONLY);
+  check(fd >= 0, "Open failed");
+  struct stat st;
+  check(fstat(fd, &st) == 0, "Stat failed");
+  if (!S_ISREG(st.st_mode) || st.st_size == 0)
+  {
+    close(fd);
+    return NULL;
+  }
+  size_t size = (size_t)st.st_size;
+  const uint8 *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+  {
+    return NULL;
+  }
+  madvise((void *)map, size, MADV_SEQUENTIAL); // just a hint: let the kernel read ahead
+
+  // Parse PBM header
+  size_t pos = 0;
+  check(size >= 2 && map[0] == 'P' && map[1] == '4', "Invalid file format");
+  pos = 2;
+  skipMappedSpaces(map, size, &pos);
+  skipMappedComments(map, size, &pos);
+  check(parseMappedInt(map, size, &pos, &w), "Invalid width");
+  skipMappedSpaces(map, size, &pos);
+  skipMappedComments(map, size, &pos);
+  check(parseMappedInt(map, size, &pos, &h), "Invalid height");
+  check(pos < size && isspace(map[pos]), "Whitespace expected");
+  pos++;
+
+  size_t nbytes = ((size_t)w + 8 - 1) / 8; // number of bytes for each row
+  check(size - pos >= nbytes * h, "Reading pixels");
+
+  // Allocate image, with room for a few runs per row to start with
+  int workers = PlanWorkers(h);
+  Image img = AllocateWorkerImageHeader(w, h, 2 * (size_t)h, workers);
+
+  // Read pixels
+  struct mappedjob job = {img, map, size, pos, nbytes};
+  ParallelFor(h, workers, LoadMappedRange, &job);
+  FinishImage(img);
+
+  munmap((void *)map, size);
+  return img;
+}
+
+// Load a raw PBM file, reading the rows with stdio.
+static Image LoadStreamPBM(const char *filename)
+{
+  int w, h;
+  char c;
+  FILE *f = NULL;
+  Image img = NULL;
+
+  check((f = fopen(filename, "rb")) != NULL, "Open failed");
+  // Parse PBM header
+  check(fscanf(f, "P%c ", &c) == 1 && c == '4', "Invalid file format");
+  skipComments(f);
+  check(fscanf(f, "%d ", &w) == 1 && w >= 0, "Invalid width");
+  skipComments(f);
+  check(fscanf(f, "%d", &h) == 1 && h >= 0, "Invalid height");
+  check(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected");
+
+  // Allocate image, with room for a few runs per row to start with
+  img = AllocateImageHeader(w, h, 2 * (size_t)h);
+
+  // Read pixels
+  // The row buffer is rounded up to whole 64-bit words, zero padded,
+  // so that CompressPackedRow may read full words.
+  size_t nbytes = ((size_t)w + 8 - 1) / 8; // number of bytes for each row
+  uint8 *bytes = calloc(nbytes / 8 + 1, 8);
+  check(bytes != NULL, "calloc");
+  for (uint32 i = 0; i < img->height; i++)
+  {
+    check(fread(bytes, sizeof(uint8), nbytes, f) == nbytes, "Reading pixels");
+    CompressPackedRow(img, i, 0, bytes);
+  }
+  free(bytes);
+  FinishImage(img);
+
+  fclose(f);
+  return img;
+}
+
+/// Load a raw PBM file.
+/// Only binary PBM files are accepted,
+/// and native RLE files, named with the .rle extension.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageLoad(const char *filename)
+{ ///
+  if (IsRLEFileName(filename))
+  {
+    return LoadRLEFile(filename, 0, UINT32_MAX);
+  }
+  if (MappedLoad)
+  {
+    Image img = LoadMappedPBM(filename);
+    if (img != NULL)
+    {
+      return img;
+    }
+    // otherwise, fall back to stdio (e.g., for pipes)
+  }
+  return LoadStreamPBM(filename);
+}
+
+// Size of the buffer ImageSave fills before each write
+#define WRITE_BLOCK ((size_t)1 << 20)
+
+// The state of ImageSave, shared by its workers
+struct packjob
+{
+  Image img;
+  uint32 first;  // row packed at the start of block
+  size_t nbytes; // number of bytes for each row
+  uint8 *block;
+};
+
+/// Pack the rows [first + lo, first + hi) into the block
+static void PackRange(void *ctx, uint32 lo, uint32 hi, int w)
+{
+  const struct packjob *job = ctx;
+  size_t nbytes = job->nbytes;
+  for (uint32 k = lo; k < hi;)
+  {
+    // The rows of a vertical span are packed once, and copied
+    uint32 next;
+    GetRowSpan(job->img, job->first + k, &next);
+    uint32 end = next - job->first < hi ? next - job->first : hi;
+    PackRow(job->img, job->first + k, job->block + k * nbytes, nbytes, w);
+    for (uint32 r = k + 1; r < end; r++)
+    {
+      memcpy(job->block + r * nbytes, job->block + k * nbytes, nbytes);
+    }
+    k = end;
+  }
+}
+
+/// Save image to PBM file.
+/// (Or to a native RLE file, if filename ends in .rle.)
+/// On success, returns nonzero.
+/// On failure, returns 0, and
+/// a partial and invalid file may be left in the system.
+int ImageSave(const Image img, const char *filename)
+{ ///
+  assert(img != NULL);
+  if (IsRLEFileName(filename))
+  {
+    return SaveRLEFile(img, filename);
+  }
+  int w = img->width;
+  int h = img->height;
+  FILE *f = NULL;
+
+  check((f = fopen(filename, "wb")) != NULL, "Open failed");
+  check(fprintf(f, "P4\n%d %d\n", w, h) > 0, "Writing header failed");
+
+  // Write pixels
+  // The rows are packed into one reusable buffer of about WRITE_BLOCK bytes
+  // (in parallel), which is written with a single fwrite.
+  // (The rows of a pattern are generated before the workers read them.)
+  if (img->pattern != STORED)
+  {
+    GeneratePatternRows(img);
+  }
+  size_t nbytes = ((size_t)w + 8 - 1) / 8; // number of bytes for each row
+  size_t block_rows = (nbytes > 0 && nbytes < WRITE_BLOCK) ? WRITE_BLOCK / nbytes : 1;
+  struct packjob job = {img, 0, nbytes, malloc(block_rows * nbytes + 1)};
+  check(job.block != NULL, "malloc");
+  while (job.first < img->height)
+  {
+    uint32 k = img->height - job.first; // rows in the buffer
+    if (k > block_rows)
+    {
+      k = (uint32)block_rows;
+    }
+    ParallelFor(k, PlanWorkers(k), PackRange, &job);
+    check(fwrite(job.block, sizeof(uint8), k * nbytes, f) == k * nbytes,
+          "Writing pixels failed");
+    job.first += k;
+  }
+  free(job.block);
+
+  // Cleanup
+  fclose(f);
+  return 0;
+}
+
+/// Information queries
+
+/// Get image width
+int ImageWidth(const Image img)
+{
+  assert(img != NULL);
+  return img->width;
+}
+
+/// Get image height
+int ImageHeight(const Image img)
+{
+  assert(img != NULL);
+  return img->height;
+}
+
+/// Get the number of bytes of memory an image uses
+size_t ImageMemorySize(const Image img)
+{
+  assert(img != NULL);
+  size_t size = PoolBlockSize(sizeof(struct image)) +
+                PoolBlockSize(img->max_arenas * sizeof(struct arena *));
+  const struct rowtable *t = img->table;
+  if (t != NULL)
+  {
+    size += PoolBlockSize(sizeof(struct rowtable) + t->capacity * sizeof(struct rowinfo));
+    size += t->end != NULL ? PoolBlockSize(t->max_spans * sizeof(uint32)) : 0;
+  }
+  for (uint16 k = 0; k < img->num_arenas; k++)
+  {
+    size += PoolBlockSize(sizeof(struct arena)) + img->arena[k]->size;
+  }
+  return size;
+}
+
+/// Get the pixel at column x of row y of an image
+/// The pixel is found by binary search in a row of transitions, read
+/// directly in a bitset row, and found by adding up the runs of a row of
+/// runs.
+uint8 ImageGetPixel(const Image img, uint32 x, uint32 y)
+{
+  assert(img != NULL);
+  assert(x < img->width && y < img->height);
+  struct rowinfo row = GetRowInfo(img, y);
+  const uint8 *stored = GetRowRuns(img, row);
+  uint8 rs = img->run_size;
+  if (img->flip & FLIP_RUNS)
+  {
+    x = img->width - 1 - x; // (the pixel as stored)
+  }
+
+  // Number of color changes up to x, from the color of the first pixel
+  uint32 changes;
+  switch (row.form)
+  {
+  case ROW_BITS:
+    return row.color ^ ((stored[x / 8] >> (7 - x % 8)) & 1);
+  case ROW_EDGES:
+    changes = FindEdge(stored, rs, row.num_runs, x); // (the run holding x)
+    break;
+  default:
+  {
+    uint32 end = GetRun(stored, rs, 0);
+    for (changes = 0; end <= x; changes++)
+    {
+      end += GetRun(stored, rs, changes + 1);
+    }
+    break;
+  }
+  }
+  return row.color ^ (changes & 1);
+}
+
+/// Get the number of rows of an image stored as bitsets
+uint32 ImageBitsetRowCount(const Image img)
+{
+  assert(img != NULL);
+  uint32 count = 0;
+  for (uint32 i = 0, next; i < img->height; i = next)
+  {
+    struct rowinfo row = GetRowSpan(img, i, &next);
+    count += (row.form == ROW_BITS) ? next - i : 0;
+  }
+  return count;
+}
+
+/// Image comparison
+
+/// Fingerprints
+
+// The fingerprint of a row is a polynomial in an odd multiplier (modulo
+// 2^64) over its mixed run lengths, and the fingerprint of an image is
+// a polynomial over the fingerprints of its rows (mixed with their colors).
+// So the fingerprint of a sequence read backwards is computed along with
+// the forwards one, and a span of k equal rows adds up in O(log k) steps.
+// They depend only on the pixels, not on how the rows are stored (runs,
+// bitsets, transitions, spans or views).
+#define HASH_MUL 0x9E3779B97F4A7C15ull
+
+/// Mix the bits of x (the finalizer of splitmix64)
+static inline uint64 MixHash(uint64 x)
+{
+  x ^= x >> 31;
+  x *= 0xBF58476D1CE4E5B9ull;
+  x ^= x >> 27;
+  x *= 0x94D049BB133111EBull;
+  return x ^ (x >> 31);
+}
+
+/// Get the sum of HASH_MUL^j for j < k, and set *power to HASH_MUL^k
+/// (by the binary digits of k > 0, from the top one)
+static uint64 GeometricSum(uint32 k, uint64 *power)
+{
+  uint64 sum = 0, p = 1;
+  for (int bit = 31 - __builtin_clz(k); bit >= 0; bit--)
+  {
+    sum += sum * p; // (the first 2m terms, from the first m)
+    p *= p;
+    if ((k >> bit) & 1)
+    {
+      sum = 1 + sum * HASH_MUL; // (one more term)
+      p *= HASH_MUL;
+    }
+  }
+  *power = p;
+  return sum;
+}
+
+/// Compute the fingerprints of the runs of a row of an image, given its
+/// descriptor: fp[0] of the runs as stored, and fp[1] of the runs read
+/// backwards
+static void RowFingerprints(const Image img, struct rowinfo row, uint64 fp[2])
+{
+  const uint8 *runs = GetDecodedRuns(img, row, 0, 0);
+  uint8 rs = img->run_size;
+  uint64 fwd = 0, bwd = 0, p = 1;
+  for (uint32 k = 0; k < row.num_runs; k++)
+  {
+    uint64 v = MixHash(GetRun(runs, rs, k));
+    fwd += v * p;
+    p *= HASH_MUL;
+    bwd = bwd * HASH_MUL + v;
+  }
+  NUMOPS += row.num_runs;
+  fp[0] = fwd;
+  fp[1] = bwd;
+}
+
+/// Compute the fingerprints of the entries of the row table of an image,
+/// if not done yet
+/// (An entry describing the same runs as the one before gets its
+/// fingerprints copied.)
+static void HashRowTable(const Image img)
+{
+  struct rowtable *t = img->table;
+  if (t->hash != NULL)
+  {
+    return;
+  }
+  uint32 n = t->num_spans > 0 ? t->num_spans : img->height;
+  size_t size = 2 * (size_t)t->capacity * sizeof(uint64);
+  t->hash = PoolAlloc(&size);
+  for (uint32 e = 0; e < n; e++)
+  {
+    struct rowinfo row = t->row[e];
+    if (e > 0 && row.offset == t->row[e - 1].offset &&
+        row.arena == t->row[e - 1].arena &&
+        row.num_runs == t->row[e - 1].num_runs &&
+        row.form == t->row[e - 1].form)
+    {
+      t->hash[2 * e] = t->hash[2 * e - 2];
+      t->hash[2 * e + 1] = t->hash[2 * e - 1];
+    }
+    else
+    {
+      RowFingerprints(img, row, t->hash + 2 * e);
+    }
+  }
+}
+
+/// Get the fingerprint of an image: equal images have equal fingerprints,
+/// and different ones almost surely have different fingerprints.
+/// It is computed the first time it is needed, and kept until the image
+/// changes.  The fingerprints of the runs of its rows are kept in its row
+/// table, shared with its views: the views, and the image after in-place
+/// negation or mirroring, get their fingerprints with no row read again.
+/// (Like ResolveRuns, this changes img, which must not be done while other
+/// threads read it.)
+uint64 ImageHash(const Image img)
+{
+  assert(img != NULL);
+  if (img->hashed)
+  {
+    return img->hash;
+  }
+  Image im = (Image)img; // (the pixels are not changed)
+  uint32 height = img->height;
+  struct rowtable *t = img->table;
+  if (t != NULL)
+  {
+    HashRowTable(img);
+  }
+  else
+  {
+    GeneratePatternRows(img);
+  }
+  int rev = (img->flip & FLIP_RUNS) != 0;
+
+  // (once for each vertical span of rows)
+  uint64 h = 0, weight = 1; // weight: HASH_MUL^i
+  for (uint32 i = 0, next; i < height; i = next)
+  {
+    struct rowinfo row = GetRowSpan(img, i, &next);
+    uint64 fp[2];
+    const uint64 *rfp = fp;
+    if (t != NULL)
+    {
+      rfp = t->hash + 2 * RowEntry(img, i);
+    }
+    else
+    {
+      RowFingerprints(img, row, fp);
+    }
+    uint64 key = MixHash(rfp[rev] ^ GetRowColor(img, row));
+    uint64 power;
+    h += key * weight * GeometricSum(next - i, &power);
+    weight *= power;
+  }
+  im->hash = MixHash(h ^ MixHash((uint64)img->width << 32 | height));
+  im->hashed = 1;
+  return im->hash;
+}
+
+// returns 1 if equal, 0 otherwise
+// Images with different fingerprints are different (see ImageHash): then
+// this takes O(1) time, once the fingerprints were computed.  Otherwise,
+// their rows are compared.
+int ImageIsEqual(const Image img1, const Image img2)
+{
+  assert(img1 != NULL && img2 != NULL);
+
+  // first we check if width and height of images are the same -> otherwise already know they're different
+  if ((img1->height != img2->height) || (img1->width != img2->width))
+  {
+    return 0;
+  }
+  if (ImageHash(img1) != ImageHash(img2))
+  {
+    return 0;
+  }
+  if ((img1->flip ^ img2->flip) & FLIP_RUNS)
+  {
+    ResolveRuns(img1); // (rows read backwards in both images compare as stored)
+    ResolveRuns(img2);
+  }
+
+  // check row by row if encoding is equal
+  // (once for each pair of vertical spans of the two images)
+  for (uint32 i = 0, next1, next2; i < img1->height;)
+  {
+    GetRowSpan(img1, i, &next1);
+    GetRowSpan(img2, i, &next2);
+    if (lineIsEqual(img1, img2, i) != 0)
+    {
+      return 0;
+    }
+    i = next1 < next2 ? next1 : next2;
+  }
+
+  return 1;
+}
+
+int ImageIsDifferent(const Image img1, const Image img2)
+{
+  assert(img1 != NULL && img2 != NULL);
+  return !ImageIsEqual(img1, img2);
+}
+
+/// Pixel counts and mask metrics
+
+/// These functions count pixels directly on the rows of the images: the
+/// runs (or bitsets) of two images are merged row by row, and only the
+/// lengths are added up, with no result rows built.
+
+/// Count the BLACK pixels of a row of an image, given its descriptor
+static uint32 RowCountBlack(const Image img, struct rowinfo row)
+{
+  uint32 width = img->width;
+  const uint8 *stored = GetRowRuns(img, row);
+  uint8 rs = img->run_size;
+  if (row.form == ROW_BITS)
+  {
+    uint32 n[3];
+    CountBitsSet(stored, NULL, width, n);
+    return row.color == BLACK ? width - n[0] : n[0];
+  }
+  // (as stored: backwards, in a view with FLIP_RUNS, has the same count)
+  uint32 black = 0;
+  uint32 start = 0;
+  for (uint32 k = 0; k < row.num_runs; k++)
+  {
+    uint32 end = row.form == ROW_EDGES ? GetRun(stored, rs, k)
+                                       : start + GetRun(stored, rs, k);
+    black += (end - start) & -(uint32)((row.color ^ k) & 1);
+    start = end;
+  }
+  NUMOPS += row.num_runs;
+  return black;
+}
+
+/// Count the pixels of each pair of values of row r1 of img1 and row r2 of
+/// img2, as worker w: counts[2*v1 + v2] gets the number of pixels that are
+/// v1 in img1 and v2 in img2
+/// Rows sharing their runs are counted once; rows with a bitset are counted
+/// a word at a time (see GetRowBits); the transitions of other rows are
+/// merged (see GetReadingEdges).
+static void RowCountPairs(const Image img1, struct rowinfo r1, const Image img2,
+                          struct rowinfo r2, int w, uint32 counts[4])
+{
+  uint32 width = img1->width;
+  uint8 value1 = GetRowColor(img1, r1);
+  uint8 value2 = GetRowColor(img2, r2);
+
+  if (GetRowRuns(img1, r1) == GetRowRuns(img2, r2) && r1.form == r2.form &&
+      r1.num_runs == r2.num_runs && !((img1->flip ^ img2->flip) & FLIP_RUNS))
+  {
+    // The same row, or its negative
+    uint32 black = RowCountBlack(img1, r1);
+    uint8 neg = r1.color ^ r2.color;
+    counts[0] = neg ? 0 : width - black;
+    counts[1] = neg ? width - black : 0;
+    counts[2] = neg ? black : 0;
+    counts[3] = neg ? 0 : black;
+  }
+  else if (r1.form == ROW_BITS || r2.form == ROW_BITS)
+  {
+    // The bits are the pixels XOR the first pixel: n[0] = |bits1|,
+    // n[1] = |bits2|, n[2] = |bits1 & bits2|
+    uint32 n[3];
+    CountBitsSet(GetRowBits(img1, r1, w, 0), GetRowBits(img2, r2, w, 1),
+                 width, n);
+    counts[2 * value1 + value2] = width - n[0] - n[1] + n[2];
+    counts[2 * value1 + (value2 ^ 1)] = n[1] - n[2];
+    counts[2 * (value1 ^ 1) + value2] = n[0] - n[2];
+    counts[2 * (value1 ^ 1) + (value2 ^ 1)] = n[2];
+  }
+  else
+  {
+    rowEdgesCount(GetReadingEdges(img1, r1, w, 0), value1,
+                  GetReadingEdges(img2, r2, w, 1), value2, counts,
+                  img1->run_size, width);
+  }
+}
+
+// The state of CountPairs (and ImageCountBlack), shared by its workers
+struct countjob
+{
+  Image img1, img2; // (img2 is NULL, to count the BLACK pixels of img1)
+  uint64 counts[MAX_THREADS][4]; // the counts of each worker
+};
+
+/// Count the pixels of the rows [lo, hi) for job, as worker w
+/// (once for each pair of vertical spans of the images)
+static void CountRange(void *ctx, uint32 lo, uint32 hi, int w)
+{
+  struct countjob *job = ctx;
+  uint64 *counts = job->counts[w];
+  for (uint32 i = lo, next1, next2 = hi; i < hi;)
+  {
+    struct rowinfo r1 = GetRowSpan(job->img1, i, &next1);
+    uint32 c[4] = {0, 0, 0, 0};
+    if (job->img2 == NULL)
+    {
+      c[BLACK] = RowCountBlack(job->img1, r1);
+    }
+    else
+    {
+      struct rowinfo r2 = GetRowSpan(job->img2, i, &next2);
+      RowCountPairs(job->img1, r1, job->img2, r2, w, c);
+    }
+    uint32 next = next1 < next2 ? next1 : next2;
+    next = next < hi ? next : hi;
+    for (int v = 0; v < 4; v++)
+    {
+      counts[v] += (uint64)c[v] * (next - i);
+    }
+    i = next;
+  }
+}
+
+/// Count the pixels of img1, or of each pair of values of img1 and img2
+/// (see struct countjob), with the rows split across the workers
+/// The counts of all workers are added up into counts.
+static void CountPixels(const Image img1, const Image img2, uint64 counts[4])
+{
+  // The rows of pattern images are generated before the workers read them
+  if (img1->pattern != STORED)
+  {
+    GeneratePatternRows(img1);
+  }
+  if (img2 != NULL && img2->pattern != STORED)
+  {
+    GeneratePatternRows(img2);
+  }
+
+  struct countjob job = {img1, img2, {{0}}};
+  int workers = PlanWorkers(img1->height);
+  ParallelFor(img1->height, workers, CountRange, &job);
+
+  for (int v = 0; v < 4; v++)
+  {
+    counts[v] = 0;
+    for (int w = 0; w < workers; w++)
+    {
+      counts[v] += job.counts[w][v];
+    }
+  }
+}
+
+uint64 ImageCountBlack(const Image img)
+{
+  assert(img != NULL);
+  uint64 counts[4];
+  CountPixels(img, NULL, counts);
+  return counts[BLACK];
+}
+
+void ImageCountPairs(const Image img1, const Image img2, uint64 counts[4])
+{
+  assert(img1 != NULL && img2 != NULL);
+  assert((img1->height == img2->height) && (img1->width == img2->width));
+  CountPixels(img1, img2, counts);
+}
+
+uint64 ImageCountDiff(const Image img1, const Image img2)
+{
+  uint64 counts[4];
+  ImageCountPairs(img1, img2, counts);
+  return counts[1] + counts[2];
+}
+
+uint64 ImageIntersectionCount(const Image img1, const Image img2)
+{
+  uint64 counts[4];
+  ImageCountPairs(img1, img2, counts);
+  return counts[3];
+}
+
+/// The ratio num / den, or 1 if den is 0 (there were no pixels to get wrong)
+static double Ratio(uint64 num, uint64 den)
+{
+  return den == 0 ? 1.0 : (double)num / (double)den;
+}
+
+void ImageMaskScores(const Image pred, const Image truth, double *iou,
+                     double *dice, double *precision, double *recall)
+{
+  uint64 counts[4];
+  ImageCountPairs(pred, truth, counts);
+  uint64 tp = counts[3], fp = counts[2], fn = counts[1];
+  if (iou != NULL)
+  {
+    *iou = Ratio(tp, tp + fp + fn);
+  }
+  if (dice != NULL)
+  {
+    *dice = Ratio(2 * tp, 2 * tp + fp + fn);
+  }
+  if (precision != NULL)
+  {
+    *precision = Ratio(tp, tp + fp);
+  }
+  if (recall != NULL)
+  {
+    *recall = Ratio(tp, tp + fn);
+  }
+}
+
+double ImageIoU(const Image pred, const Image truth)
+{
+  double iou;
+  ImageMaskScores(pred, truth, &iou, NULL, NULL, NULL);
+  return iou;
+}
+
+double ImageDice(const Image pred, const Image truth)
+{
+  double dice;
+  ImageMaskScores(pred, truth, NULL, &dice, NULL, NULL);
+  return dice;
+}
+
+double ImagePrecision(const Image pred, const Image truth)
+{
+  double precision;
+  ImageMaskScores(pred, truth, NULL, NULL, &precision, NULL);
+  return precision;
+}
+
+double ImageRecall(const Image pred, const Image truth)
+{
+  double recall;
+  ImageMaskScores(pred, truth, NULL, NULL, NULL, &recall);
+  return recall;
+}
+
+/// Connected components
+
+// The BLACK pixels of an image are labeled on its runs, in a single pass
+// over the rows: each BLACK run is joined (with a union-find forest) to the
+// BLACK runs it touches in the row above, found by merging the two rows.
+// A vertical span of equal rows (see ImageSetRowSpans) is taken as a single
+// row, as tall as the span: its runs touch only themselves in the rows in
+// between.  Time and memory are O(runs), whatever the number of pixels.
+
+// A BLACK run of a component: the columns [x, x + len) of the rows
+// [y, y + rows)
+struct comprun
+{
+  uint32 x, y;
+  uint32 len, rows;
+};
+
+// The bounding box and area of a component
+struct compinfo
+{
+  uint32 x0, y0, x1, y1; // the columns [x0, x1) of the rows [y0, y1)
+  uint64 area;
+};
+
+struct imagecomponents
+{
+  uint32 num_components;
+  uint32 num_runs;
+  struct comprun *run;   // the runs of component 0, then of component 1, ...
+  uint32 *first;         // component k has the runs [first[k], first[k+1])
+  struct compinfo *info; // an entry per component
+};
+
+/// Get the root of the tree of run r, halving the path on the way
+/// (A run is never joined below a later one: parent[r] <= r.)
+static uint32 FindRoot(uint32 *parent, uint32 r)
+{
+  while (parent[r] != r)
+  {
+    parent[r] = parent[parent[r]];
+    r = parent[r];
+  }
+  return r;
+}
+
+/// Join the trees of runs p and q, under the root of the earlier run
+static void JoinRuns(uint32 *parent, uint32 p, uint32 q)
+{
+  p = FindRoot(parent, p);
+  q = FindRoot(parent, q);
+  if (p < q)
+  {
+    parent[q] = p;
+  }
+  else
+  {
+    parent[p] = q;
+  }
+}
+
+ImageComponents ImageLabelComponents(const Image img, int connectivity)
+{
+  assert(img != NULL);
+  assert(connectivity == 4 || connectivity == 8);
+  // Runs touch if they overlap (4-connectivity), or if they overlap once
+  // widened by one pixel (8-connectivity: diagonal neighbours touch)
+  uint32 reach = connectivity == 8;
+  uint8 rs = img->run_size;
+
+  // The BLACK runs, in reading order, and their union-find forest
+  size_t capacity = 64;
+  struct comprun *run = malloc(capacity * sizeof(struct comprun));
+  uint32 *parent = malloc(capacity * sizeof(uint32));
+  check(run != NULL && parent != NULL, "malloc");
+  uint32 n = 0;
+  uint32 prev = 0; // the runs of the row above are [prev, cur)
+
+  // (once for each vertical span of rows)
+  for (uint32 i = 0, next; i < img->height; i = next)
+  {
+    struct rowinfo row = GetRowSpan(img, i, &next);
+    const uint8 *edges = GetReadingEdges(img, row, 0, 0);
+    uint8 color = GetRowColor(img, row);
+    if (n + row.num_runs > capacity)
+    {
+      capacity = 2 * (n + row.num_runs);
+      run = realloc(run, capacity * sizeof(struct comprun));
+      parent = realloc(parent, capacity * sizeof(uint32));
+      check(run != NULL && parent != NULL, "realloc");
+    }
+    uint32 cur = n;
+    uint32 start = 0;
+    for (uint32 k = 0; k < row.num_runs; k++)
+    {
+      uint32 end = GetRun(edges, rs, k);
+      if ((color ^ k) & 1)
+      {
+        run[n] = (struct comprun){start, i, end - start, next - i};
+        parent[n] = n;
+        n++;
+      }
+      start = end;
+    }
+    NUMOPS += row.num_runs;
+
+    // Merge the BLACK runs of this row with those of the row above:
+    // the run that ends first cannot touch any later run of the other row
+    for (uint32 p = prev, q = cur; p < cur && q < n;)
+    {
+      uint32 end_p = run[p].x + run[p].len;
+      uint32 end_q = run[q].x + run[q].len;
+      if (run[p].x < end_q + reach && run[q].x < end_p + reach)
+      {
+        JoinRuns(parent, p, q);
+      }
+      if (end_p < end_q)
+      {
+        p++;
+      }
+      else
+      {
+        q++;
+      }
+      NUMOPS++;
+    }
+    prev = cur;
+  }
+
+  // Number the components in reading order of their first pixels:
+  // as parent[r] <= r, the entries before r already hold their numbers
+  // when r is reached, and parent[r] of a run r that is not a root is
+  // turned into the number of its root (through the runs in between)
+  uint32 num_components = 0;
+  for (uint32 r = 0; r < n; r++)
+  {
+    parent[r] = parent[r] == r ? num_components++ : parent[parent[r]];
+  }
+
+  ImageComponents c = malloc(sizeof(struct imagecomponents));
+  check(c != NULL, "malloc");
+  c->num_components = num_components;
+  c->num_runs = n;
+  c->first = calloc((size_t)num_components + 1, sizeof(uint32));
+  c->info = malloc(((size_t)num_components + 1) * sizeof(struct compinfo));
+  c->run = malloc(((size_t)n + 1) * sizeof(struct comprun));
+  check(c->first != NULL && c->info != NULL && c->run != NULL, "malloc");
+
+  // Group the runs by component (a counting sort, which keeps them in
+  // reading order), and measure each component
+  for (uint32 k = 0; k < num_components; k++)
+  {
+    c->info[k] = (struct compinfo){UINT32_MAX, UINT32_MAX, 0, 0, 0};
+  }
+  for (uint32 r = 0; r < n; r++)
+  {
+    c->first[parent[r] + 1]++;
+  }
+  for (uint32 k = 0; k < num_components; k++)
+  {
+    c->first[k + 1] += c->first[k];
+  }
+  for (uint32 r = 0; r < n; r++)
+  {
+    uint32 k = parent[r];
+    struct comprun cr = run[r];
+    struct compinfo *ci = &c->info[k];
+    ci->area += (uint64)cr.len * cr.rows;
+    ci->x0 = cr.x < ci->x0 ? cr.x : ci->x0;
+    ci->y0 = cr.y < ci->y0 ? cr.y : ci->y0;
+    ci->x1 = cr.x + cr.len > ci->x1 ? cr.x + cr.len : ci->x1;
+    ci->y1 = cr.y + cr.rows > ci->y1 ? cr.y + cr.rows : ci->y1;
+    // (first[k] is the next free slot of component k, for now)
+    c->run[c->first[k]++] = cr;
+  }
+  // (each first[k] is now where component k+1 starts: shift them back)
+  for (uint32 k = num_components; k > 0; k--)
+  {
+    c->first[k] = c->first[k - 1];
+  }
+  c->first[0] = 0;
+
+  free(run);
+  free(parent);
+  return c;
+}
+
+uint32 ImageComponentsCount(const ImageComponents c)
+{
+  assert(c != NULL);
+  return c->num_components;
+}
+
+uint64 ImageComponentArea(const ImageComponents c, uint32 k)
+{
+  assert(c != NULL && k < c->num_components);
+  return c->info[k].area;
+}
+
+void ImageComponentBox(const ImageComponents c, uint32 k, uint32 *x,
+                       uint32 *y, uint32 *w, uint32 *h)
+{
+  assert(c != NULL && k < c->num_components);
+  const struct compinfo *ci = &c->info[k];
+  *x = ci->x0;
+  *y = ci->y0;
+  *w = ci->x1 - ci->x0;
+  *h = ci->y1 - ci->y0;
+}
+
+uint32 ImageComponentNumRuns(const ImageComponents c, uint32 k)
+{
+  assert(c != NULL && k < c->num_components);
+  return c->first[k + 1] - c->first[k];
+}
+
+void ImageComponentRun(const ImageComponents c, uint32 k, uint32 j, uint32 *x,
+                       uint32 *y, uint32 *len, uint32 *rows)
+{
+  assert(c != NULL && k < c->num_components);
+  assert(j < c->first[k + 1] - c->first[k]);
+  const struct comprun *cr = &c->run[c->first[k] + j];
+  *x = cr->x;
+  *y = cr->y;
+  *len = cr->len;
+  *rows = cr->rows;
+}
+
+void ImageComponentsDestroy(ImageComponents *cp)
+{ ///
+  assert(cp != NULL);
+
+  ImageComponents c = *cp;
+  if (c == NULL)
+  {
+    return;
+  }
+
+  free(c->run);
+  free(c->first);
+  free(c->info);
+  free(c);
+
+  *cp = NULL;
+}
+
+/// Boolean Operations on image pixels
+
+/// These functions apply boolean operations to images,
+/// returning a new image as a result.
+///
+/// Operand images are left untouched and must be of the same size.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+
+/// Negate img into dst (see PrepareSharedResult), or into a new image
+static Image ImageNEGOp(Image dst, const Image img)
+{
+  uint32 height = img->height;
+
+  if (img->pattern != STORED)
+  {
+    GeneratePatternRows(img);
+  }
+  Image newImage = PrepareSharedResult(dst, img->width, height, img->num_arenas);
+
+  // Sharing the arenas and copying the row table
+  // And changing the color of the first run of each row
+  ShareArenas(newImage, img);
+  if (img->row != NULL)
+  {
+    // (as stored: the result keeps the orientation and spans of a view)
+    CopyRowTable(newImage, img);
+    newImage->num_runs = img->num_runs;
+    newImage->flip = img->flip;
+  }
+  else
+  {
+    for (uint32 i = 0; i < height; i++)
+    {
+      newImage->row[i] = GetRowInfo(img, i);
+      newImage->num_runs += newImage->row[i].num_runs;
+    }
+  }
+
+  uint32 n = newImage->table->num_spans > 0 ? newImage->table->num_spans : height;
+  for (uint32 i = 0; i < n; i++)
+  {
+    newImage->row[i].color ^= 1; // Just negate the value of the first pixel run
+  }
+
+  FinishSharedResult(newImage, dst);
+  return newImage;
+}
+
+Image ImageNEG(const Image img)
+{
+  assert(img != NULL);
+
+  uint32 width = img->width;
+  uint32 height = img->height;
+
+  if (img->pattern != STORED)
+  {
+    // The negative of a pattern is the same pattern with the opposite color
+    Image newImage = NewPatternImage(width, height, img->pattern, img->value ^ 1,
+                                     img->period, img->thickness);
+    if (img->num_arenas > 0)
+    {
+      // Share the rows already generated
+      AttachArena(newImage, img->arena[0]);
+      newImage->prow[0] = img->prow[0];
+      newImage->prow[1] = img->prow[1];
+      newImage->num_runs = img->num_runs;
+    }
+    return newImage;
+  }
+
+  return ImageNEGOp(NULL, img);
+}
+
+/// Negate img into dst.
+/// dst shares the rows of img, as with ImageNEG (but it is a stored image,
+/// even if img is a pattern).
+void ImageNEGInto(Image dst, const Image img)
+{
+  assert(dst != NULL && img != NULL);
+
+  if (dst == img)
+  {
+    ImageNEGInPlace(dst);
+    return;
+  }
+  ImageNEGOp(dst, img);
+}
+
+/// Negate img, in place: only the color of each row changes.
+/// (A row table shared with views is copied first.)
+void ImageNEGInPlace(Image img)
+{
+  assert(img != NULL);
+
+  if (img->pattern != STORED)
+  {
+    img->value ^= 1; // the same pattern, with the opposite color
+    img->hashed = 0;
+    return;
+  }
+  UnshareRowTable(img);
+  uint32 n = img->table->num_spans > 0 ? img->table->num_spans : img->height;
+  for (uint32 i = 0; i < n; i++)
+  {
+    img->row[i].color ^= 1; // (an entry per row, or per vertical span)
+  }
+  img->hashed = 0; // (the fingerprints of the runs are kept)
+}
+
+// This is the optimized version of the algorithm
+Image ImageAND(const Image img1, const Image img2)
+{
+  assert(img1 != NULL && img2 != NULL);
+  assert((img1->height == img2->height) && (img1->width == img2->width));
+
+  return ImageRowOp(NULL, img1, img2, BOOL_AND);
+}
+
+// This is the non-optimized version of imageAND()
+// Image ImageAND(const Image img1, const Image img2)
+// {
+//   assert(img1 != NULL && img2 != NULL);
+//   assert((img1->height == img2->height) && (img1->width == img2->width));
+
+//   // allocate memory for the resulting image
+//   Image rslt = AllocateImageHeader(img1->width, img1->height);
+
+//   for (uint32 row_index = 0; row_index < img1->height; row_index++)
+//   {
+//     uint8 *row1 = UncompressRow(img1->width, img1->row[row_index]);
+//     uint8 *row2 = UncompressRow(img2->width, img2->row[row_index]);
+
+//     uint8 *rslt_row = (uint8 *)malloc(img1->width * sizeof(uint8));
+//     check(rslt_row != NULL, "malloc");
+
+//     // perform and operation pixelwise
+//     for (uint32 j = 0; j < img1->width; j++)
+//     {
+//       rslt_row[j] = row1[j] & row2[j];
+//       NUMOPS++; // increment due to logic and operation
+//     }
+
+//     int *aux = CompressRow(img1->width, rslt_row);
+//     rslt->row[row_index] = aux;
+
+//     free(rslt_row);
+//     free(row1);
+//     free(row2);
+//     // we don't free aux as it is being assigned to rlst->row. Therefore it will only be freed when calling imageDestroy
+//   }
+
+//   return rslt;
+// }
+
+Image ImageOR(const Image img1, const Image img2)
+{
+  assert(img1 != NULL && img2 != NULL);
+  assert((img1->height == img2->height) && (img1->width == img2->width));
+
+  return ImageRowOp(NULL, img1, img2, BOOL_OR);
+}
+
+Image ImageXOR(const Image img1, const Image img2)
+{
+  assert(img1 != NULL && img2 != NULL);
+  assert((img1->height == img2->height) && (img1->width == img2->width));
+
+  return ImageRowOp(NULL, img1, img2, BOOL_XOR);
+}
+
+/// The boolean operations into dst reuse the arenas of dst:
+/// repeated on images of the same size, they allocate no memory.
+/// (dst may also be one of the operands: then the result is built apart,
+/// and moved into dst.)
+
+void ImageANDInto(Image dst, const Image img1, const Image img2)
+{
+  assert(dst != NULL && img1 != NULL && img2 != NULL);
+  assert((img1->height == img2->height) && (img1->width == img2->width));
+
+  ImageRowOp(dst, img1, img2, BOOL_AND);
+}
+
+void ImageORInto(Image dst, const Image img1, const Image img2)
+{
+  assert(dst != NULL && img1 != NULL && img2 != NULL);
+  assert((img1->height == img2->height) && (img1->width == img2->width));
+
+  ImageRowOp(dst, img1, img2, BOOL_OR);
+}
+
+void ImageXORInto(Image dst, const Image img1, const Image img2)
+{
+  assert(dst != NULL && img1 != NULL && img2 != NULL);
+  assert((img1->height == img2->height) && (img1->width == img2->width));
+
+  ImageRowOp(dst, img1, img2, BOOL_XOR);
+}
+
+/// Combine img1 and img2 pixel by pixel with any boolean operator:
+/// op is the truth table of the operator, see BOOL_AND and the rest.
+Image ImageBoolOp(const Image img1, const Image img2, uint8 op)
+{
+  assert(img1 != NULL && img2 != NULL);
+  assert((img1->height == img2->height) && (img1->width == img2->width));
+  assert(op <= 0xF);
+
+  return ImageRowOp(NULL, img1, img2, op);
+}
+
+void ImageBoolOpInto(Image dst, const Image img1, const Image img2, uint8 op)
+{
+  assert(dst != NULL && img1 != NULL && img2 != NULL);
+  assert((img1->height == img2->height) && (img1->width == img2->width));
+  assert(op <= 0xF);
+
+  ImageRowOp(dst, img1, img2, op);
+}
+
+/// Reduce k images to one, pixel by pixel, in a single sweep:
+/// op is REDUCE_AND, REDUCE_OR, REDUCE_XOR or REDUCE_MAJORITY.
+/// No intermediate images are built.
+Image ImageReduce(const Image imgs[], uint32 k, uint8 op)
+{
+  assert(imgs != NULL && k > 0);
+  assert(op == REDUCE_AND || op == REDUCE_OR || op == REDUCE_XOR ||
+         op == REDUCE_MAJORITY);
+
+  struct expr e = {op, k, 0, NULL};
+  return ImageKWayOp(NULL, imgs, k, &e);
+}
+
+/// Reduce k images into dst, reusing the arenas of dst.
+void ImageReduceInto(Image dst, const Image imgs[], uint32 k, uint8 op)
+{
+  assert(dst != NULL && imgs != NULL && k > 0);
+  assert(op == REDUCE_AND || op == REDUCE_OR || op == REDUCE_XOR ||
+         op == REDUCE_MAJORITY);
+
+  struct expr e = {op, k, 0, NULL};
+  ImageKWayOp(dst, imgs, k, &e);
+}
+
+/// Evaluate expr over k images, into dst (or into a new image, if NULL)
+static Image ImageEvalOp(Image dst, const Image imgs[], uint32 k, const char *expr)
+{
+  struct expr e;
+  int valid = CompileExpr(&e, k, expr);
+  assert(valid);
+  (void)valid; // (only checked by assert)
+  Image rslt = ImageKWayOp(dst, imgs, k, &e);
+  free(e.code);
+  return rslt;
+}
+
+/// Evaluate a boolean expression over k images, pixel by pixel,
+/// in a single sweep: imgs[0] is named A in expr, imgs[1] is B, and so on.
+/// No intermediate images are built.
+Image ImageEval(const Image imgs[], uint32 k, const char *expr)
+{
+  assert(imgs != NULL && k > 0 && k <= 26);
+  assert(expr != NULL);
+
+  return ImageEvalOp(NULL, imgs, k, expr);
+}
+
+/// Evaluate a boolean expression over k images into dst,
+/// reusing the arenas of dst.
+void ImageEvalInto(Image dst, const Image imgs[], uint32 k, const char *expr)
+{
+  assert(dst != NULL && imgs != NULL && k > 0 && k <= 26);
+  assert(expr != NULL);
+
+  ImageEvalOp(dst, imgs, k, expr);
+}
+
+/// Geometric transformations
+
+/// These functions apply geometric transformations to an image,
+/// returning a new image as a result.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+
+/// Mirror img top-bottom into dst (see PrepareSharedResult),
+/// or into a new image
+/// The mirror of a stored image is a view of its rows, read bottom-up;
+/// the mirror of a pattern gets a row table of its own.
+static Image ImageHMirrorOp(Image dst, const Image img)
+{
+  uint32 width = img->width;
+  uint32 height = img->height;
+
+  if (img->pattern == STORED)
+  {
+    return NewView(dst, img, FLIP_ROWS);
+  }
+
+  // The rows are not copied: the new image shares the arenas of img.
+  GeneratePatternRows(img);
+  Image newImage = PrepareSharedResult(dst, width, height, img->num_arenas);
+  ShareArenas(newImage, img);
+
+  // Iterates through each row in the original image, in reverse order.
+  for (uint32 i = 0; i < height; i++)
+  {
+    newImage->row[i] = GetRowInfo(img, height - i - 1);
+    newImage->num_runs += newImage->row[i].num_runs;
+  }
+
+  FinishSharedResult(newImage, dst);
+  return newImage;
+}
+
+/// Mirror an image = flip top-bottom.
+/// Returns a mirrored version of the image.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageHorizontalMirror(const Image img)
+{
+  assert(img != NULL);
+
+  return ImageHMirrorOp(NULL, img);
+}
+
+/// Mirror img top-bottom into dst.
+/// dst shares the rows of img, as with ImageHorizontalMirror.
+void ImageHorizontalMirrorInto(Image dst, const Image img)
+{
+  assert(dst != NULL && img != NULL);
+
+  if (dst == img)
+  {
+    ImageHorizontalMirrorInPlace(dst);
+    return;
+  }
+  ImageHMirrorOp(dst, img);
+}
+
+/// Mirror img top-bottom, in place: only its orientation changes.
+/// (A pattern image is first turned into a stored image.)
+void ImageHorizontalMirrorInPlace(Image img)
+{
+  assert(img != NULL);
+
+  if (img->pattern != STORED)
+  {
+    MoveImage(img, ImageHMirrorOp(NULL, img));
+    return;
+  }
+  img->flip ^= FLIP_ROWS;
+  img->hashed = 0;
+}
+
+/// Mirror the rows [lo, hi) of imgs[0] into imgs[1], as worker w
+static void VerticalMirrorRange(void *ctx, uint32 lo, uint32 hi, int w)
+{
+  const Image *imgs = ctx;
+  Image img = imgs[0], newImage = imgs[1];
+  uint8 rs = img->run_size;
+
+  // Iterates through each row in the range.
+  for (uint32 i = lo; i < hi; i++)
+  {
+    const uint8 *row = GetRLERow(img, i);
+    uint32 num_runs = GetNumRunsInRLERow(img, i);           // Gets the number of RLE runs in the row.
+    uint8 *new_row = ReserveRLERow(newImage, w, num_runs);  // Reserves space for the new row.
+
+    // The first run of the new row is the last run of the original row,
+    // whose color depends on the parity of the number of runs.
+    uint8 color = GetRLERowColor(img, i) ^ ((num_runs - 1) % 2);
+
+    // Reverses the order of the runs for the new image.
+    for (uint32 j = 0; j < num_runs; j++)
+    {
+      SetRun(new_row, rs, j, GetRun(row, rs, num_runs - 1 - j));
+    }
+
+    CommitRLERow(newImage, i, w, color, num_runs);
+  }
+}
+
+/// Mirror img left-right into dst (see PrepareResult), or into a new image
+/// The mirror of a stored image is a view of its rows, read backwards;
+/// the rows of the mirror of a pattern are built.
+static Image ImageVMirrorOp(Image dst, const Image img)
+{
+  uint32 width = img->width;
+  uint32 height = img->height;
+
+  if (img->pattern == STORED)
+  {
+    return NewView(dst, img, FLIP_RUNS);
+  }
+
+  // The rows of a pattern are generated before the workers read them
+  GeneratePatternRows(img);
+  int workers = PlanWorkers(height);
+  Image newImage = PrepareResult(dst, width, height, img->num_runs, workers);
+  Image imgs[2] = {img, newImage};
+
+  ParallelFor(height, workers, VerticalMirrorRange, imgs);
+
+  FinishResult(newImage, dst);
+
+  return newImage;
+}
+
+/// Mirror an image = flip left-right.
+/// Returns a mirrored version of the image.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageVerticalMirror(const Image img)
+{
+  assert(img != NULL);
+
+  return ImageVMirrorOp(NULL, img);
+}
+
+/// Mirror img left-right into dst, reusing the arenas of dst.
+void ImageVerticalMirrorInto(Image dst, const Image img)
+{
+  assert(dst != NULL && img != NULL);
+
+  if (dst == img)
+  {
+    ImageVerticalMirrorInPlace(dst);
+    return;
+  }
+  ImageVMirrorOp(dst, img);
+}
+
+/// Mirror img left-right, in place: only its orientation changes.
+/// (A pattern image is first turned into a stored image.)
+void ImageVerticalMirrorInPlace(Image img)
+{
+  assert(img != NULL);
+
+  if (img->pattern != STORED)
+  {
+    MoveImage(img, ImageVMirrorOp(NULL, img));
+    return;
+  }
+  img->flip ^= FLIP_RUNS;
+  img->hashed = 0;
+}
+
+/// Replicate img2 at the bottom of img1 into dst (see PrepareSharedResult),
+/// or into a new image
+static Image ImageRepBOp(Image dst, const Image img1, const Image img2)
+{
+  if (dst != NULL && (dst == img1 || dst == img2))
+  {
+    // the operands must not change while they are read
+    MoveImage(dst, ImageRepBOp(NULL, img1, img2));
+    return dst;
+  }
+
+  uint32 new_width = img1->width;
+  uint32 new_height = img1->height + img2->height;
+
+  // The rows are not copied: the new image shares the arenas of both images.
+  // (Both images have the same width, hence the same run size.)
+  if (img1->pattern != STORED)
+  {
+    GeneratePatternRows(img1);
+  }
+  if (img2->pattern != STORED)
+  {
+    GeneratePatternRows(img2);
+  }
+  ResolveRuns(img1);
+  ResolveRuns(img2);
+  Image newImage = PrepareSharedResult(dst, new_width, new_height,
+                                      img1->num_arenas + img2->num_arenas);
+  ShareArenas(newImage, img1);
+
+  // The rows of img1 keep their arena indices.
+  for (uint32 i = 0, next; i < img1->height; i = next)
+  {
+    struct rowinfo row = GetRowSpan(img1, i, &next);
+    for (uint32 r = i; r < next; r++)
+    {
+      newImage->row[r] = row;
+    }
+    newImage->num_runs += (size_t)(next - i) * row.num_runs;
+  }
+
+  // The rows of img2 come after img1's rows, with their arena indices
+  // translated to the arena list of the new image.
+  uint16 map[img2->num_arenas];
+  MapArenas(newImage, img2, map);
+  for (uint32 i = 0, next; i < img2->height; i = next)
+  {
+    struct rowinfo row = GetRowSpan(img2, i, &next);
+    row.arena = map[row.arena];
+    for (uint32 r = i; r < next; r++)
+    {
+      newImage->row[img1->height + r] = row;
+    }
+    newImage->num_runs += (size_t)(next - i) * row.num_runs;
+  }
+
+  FinishSharedResult(newImage, dst);
+  if (newImage->num_arenas > MAX_SHARED_ARENAS)
+  {
+    CompactArenas(newImage);
+  }
+  return newImage;
+}
+
+/// Replicate img2 at the bottom of imag1, creating a larger image
+/// Requires: the width of the two images must be the same.
+/// Returns the new larger image.
+/// Ensures: The original images are not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageReplicateAtBottom(const Image img1, const Image img2)
+{
+  assert(img1 != NULL && img2 != NULL);
+  assert(img1->width == img2->width);
+
+  return ImageRepBOp(NULL, img1, img2);
+}
+
+/// Replicate img2 at the bottom of img1 into dst.
+/// dst shares the rows of both images, as with ImageReplicateAtBottom.
+void ImageReplicateAtBottomInto(Image dst, const Image img1, const Image img2)
+{
+  assert(dst != NULL && img1 != NULL && img2 != NULL);
+  assert(img1->width == img2->width);
+
+  ImageRepBOp(dst, img1, img2);
+}
+
+/// Join the rows [lo, hi) of imgs[0] and imgs[1] into imgs[2], as worker w
+static void ReplicateAtRightRange(void *ctx, uint32 lo, uint32 hi, int w)
+{
+  const Image *imgs = ctx;
+  Image img1 = imgs[0], img2 = imgs[1], newImage = imgs[2];
+  uint8 rs = newImage->run_size; // may be larger than the run size of img1 or img2
+
+  for (uint32 i = lo; i < hi; i++)
+  {
+    struct rowinfo info1 = GetRowInfo(img1, i);
+    struct rowinfo info2 = GetRowInfo(img2, i);
+    const uint8 *row1 = GetDecodedRuns(img1, info1, w, 0);
+    const uint8 *row2 = GetDecodedRuns(img2, info2, w, 1);
+    uint32 num_runs_img1 = info1.num_runs;
+    uint32 num_runs_img2 = info2.num_runs;
+
+    // Color of the last run of img1.
+    uint8 last_value = info1.color ^ ((num_runs_img1 - 1) % 2);
+
+    // Reserves space for the combined row (the case with no merging).
+    uint8 *new_row = ReserveRLERow(newImage, w, num_runs_img1 + num_runs_img2);
+
+    // Copies all runs from img1 into the new image's row.
+    CopyRuns(new_row, rs, row1, img1->run_size, num_runs_img1);
+
+    uint32 num_runs_total;
+    // Determines how to handle adjoining RLE runs based on their colors.
+    if (last_value != info2.color)
+    {
+      // Case 1: No merging of the last run from img1 and the first run from img2 is needed.
+      num_runs_total = num_runs_img1 + num_runs_img2; // Total number of runs in the combined row.
+      CopyRuns(new_row + num_runs_img1 * rs, rs, row2, img2->run_size, num_runs_img2);
+    }
+    else
+    {
+      // Case 2: Merges the last run from img1 with the first run from img2.
+      num_runs_total = num_runs_img1 + num_runs_img2 - 1; // Total number of runs after merging.
+      SetRun(new_row, rs, num_runs_img1 - 1,
+             GetRun(new_row, rs, num_runs_img1 - 1) + GetRun(row2, img2->run_size, 0));
+
+      // Copies the remaining runs from img2 into the new image's row.
+      CopyRuns(new_row + num_runs_img1 * rs, rs, row2 + img2->run_size, img2->run_size,
+               num_runs_img2 - 1);
+    }
+
+    CommitRLERow(newImage, i, w, info1.color, num_runs_total);
+  }
+}
+
+/// Replicate img2 to the right of img1 into dst (see PrepareResult),
+/// or into a new image
+static Image ImageRepROp(Image dst, const Image img1, const Image img2)
+{
+  if (dst != NULL && (dst == img1 || dst == img2))
+  {
+    // the operands must not change while they are read
+    MoveImage(dst, ImageRepROp(NULL, img1, img2));
+    return dst;
+  }
+
+  uint32 new_width = img1->width + img2->width;
+  uint32 new_height = img1->height;
+
+  // The rows of patterns are generated (and views resolved) before the
+  // workers read them
+  if (img1->pattern != STORED)
+  {
+    GeneratePatternRows(img1);
+  }
+  if (img2->pattern != STORED)
+  {
+    GeneratePatternRows(img2);
+  }
+  ResolveRuns(img1);
+  ResolveRuns(img2);
+  int workers = PlanWorkers(new_height);
+  Image newImage = PrepareResult(dst, new_width, new_height,
+                                 img1->num_runs + img2->num_runs, workers);
+  Image imgs[3] = {img1, img2, newImage};
+
+  ParallelFor(new_height, workers, ReplicateAtRightRange, imgs);
+
+  FinishResult(newImage, dst);
+
+  return newImage;
+}
+
+/// Replicate img2 to the right of imag1, creating a larger image
+/// Requires: the height of the two images must be the same.
+/// Returns the new larger image.
+/// Ensures: The original images are not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageReplicateAtRight(const Image img1, const Image img2)
+{
+  assert(img1 != NULL && img2 != NULL);
+  assert(img1->height == img2->height);
+
+  return ImageRepROp(NULL, img1, img2);
+}
+
+/// Replicate img2 to the right of img1 into dst, reusing the arenas of dst.
+void ImageReplicateAtRightInto(Image dst, const Image img1, const Image img2)
+{
+  assert(dst != NULL && img1 != NULL && img2 != NULL);
+  assert(img1->height == img2->height);
+
+  ImageRepROp(dst, img1, img2);
+}
 
-    // Determines how to handle overlapping or adjoining RLE runs based on their properties.
-    if ((num_runs_img1 % 2 != 0 && img1->row[i][0] != img2->row[i][0]) || (num_runs_img1 % 2 == 0 && img1->row[i][0] == img2->row[i][0]))
+/// Crop
+
+// A crop reads only the rows of the window, and only the runs of each row
+// that overlap the window, trimming those at its left and right edges.
+// Where the first run in the window is found depends on the form of a row:
+// - a row stored by its transitions (their prefix sums, see
+//   ImageSetEdgeRows) is searched: O(log runs + runs in the window);
+// - a row of runs gets, the first time it is cropped, the end of every
+//   MARK_STEP-th run (sampled prefix sums, its marks), kept in the row
+//   table; the marks are searched, and then at most MARK_STEP runs:
+//   O(log runs + MARK_STEP + runs in the window), once marked;
+// - a bitset row is read from the byte of the window on: O(window bytes).
+// A crop of the full width shares the rows of the image: no runs are
+// copied.
+
+// Number of runs from a mark of a row of runs to the next
+// (Rows of no more runs are not marked.)
+#define MARK_STEP 16
+
+/// Mark the runs of entry e of the row table of an image, if not done yet
+/// (An entry describing the same runs as the one before shares its marks.)
+/// (Like ResolveRuns, this changes img, which must not be done while other
+/// threads read it.)
+static void MarkRowRuns(const Image img, uint32 e)
+{
+  struct rowtable *t = img->table;
+  struct rowinfo row = t->row[e];
+  if (row.form != ROW_RUNS || row.num_runs <= MARK_STEP)
+  {
+    return;
+  }
+  if (t->mark == NULL)
+  {
+    size_t size = t->capacity * sizeof(uint32);
+    t->mark = PoolAlloc(&size);
+    for (uint32 k = 0; k < t->capacity; k++)
     {
-      // Case 1: No merging of the last run from img1 and the first run from img2 is needed.
-      uint32 num_runs_total = num_runs_img1 + num_runs_img2;      // Total number of runs in the combined row.
-      newImage->row[i] = AllocateRLERowArray(num_runs_total + 2); // Allocates memory for the combined row.
+      t->mark[k] = NO_ROW;
+    }
+  }
+  if (t->mark[e] != NO_ROW)
+  {
+    return;
+  }
+  if (e > 0 && row.offset == t->row[e - 1].offset &&
+      row.arena == t->row[e - 1].arena &&
+      row.num_runs == t->row[e - 1].num_runs &&
+      row.form == t->row[e - 1].form && t->mark[e - 1] != NO_ROW)
+  {
+    t->mark[e] = t->mark[e - 1];
+    return;
+  }
 
-      // Copies all runs from img1 into the new image's row.
-      newImage->row[i][0] = img1->row[i][0]; // Copies the starting value.
-      for (uint32 j = 1; j <= num_runs_img1; j++)
-      {
-        newImage->row[i][j] = img1->row[i][j];
-      }
+  uint32 n = row.num_runs / MARK_STEP; // (the last run is never marked)
+  check(t->num_marks + n < NO_ROW, "too many row marks");
+  if (t->num_marks + n > t->max_marks)
+  {
+    size_t size = 2 * (t->num_marks + n) * sizeof(uint32);
+    uint32 *marks = PoolAlloc(&size);
+    if (t->num_marks > 0)
+    {
+      memcpy(marks, t->marks, t->num_marks * sizeof(uint32));
+    }
+    PoolFree(t->marks, t->max_marks * sizeof(uint32));
+    t->marks = marks;
+    t->max_marks = size / sizeof(uint32);
+  }
+  const uint8 *runs = GetRowRuns(img, row);
+  uint8 rs = img->run_size;
+  uint32 *mark = t->marks + t->num_marks;
+  uint32 end = 0;
+  for (uint32 k = 0; k < n * MARK_STEP; k++)
+  {
+    end += GetRun(runs, rs, k);
+    if (k % MARK_STEP == MARK_STEP - 1)
+    {
+      mark[k / MARK_STEP] = end; // (the end of run k)
+    }
+  }
+  NUMOPS += n * MARK_STEP;
+  t->mark[e] = (uint32)t->num_marks;
+  t->num_marks += n;
+}
+
+// The state of ImageCrop, shared by its workers
+struct cropjob
+{
+  Image img, rslt;
+  uint32 x, y; // the corner of the window
+};
+
+/// Get the runs of the pixels [x, x + w) of a row of an image, given its
+/// descriptor and its marks (NULL if it has none), as stored (backwards, in
+/// a view with FLIP_RUNS), into rslt (stored with rs bytes each, with room
+/// for as many runs as the row has, or w if fewer), as worker wk
+/// Returns the number of runs written; *color gets the color of the first.
+static uint32 CropRowRuns(const Image img, struct rowinfo row,
+                          const uint32 *marks, uint32 x, uint32 w,
+                          uint8 *rslt, uint8 rs, uint8 *color, int wk)
+{
+  const uint8 *stored = GetRowRuns(img, row);
+  uint8 srs = img->run_size;
+  if (row.form == ROW_BITS)
+  {
+    // Shift the bits of the window to the start of a packed row
+    size_t nbytes = (size_t)BitsWords(w) * 8;
+    uint8 *bits = ScratchRowBuffer(wk, BITS_BUFFER, nbytes);
+    const uint8 *src = stored + x / 8;
+    size_t avail = (size_t)BitsWords(img->width) * 8 - x / 8; // (of src)
+    uint32 s = x % 8;
+    size_t b = 0;
+    for (; b < (w + 7) / 8; b++)
+    {
+      uint8 next = (s > 0 && b + 1 < avail) ? src[b + 1] >> (8 - s) : 0;
+      bits[b] = (uint8)(src[b] << s) | next;
+    }
+    memset(bits + b, 0, nbytes - b);
+    *color = row.color ^ ((src[0] >> (7 - s)) & 1);
+    NUMOPS += nbytes / 8;
+    return PackedRowRuns(bits, w, rslt, rs, UINT32_MAX);
+  }
+
+  // Run k (ending at end) holds pixel x
+  uint32 k, end, from = 0; // (runs are added up from run from on)
+  if (row.form == ROW_EDGES)
+  {
+    k = FindEdge(stored, srs, row.num_runs, x);
+    end = GetRun(stored, srs, k);
+  }
+  else
+  {
+    // From the last mark not past x, if any: the end of run from - 1
+    uint32 start = 0;
+    if (marks != NULL)
+    {
+      uint32 j = FindEdge((const uint8 *)marks, sizeof(uint32),
+                          row.num_runs / MARK_STEP, x);
+      from = j * MARK_STEP;
+      start = j > 0 ? marks[j - 1] : 0;
+    }
+    end = start + GetRun(stored, srs, from);
+    for (k = from; end <= x;)
+    {
+      end += GetRun(stored, srs, ++k);
+    }
+  }
+  *color = row.color ^ (k & 1);
 
-      // Copies all runs from img2 into the new image's row, starting where img1's runs end.
-      newImage->row[i][num_runs_img1 + 1] = img2->row[i][1]; // Starts with the first run of img2.
+  // The runs from there on, up to the right edge of the window
+  uint32 stop = x + w;
+  uint32 n = 0;
+  for (uint32 start = x;;)
+  {
+    SetRun(rslt, rs, n++, (end < stop ? end : stop) - start);
+    if (end >= stop)
+    {
+      break;
+    }
+    start = end;
+    k++;
+    end = (row.form == ROW_EDGES) ? GetRun(stored, srs, k)
+                                  : end + GetRun(stored, srs, k);
+  }
+  NUMOPS += (row.form == ROW_EDGES) ? n : k - from + 1;
+  return n;
+}
 
-      for (uint32 j = 2; j <= num_runs_img2; j++)
+/// Crop the rows [lo, hi) of the result of job, as worker w
+/// (once for each vertical span of rows)
+static void CropRange(void *ctx, uint32 lo, uint32 hi, int w)
+{
+  struct cropjob *job = ctx;
+  Image img = job->img, rslt = job->rslt;
+  const struct rowtable *t = img->table; // (NULL for patterns)
+  uint32 width = rslt->width;
+  uint8 rs = rslt->run_size;
+  int rev = (img->flip & FLIP_RUNS) != 0;
+  // (the window as stored, in a view with FLIP_RUNS)
+  uint32 x = rev ? img->width - job->x - width : job->x;
+  for (uint32 i = lo, next; i < hi; i = next)
+  {
+    struct rowinfo row = GetRowSpan(img, job->y + i, &next);
+    const uint32 *marks = NULL;
+    if (t != NULL && t->mark != NULL)
+    {
+      uint32 e = t->mark[RowEntry(img, job->y + i)];
+      marks = e != NO_ROW ? t->marks + e : NULL;
+    }
+    next = next - job->y < hi ? next - job->y : hi;
+    uint32 room = row.num_runs < width ? row.num_runs : width;
+    uint8 *runs = ReserveRLERow(rslt, w, room);
+    uint8 color;
+    uint32 n = CropRowRuns(img, row, marks, x, width, runs, rs, &color, w);
+    if (rev)
+    {
+      // In reading order: reversed, from the last run
+      for (uint32 a = 0, b = n - 1; a < b; a++, b--)
       {
-        newImage->row[i][num_runs_img1 + j] = img2->row[i][j];
+        uint32 run = GetRun(runs, rs, a);
+        SetRun(runs, rs, a, GetRun(runs, rs, b));
+        SetRun(runs, rs, b, run);
       }
-
-      newImage->row[i][num_runs_total + 1] = -1; // Adds the end marker for the row.
+      color ^= (n - 1) & 1;
     }
-    else
+    CommitRLERow(rslt, i, w, color, n);
+    for (uint32 r = i + 1; r < next; r++)
     {
-      // Case 2: Merges the last run from img1 with the first run from img2.
-      uint32 num_runs_total = num_runs_img1 + num_runs_img2 - 1;  // Total number of runs after merging.
-      newImage->row[i] = AllocateRLERowArray(num_runs_total + 2); // Allocates memory for the combined row.
+      rslt->row[r] = rslt->row[i]; // the rest of the span
+    }
+    rslt->arena[w]->last = next - 1; // (the next row may share its runs)
+  }
+}
 
-      // Copies all runs from img1 into the new image's row.
-      newImage->row[i][0] = img1->row[i][0]; // Copy the starting value.
-      for (uint32 j = 1; j <= num_runs_img1; j++)
+Image ImageCrop(const Image img, uint32 x, uint32 y, uint32 w, uint32 h)
+{
+  assert(img != NULL);
+  assert(w > 0 && h > 0);
+  assert(w <= img->width && h <= img->height);
+  assert(x <= img->width - w && y <= img->height - h);
+
+  // The rows of pattern images are generated before the workers read them
+  if (img->pattern != STORED)
+  {
+    GeneratePatternRows(img);
+  }
+
+  if (w == img->width && !(img->flip & FLIP_RUNS))
+  {
+    // The rows are not copied: the new image shares the arenas of img
+    Image rslt = PrepareSharedResult(NULL, w, h, img->num_arenas);
+    ShareArenas(rslt, img);
+    for (uint32 i = 0, next; i < h; i = next)
+    {
+      struct rowinfo row = GetRowSpan(img, y + i, &next);
+      next = next - y < h ? next - y : h; // (a row of the crop)
+      for (uint32 r = i; r < next; r++)
       {
-        newImage->row[i][j] = img1->row[i][j];
+        rslt->row[r] = row;
       }
+      rslt->num_runs += (size_t)(next - i) * row.num_runs;
+    }
+    FinishSharedResult(rslt, NULL);
+    return rslt;
+  }
 
-      // Merges the last run of img1 with the first run of img2.
-      newImage->row[i][num_runs_img1] += img2->row[i][1]; // Add the lengths of the overlapping runs.
+  // The rows of runs are marked before the workers read them
+  if (img->table != NULL)
+  {
+    for (uint32 i = 0, next; i < h; i = next)
+    {
+      GetRowSpan(img, y + i, &next);
+      MarkRowRuns(img, RowEntry(img, y + i));
+      next -= y;
+    }
+  }
 
-      // Copies the remaining runs from img2 into the new image's row.
-      for (uint32 j = 1; j <= num_runs_img2; j++)
+  int workers = PlanWorkers(h);
+  struct cropjob job = {img, NULL, x, y};
+  job.rslt = PrepareResult(NULL, w, h, (size_t)h * 2, workers);
+  ParallelFor(h, workers, CropRange, &job);
+  FinishResult(job.rslt, NULL);
+  return job.rslt;
+}
+
+/// Morphology
+
+// Dilation and erosion by a box are separable: the box is a row of pixels
+// (the horizontal pass), swept over a column of rows (the vertical pass).
+// Dilation grows the BLACK runs, and erosion the WHITE ones (it is the
+// dilation of the negative), so both passes are written for a color that
+// grows:
+// - the horizontal pass widens each run of that color by the reach of the
+//   box on either side: the runs of the other color shrink, and vanish if
+//   they get empty, merging the runs around them (O(runs) per row);
+// - the vertical pass combines the rows in reach of each row with the
+//   transition merge (rowEdgesOp), with OR (dilation) or AND (erosion).
+//   OR and AND are idempotent, so a vertical span of equal rows is merged
+//   once, and rows reaching the same spans share their result: a row costs
+//   the runs of the (at most h) spans it reaches.
+// Pixels beyond the borders never grow into the image: they are WHITE for
+// dilation, and BLACK for erosion.
+
+// The state of a morphology pass, shared by its workers
+struct morphjob
+{
+  Image img, rslt;
+  uint8 grow; // the color that grows (BLACK: dilation, WHITE: erosion)
+  // The box of pixel x covers the pixels [x - back, x + ahead] of its row
+  // (horizontal pass), or the box of row y the rows [y - back, y + ahead]
+  // (vertical pass)
+  uint32 back, ahead;
+};
+
+/// Grow the runs of color grow of a row, given by the ends of its n runs
+/// (in reading order) and its first color: by `before` pixels to the left,
+/// and `after` pixels to the right (within the row), over the runs of the
+/// other color, which shrink, and vanish if they get empty.
+/// Writes the runs of the result to rslt (it has at most n runs), and
+/// returns their number; *rslt_color gets the color of the first one.
+static uint32 GrowRowRuns(const uint8 *edges, uint32 n, uint8 color, uint8 rs,
+                          uint32 width, uint8 grow, uint32 before,
+                          uint32 after, uint8 *rslt, uint8 *rslt_color)
+{
+  // The result is the runs of the other color that are left, with runs of
+  // color grow in the gaps between them
+  uint32 num_runs = 0;
+  uint32 pos = 0; // the end of the result so far
+  *rslt_color = grow;
+  for (uint32 k = 0, start = 0; k < n; k++)
+  {
+    uint32 end = GetRun(edges, rs, k);
+    if (((color ^ k) & 1) != grow)
+    {
+      // (a run at a border does not shrink on that side)
+      uint32 s = k == 0 ? 0 : (start < width - after ? start + after : width);
+      uint32 e = k + 1 == n ? width : (end > before ? end - before : 0);
+      if (s < e)
       {
-        newImage->row[i][num_runs_img1 + j] = img2->row[i][j];
+        if (s > pos)
+        {
+          SetRun(rslt, rs, num_runs++, s - pos);
+        }
+        else
+        {
+          *rslt_color = grow ^ 1; // (s == 0: the row starts with this run)
+        }
+        SetRun(rslt, rs, num_runs++, e - s);
+        pos = e;
       }
+    }
+    start = end;
+  }
+  if (pos < width)
+  {
+    SetRun(rslt, rs, num_runs++, width - pos);
+  }
+  NUMOPS += n;
+  return num_runs;
+}
 
-      newImage->row[i][num_runs_total + 1] = -1; // Adds the end marker for the row.
+/// Grow the runs of the rows [lo, hi) for job (the horizontal pass), as
+/// worker w (once for each vertical span of rows)
+static void GrowRowsRange(void *ctx, uint32 lo, uint32 hi, int w)
+{
+  struct morphjob *job = ctx;
+  Image img = job->img, rslt = job->rslt;
+  for (uint32 i = lo, next; i < hi; i = next)
+  {
+    struct rowinfo row = GetRowSpan(img, i, &next);
+    next = next < hi ? next : hi;
+    const uint8 *edges = GetReadingEdges(img, row, w, 0);
+    uint8 *runs = ReserveRLERow(rslt, w, row.num_runs);
+    uint8 color;
+    // (a run of color grow reaches the pixels whose box covers it)
+    uint32 num_runs = GrowRowRuns(edges, row.num_runs, GetRowColor(img, row),
+                                  rslt->run_size, rslt->width, job->grow,
+                                  job->ahead, job->back, runs, &color);
+    CommitRLERow(rslt, i, w, color, num_runs);
+    for (uint32 r = i + 1; r < next; r++)
+    {
+      rslt->row[r] = rslt->row[i]; // the rest of the span
     }
+    rslt->arena[w]->last = next - 1; // (the next row may share its runs)
   }
+}
 
-  return newImage;
+/// Combine the rows in reach of each row of [lo, hi) for job (the vertical
+/// pass), as worker w
+/// A row that reaches the same vertical spans as the row above shares its
+/// result.
+static void GrowColumnsRange(void *ctx, uint32 lo, uint32 hi, int w)
+{
+  struct morphjob *job = ctx;
+  Image img = job->img, rslt = job->rslt;
+  uint32 width = img->width, height = img->height;
+  uint8 rs = img->run_size;
+  uint8 table = job->grow == BLACK ? BOOL_OR : BOOL_AND;
+  size_t nbytes = ((size_t)width + 1) * rs;
+  uint8 *acc = ScratchRowBuffer(w, MORPH_BUFFER, nbytes);
+  uint8 *tmp = ScratchRowBuffer(w, MORPH_BUFFER + 1, nbytes);
+
+  uint32 first_end = 0, last_end = 0; // the ends of the first and last
+                                      // spans reached by the row above
+  for (uint32 i = lo; i < hi; i++)
+  {
+    // The rows [top, bottom] are in reach
+    uint32 top = i > job->back ? i - job->back : 0;
+    uint32 bottom = job->ahead < height - 1 - i ? i + job->ahead : height - 1;
+    if (i > lo && top < first_end && bottom < last_end)
+    {
+      rslt->row[i] = rslt->row[i - 1]; // the same spans as the row above
+      rslt->arena[w]->last = i;
+      continue;
+    }
+
+    // Merge the transitions of the spans in reach
+    uint32 next;
+    struct rowinfo row = GetRowSpan(img, top, &next);
+    uint8 color = GetRowColor(img, row);
+    uint32 n = row.num_runs;
+    memcpy(acc, GetReadingEdges(img, row, w, 0), (size_t)n * rs);
+    first_end = next;
+    while (next <= bottom)
+    {
+      row = GetRowSpan(img, next, &next);
+      uint8 value = GetRowColor(img, row);
+      n = rowEdgesOp(acc, color, GetReadingEdges(img, row, w, 0), value, tmp,
+                     rs, width, table);
+      color = (table >> (2 * color + value)) & 1;
+      uint8 *merged = tmp;
+      tmp = acc;
+      acc = merged;
+    }
+    last_end = next;
+
+    uint8 *runs = ReserveRLERow(rslt, w, n);
+    memcpy(runs, acc, (size_t)n * rs);
+    EdgesToRuns(runs, rs, n);
+    CommitRLERow(rslt, i, w, color, n);
+  }
+}
+
+/// Run a morphology pass over img (see struct morphjob), with the rows
+/// split across the workers: the runs of each row grow (horizontal), or
+/// the rows in reach are combined (vertical)
+static Image MorphologyPass(const Image img, uint8 grow, uint32 back,
+                            uint32 ahead, int vertical)
+{
+  // The rows of pattern images are generated before the workers read them
+  if (img->pattern != STORED)
+  {
+    GeneratePatternRows(img);
+  }
+  int workers = PlanWorkers(img->height);
+  struct morphjob job = {img, NULL, grow, back, ahead};
+  job.rslt = PrepareResult(NULL, img->width, img->height,
+                           img->num_runs + img->height, workers);
+  ParallelFor(img->height, workers,
+              vertical ? GrowColumnsRange : GrowRowsRange, &job);
+  FinishResult(job.rslt, NULL);
+  return job.rslt;
+}
+
+/// Grow the runs of color grow of an image (see struct morphjob) by the box
+/// that covers the pixels [x - left, x + right] of the rows [y - up, y + down]
+/// of each pixel (x, y): a pixel gets color grow if any pixel in its box
+/// has it
+static Image Morphology(const Image img, uint8 grow, uint32 left,
+                        uint32 right, uint32 up, uint32 down)
+{
+  // (reaching beyond the image changes nothing)
+  left = left < img->width ? left : img->width;
+  right = right < img->width ? right : img->width;
+  up = up < img->height ? up : img->height;
+  down = down < img->height ? down : img->height;
+
+  if (up + down == 0)
+  {
+    return MorphologyPass(img, grow, left, right, 0);
+  }
+  if (left + right == 0)
+  {
+    return MorphologyPass(img, grow, up, down, 1);
+  }
+  Image rows = MorphologyPass(img, grow, left, right, 0);
+  Image rslt = MorphologyPass(rows, grow, up, down, 1);
+  ImageDestroy(&rows);
+  return rslt;
+}
+
+Image ImageDilate(const Image img, uint32 w, uint32 h)
+{
+  assert(img != NULL);
+  assert(w > 0 && h > 0);
+  return Morphology(img, BLACK, w / 2, (w - 1) / 2, h / 2, (h - 1) / 2);
+}
+
+Image ImageErode(const Image img, uint32 w, uint32 h)
+{
+  assert(img != NULL);
+  assert(w > 0 && h > 0);
+  return Morphology(img, WHITE, w / 2, (w - 1) / 2, h / 2, (h - 1) / 2);
+}
+
+Image ImageOpen(const Image img, uint32 w, uint32 h)
+{
+  assert(img != NULL);
+  assert(w > 0 && h > 0);
+  // (the dilation by the reflected box: back to the pixels left)
+  Image eroded = ImageErode(img, w, h);
+  Image rslt = Morphology(eroded, BLACK, (w - 1) / 2, w / 2, (h - 1) / 2,
+                          h / 2);
+  ImageDestroy(&eroded);
+  return rslt;
+}
+
+Image ImageClose(const Image img, uint32 w, uint32 h)
+{
+  assert(img != NULL);
+  assert(w > 0 && h > 0);
+  Image dilated = ImageDilate(img, w, h);
+  Image rslt = Morphology(dilated, WHITE, (w - 1) / 2, w / 2, (h - 1) / 2,
+                          h / 2);
+  ImageDestroy(&dilated);
+  return rslt;
+}
+
+/// Streaming pipelines
+
+// An image stream produces the rows of an image one at a time, on demand:
+// a source reads them from a PBM file (or takes them from an image), and
+// an operator pulls the rows of its input streams and combines them.
+// Each stream holds its current row as a 1-row image, rebuilt in place
+// (with the destination-passing forms of the operations), so a pipeline
+// needs memory for a few rows only, whatever the height of the images.
+// Operators that change a row in place (neg, vmirror) or pass rows along
+// (repb) just hand over the row of their input.
+
+enum streamkind
+{
+  STREAM_FILE,  // rows read from a PBM file
+  STREAM_IMAGE, // rows of an image
+  STREAM_NEG,
+  STREAM_VMIRROR,
+  STREAM_BOOL,  // boolean operation, with truth table op
+  STREAM_REPB,
+  STREAM_REPR,
+};
+
+struct imagestream
+{
+  uint32 width;
+  uint32 height;
+  uint32 next;       // index of the next row to produce
+  uint8 kind;        // see enum streamkind
+  uint8 op;          // truth table of a STREAM_BOOL
+  Image row;         // the current row (NULL if the row of an input is used)
+  ImageStream in[2]; // input streams, owned by the stream
+  // Sources
+  FILE *f;       // the PBM file of a STREAM_FILE
+  uint8 *bytes;  // packed row buffer, rounded up to whole 64-bit words
+  size_t nbytes; // number of bytes for each row
+  Image img;     // the image of a STREAM_IMAGE
+};
+
+/// Create a stream of the given kind and size, taking in1 and in2 as inputs
+static ImageStream NewStream(uint8 kind, uint32 width, uint32 height,
+                             ImageStream in1, ImageStream in2)
+{
+  ImageStream s = calloc(1, sizeof(struct imagestream));
+  check(s != NULL, "calloc");
+  s->kind = kind;
+  s->width = width;
+  s->height = height;
+  s->in[0] = in1;
+  s->in[1] = in2;
+  return s;
+}
+
+/// Produce the next row of a stream
+/// Returns a 1-row image, valid until the next row is produced.
+static Image StreamNextRow(ImageStream s)
+{
+  assert(s->next < s->height);
+  uint32 i = s->next++;
+  Image r;
+  switch (s->kind)
+  {
+  case STREAM_FILE:
+  {
+    check(fread(s->bytes, sizeof(uint8), s->nbytes, s->f) == s->nbytes,
+          "Reading pixels");
+    r = PrepareResult(s->row, s->width, 1, 2, 1);
+    CompressPackedRow(r, 0, 0, s->bytes);
+    FinishResult(r, s->row);
+    return r;
+  }
+  case STREAM_IMAGE:
+  {
+    // Share the row of the image
+    struct rowinfo row = GetRowInfo(s->img, i);
+    r = PrepareSharedResult(s->row, s->width, 1, 1);
+    row.arena = AttachArena(r, s->img->arena[row.arena]);
+    r->row[0] = row;
+    r->num_runs = row.num_runs;
+    return r;
+  }
+  case STREAM_NEG:
+    r = StreamNextRow(s->in[0]);
+    ImageNEGInPlace(r);
+    return r;
+  case STREAM_VMIRROR:
+    r = StreamNextRow(s->in[0]);
+    ImageVerticalMirrorInPlace(r);
+    return r;
+  case STREAM_BOOL:
+  {
+    Image r1 = StreamNextRow(s->in[0]);
+    Image r2 = StreamNextRow(s->in[1]);
+    return ImageRowOp(s->row, r1, r2, s->op);
+  }
+  case STREAM_REPB:
+    return StreamNextRow(s->in[i < s->in[0]->height ? 0 : 1]);
+  default: // STREAM_REPR
+  {
+    Image r1 = StreamNextRow(s->in[0]);
+    Image r2 = StreamNextRow(s->in[1]);
+    return ImageRepROp(s->row, r1, r2);
+  }
+  }
+}
+
+/// Open a stream of the rows of a raw PBM file.
+/// The rows are read as they are pulled: only one is kept in memory.
+/// (The caller is responsible for destroying the returned stream!)
+ImageStream ImageStreamLoad(const char *filename)
+{ ///
+  assert(filename != NULL);
+  int w, h;
+  char c;
+  FILE *f = NULL;
+
+  check((f = fopen(filename, "rb")) != NULL, "Open failed");
+  // Parse PBM header
+  check(fscanf(f, "P%c ", &c) == 1 && c == '4', "Invalid file format");
+  skipComments(f);
+  check(fscanf(f, "%d ", &w) == 1 && w >= 0, "Invalid width");
+  skipComments(f);
+  check(fscanf(f, "%d", &h) == 1 && h >= 0, "Invalid height");
+  check(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected");
+
+  ImageStream s = NewStream(STREAM_FILE, w, h, NULL, NULL);
+  s->f = f;
+  s->nbytes = ((size_t)w + 8 - 1) / 8;
+  s->bytes = calloc(s->nbytes / 8 + 1, 8); // (see LoadStreamPBM)
+  check(s->bytes != NULL, "calloc");
+  s->row = ImageCreate(w, 1, WHITE);
+  return s;
+}
+
+/// Open a stream of the rows of an image.
+/// The rows are shared, not copied; img must not be changed or destroyed
+/// before the stream is.
+/// (The caller is responsible for destroying the returned stream!)
+ImageStream ImageStreamOfImage(const Image img)
+{ ///
+  assert(img != NULL);
+  if (img->pattern != STORED)
+  {
+    GeneratePatternRows(img);
+  }
+  ResolveRuns(img);
+  ImageStream s = NewStream(STREAM_IMAGE, img->width, img->height, NULL, NULL);
+  s->img = img;
+  s->row = ImageCreate(img->width, 1, WHITE);
+  return s;
+}
+
+/// Stream operators.
+/// Each operator takes its input streams, which must not have produced any
+/// row yet, and returns a new stream; the inputs belong to the new stream
+/// from then on, and are destroyed with it.
+/// The preconditions on the sizes are those of the image operations.
+
+ImageStream ImageStreamNEG(ImageStream s)
+{ ///
+  assert(s != NULL && s->next == 0);
+  return NewStream(STREAM_NEG, s->width, s->height, s, NULL);
+}
+
+ImageStream ImageStreamVerticalMirror(ImageStream s)
+{ ///
+  assert(s != NULL && s->next == 0);
+  return NewStream(STREAM_VMIRROR, s->width, s->height, s, NULL);
+}
+
+ImageStream ImageStreamBoolOp(ImageStream s1, ImageStream s2, uint8 op)
+{ ///
+  assert(s1 != NULL && s2 != NULL && s1 != s2);
+  assert(s1->next == 0 && s2->next == 0);
+  assert(s1->width == s2->width && s1->height == s2->height);
+  assert(op <= 0xF);
+
+  ImageStream s = NewStream(STREAM_BOOL, s1->width, s1->height, s1, s2);
+  s->op = op;
+  s->row = ImageCreate(s->width, 1, WHITE);
+  return s;
+}
+
+ImageStream ImageStreamAND(ImageStream s1, ImageStream s2)
+{ ///
+  return ImageStreamBoolOp(s1, s2, BOOL_AND);
+}
+
+ImageStream ImageStreamOR(ImageStream s1, ImageStream s2)
+{ ///
+  return ImageStreamBoolOp(s1, s2, BOOL_OR);
+}
+
+ImageStream ImageStreamXOR(ImageStream s1, ImageStream s2)
+{ ///
+  return ImageStreamBoolOp(s1, s2, BOOL_XOR);
+}
+
+ImageStream ImageStreamReplicateAtBottom(ImageStream s1, ImageStream s2)
+{ ///
+  assert(s1 != NULL && s2 != NULL && s1 != s2);
+  assert(s1->next == 0 && s2->next == 0);
+  assert(s1->width == s2->width);
+
+  return NewStream(STREAM_REPB, s1->width, s1->height + s2->height, s1, s2);
+}
+
+ImageStream ImageStreamReplicateAtRight(ImageStream s1, ImageStream s2)
+{ ///
+  assert(s1 != NULL && s2 != NULL && s1 != s2);
+  assert(s1->next == 0 && s2->next == 0);
+  assert(s1->height == s2->height);
+
+  ImageStream s = NewStream(STREAM_REPR, s1->width + s2->width, s1->height,
+                            s1, s2);
+  s->row = ImageCreate(s->width, 1, WHITE);
+  return s;
+}
+
+/// Get stream width
+int ImageStreamWidth(const ImageStream s)
+{ ///
+  assert(s != NULL);
+  return s->width;
+}
+
+/// Get stream height
+int ImageStreamHeight(const ImageStream s)
+{ ///
+  assert(s != NULL);
+  return s->height;
+}
+
+/// Run a stream: pull all its rows, and write them to a PBM file.
+/// The stream must not have produced any row yet; afterwards, it is
+/// exhausted, and may only be destroyed.
+/// On success, returns nonzero.
+/// On failure, returns 0, and
+/// a partial and invalid file may be left in the system.
+int ImageStreamSave(ImageStream s, const char *filename)
+{ ///
+  assert(s != NULL && s->next == 0);
+  FILE *f = NULL;
+
+  check((f = fopen(filename, "wb")) != NULL, "Open failed");
+  check(fprintf(f, "P4\n%u %u\n", s->width, s->height) > 0,
+        "Writing header failed");
+
+  size_t nbytes = ((size_t)s->width + 8 - 1) / 8; // number of bytes for each row
+  uint8 *bytes = malloc(nbytes + 1);
+  check(bytes != NULL, "malloc");
+  while (s->next < s->height)
+  {
+    PackRow(StreamNextRow(s), 0, bytes, nbytes, 0);
+    check(fwrite(bytes, sizeof(uint8), nbytes, f) == nbytes,
+          "Writing pixels failed");
+  }
+  free(bytes);
+
+  // Cleanup
+  fclose(f);
+  return 0;
+}
+
+/// Destroy a stream, with its input streams.
+/// Requires: valid pointer to a valid stream.
+/// Ensures: *sp==NULL.
+void ImageStreamDestroy(ImageStream *sp)
+{ ///
+  assert(sp != NULL);
+
+  ImageStream s = *sp;
+  if (s == NULL)
+  {
+    return;
+  }
+
+  ImageStreamDestroy(&s->in[0]);
+  ImageStreamDestroy(&s->in[1]);
+  if (s->f != NULL)
+  {
+    fclose(s->f);
+  }
+  free(s->bytes);
+  ImageDestroy(&s->row);
+  free(s);
+
+  *sp = NULL;
 }
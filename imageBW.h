@@ -14,15 +14,23 @@
 #define IMAGEBW_H
 
 #include <inttypes.h>
+#include <stddef.h>
 
 // Types for non-negative integer values
 typedef uint8_t uint8;
 typedef uint16_t uint16;
 typedef uint32_t uint32;
+typedef uint64_t uint64;
 
 // Type Image is a pointer to image objects
 typedef struct image *Image;
 
+// Streams of image rows (see ImageStreamLoad)
+typedef struct imagestream *ImageStream;
+
+// Connected components of an image (see ImageLabelComponents)
+typedef struct imagecomponents *ImageComponents;
+
 // The values for the B and W pixels
 #define BLACK 1 // Black pixel value
 #define WHITE 0 // White pixel value
@@ -31,6 +39,81 @@ typedef struct image *Image;
 /// Currently, simply calibrate instrumentation and set names of counters.
 void ImageInit(void);
 
+/// Row interning (hash-consing).
+/// When enabled, every image built afterwards stores each distinct row
+/// only once, and repeated rows refer to that single copy.
+/// This saves memory (and time, in later operations) on images with many
+/// repeated rows, at the cost of hashing each row as it is built.
+/// Disabled by default.
+void ImageSetRowInterning(int enable);
+
+/// Memory-mapped loading.
+/// When enabled, ImageLoad maps regular files into memory and decodes the
+/// rows straight from the mapped pages, saving the copy made by fread and
+/// letting the kernel read ahead.
+/// Other files (e.g., pipes) are still read with stdio.
+/// Enabled by default.
+void ImageSetMappedLoad(int enable);
+
+/// Row-parallel execution.
+/// Operations that build one row at a time (boolean operations, vertical
+/// mirror, load and save) split their rows across n threads, balancing the
+/// load by work stealing; small images are still processed by one thread.
+/// The instrumentation counters sum the work of all threads.
+/// While row interning is enabled, operations run on a single thread.
+/// Defaults to the number of online processors (set by ImageInit).
+void ImageSetThreads(int n);
+
+/// Block pooling.
+/// Images take their memory blocks (header, row table, runs) from a pool
+/// of blocks freed by destroyed images, kept in lists by size class, and
+/// fall back to malloc only when the pool has no block of the size needed.
+/// Each thread caches a few small blocks, so most blocks are taken and
+/// returned without locking; the pool holds up to 256 MiB.
+/// Enabled by default; disabling it also frees the blocks held.
+void ImageSetPooling(int enable);
+
+/// Statistics of the block pool:
+/// the number of blocks taken from the pool (hits) and from malloc
+/// (misses), and the number of bytes held by the pool.
+void ImageGetPoolStats(unsigned long *hits, unsigned long *misses, size_t *held);
+
+/// Free the blocks held by the pool (and cached by the calling thread).
+void ImageTrimPool(void);
+
+/// Vertical spans (2D RLE).
+/// A row equal to the row just above it shares its runs, and consecutive
+/// rows with the same runs and color form a vertical span, which the row
+/// table stores as a single entry (once the image is built, and if that
+/// saves at least half of the table).  Boolean operations, evaluation,
+/// comparison and saving compute each pair of operand spans once.
+/// On blank-heavy pages, this cuts memory and time roughly by the ratio of
+/// distinct rows to rows; reading an arbitrary row costs O(log spans).
+/// Enabled by default.
+void ImageSetRowSpans(int enable);
+
+/// Bitset rows (hybrid row storage).
+/// Each row is stored either as runs or as a bitset of its pixels, in whole
+/// 64-bit words, whichever takes less space: rows with more runs than
+/// (width/64 rounded up) * 8 / run size, such as halftones and noise, are
+/// stored as bitsets.  Boolean operations combine two bitset rows a word
+/// at a time, with AVX2 or SSE2 instructions where the CPU has them; a row
+/// stored as runs meets a bitset row as a bitset, and each result row is
+/// stored in the form that takes less space again.
+/// Enabled by default.
+void ImageSetBitsetRows(int enable);
+
+/// Transition rows (edge encoding).
+/// Rows that are not stored as bitsets are stored by the x positions of
+/// their color transitions (the ends of their runs), instead of the run
+/// lengths: the same space, but ImageGetPixel is then a binary search, and
+/// boolean operations merge the transitions of two rows as sorted sets,
+/// with no prefix sums (XOR is their symmetric difference).
+/// Rows are converted from and to run lengths as needed, so images of both
+/// encodings combine in any operation.
+/// Disabled by default.
+void ImageSetEdgeRows(int enable);
+
 /// Image management functions
 
 /// Create a new BW image, either BLACK or WHITE.
@@ -59,6 +142,34 @@ Image ImageCreate(uint32 width, uint32 height, uint8 val);
 Image ImageCreateChessboard(uint32 width, uint32 height, uint32 square_edge,
                             uint8 first_value);
 
+/// Create a new BW image, with a pattern of stripes of alternating colors.
+///   width, height : the dimensions of the new image.
+///   stripe_width : the width of each stripe.
+///   vertical : nonzero for vertical stripes, zero for horizontal stripes.
+///   first_value: the pixel color (BLACK or WHITE) of the first stripe.
+/// Requires: width, height and stripe_width must be positive,
+/// first_value is either BLACK or WHITE.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageCreateStripes(uint32 width, uint32 height, uint32 stripe_width,
+                         int vertical, uint8 first_value);
+
+/// Create a new BW image, with a grid of lines over a background
+/// of the opposite color.
+///   width, height : the dimensions of the new image.
+///   spacing : the distance between consecutive lines (of both directions).
+///   thickness : the thickness of the lines.
+///   line_value: the pixel color (BLACK or WHITE) of the lines.
+/// The first line of each direction starts at the first row/column.
+/// Requires: width and height must be positive, 0 < thickness < spacing,
+/// line_value is either BLACK or WHITE.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageCreateGrid(uint32 width, uint32 height, uint32 spacing,
+                      uint32 thickness, uint8 line_value);
+
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
@@ -77,16 +188,30 @@ void ImageRLEPrint(const Image img);
 /// PBM BW image file operations
 
 /// Load a PBM BW image file.
-/// Only binary PBM files are accepted.
+/// Only binary PBM files are accepted,
+/// and native RLE files, named with the .rle extension.
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 Image ImageLoad(const char *filename);
 
 /// Save image to PBM file.
+/// If filename ends in .rle, the image is saved in the native RLE format:
+/// the runs and row table as laid out in memory, which load with no
+/// re-encoding (and only on hosts with the same byte order).
 /// On success, returns unspecified integer. (No need to check!)
 /// On failure, does not return, EXITS program!
 int ImageSave(const Image img, const char *filename);
 
+/// Load a range of rows of a native RLE file.
+///   first : index of the first row to load.
+///   count : number of rows to load.
+/// Only the row table entries and the runs of those rows are read.
+/// Requires: first + count must not exceed the height of the stored image.
+/// On success, a new image is returned, with the same width and count rows.
+/// On failure, does not return, EXITS program!
+/// (The caller is responsible for destroying the returned image!)
+Image ImageLoadRLERows(const char *filename, uint32 first, uint32 count);
+
 /// Information queries
 
 /// Get image width
@@ -95,12 +220,120 @@ int ImageWidth(const Image img);
 /// Get image height
 int ImageHeight(const Image img);
 
+/// Get the number of bytes of memory an image uses
+/// (header, row table and runs; memory shared with other images is
+/// counted in full).
+size_t ImageMemorySize(const Image img);
+
+/// Get the pixel value (BLACK or WHITE) at column x of row y of an image.
+/// Requires: x < width and y < height.
+uint8 ImageGetPixel(const Image img, uint32 x, uint32 y);
+
+/// Get the number of rows of an image stored as bitsets
+/// (see ImageSetBitsetRows).
+uint32 ImageBitsetRowCount(const Image img);
+
 /// Image comparison
 
+/// Get the fingerprint of an image (a 64-bit hash of its size and pixels):
+/// equal images have equal fingerprints, whatever the way their rows are
+/// stored, and different images almost surely have different ones.
+/// It is computed when first needed (in O(rows + runs) time) and kept with
+/// the image, so later calls take O(1) time until the image changes.
+uint64 ImageHash(const Image img);
+
+/// Images with different fingerprints (see ImageHash) are found different
+/// in O(1) time; images with equal fingerprints are compared row by row.
 int ImageIsEqual(const Image img1, const Image img2);
 
 int ImageIsDifferent(const Image img1, const Image img2);
 
+/// Pixel counts and mask metrics
+
+/// These functions count pixels by merging the runs of the rows of the
+/// images (or their bitsets, a word at a time): only lengths are added up,
+/// and no result image, or row, is built.  Equal rows are counted once
+/// (see ImageSetRowSpans), and the rows are split across threads (see
+/// ImageSetThreads).
+/// Operand images must be of the same size.
+
+/// Get the number of BLACK pixels of an image.
+uint64 ImageCountBlack(const Image img);
+
+/// Count the pixels of each pair of values of two images:
+/// counts[2*v1 + v2] is the number of pixels that are v1 in img1 and v2 in
+/// img2.  (For a predicted mask img1 and its ground truth img2, these are
+/// the true negatives, false negatives, false positives and true positives.)
+void ImageCountPairs(const Image img1, const Image img2, uint64 counts[4]);
+
+/// Get the number of pixels that differ between two images (their Hamming
+/// distance: the number of BLACK pixels of their XOR).
+uint64 ImageCountDiff(const Image img1, const Image img2);
+
+/// Get the number of pixels that are BLACK in both images (the number of
+/// BLACK pixels of their AND).
+uint64 ImageIntersectionCount(const Image img1, const Image img2);
+
+/// Scores of a predicted mask against its ground truth (BLACK pixels are in
+/// the mask), from a single count of their pixels (see ImageCountPairs):
+///   IoU = |P & T| / |P | T|            Dice = 2 |P & T| / (|P| + |T|)
+///   precision = |P & T| / |P|         recall = |P & T| / |T|
+/// A score whose denominator is 0 is 1 (there were no pixels to get wrong).
+/// The scores whose pointer is NULL are not stored.
+void ImageMaskScores(const Image pred, const Image truth, double *iou,
+                     double *dice, double *precision, double *recall);
+
+/// Each score of ImageMaskScores, alone.
+double ImageIoU(const Image pred, const Image truth);
+double ImageDice(const Image pred, const Image truth);
+double ImagePrecision(const Image pred, const Image truth);
+double ImageRecall(const Image pred, const Image truth);
+
+/// Connected components
+
+/// Label the connected components of the BLACK pixels of an image, with
+/// 4-connectivity (pixels touch through their edges) or 8-connectivity
+/// (also through their corners).
+/// The components are labeled on the runs of the rows, with no pixels
+/// visited: each BLACK run is joined to the runs it touches in the row
+/// above.  A vertical span of equal rows (see ImageSetRowSpans) is labeled
+/// once, as a single run per BLACK run of the row.
+/// Time and memory are O(runs), and not O(pixels).
+/// Components are numbered 0, 1, ... in reading order of their first pixel.
+/// Requires: connectivity is 4 or 8.
+/// (The caller is responsible for destroying the returned components!)
+ImageComponents ImageLabelComponents(const Image img, int connectivity);
+
+/// Get the number of components.
+uint32 ImageComponentsCount(const ImageComponents c);
+
+/// Get the number of pixels of component k.
+/// Requires: k < ImageComponentsCount(c).
+uint64 ImageComponentArea(const ImageComponents c, uint32 k);
+
+/// Get the bounding box of component k: its pixels are in the columns
+/// [x, x + w) of the rows [y, y + h), and it touches all four sides.
+/// Requires: k < ImageComponentsCount(c).
+void ImageComponentBox(const ImageComponents c, uint32 k, uint32 *x,
+                       uint32 *y, uint32 *w, uint32 *h);
+
+/// Get the number of runs of component k (see ImageComponentRun).
+/// Requires: k < ImageComponentsCount(c).
+uint32 ImageComponentNumRuns(const ImageComponents c, uint32 k);
+
+/// Get run j of component k: the pixels in the columns [x, x + len) of the
+/// rows [y, y + rows), BLACK, with WHITE pixels (or the border) at both
+/// ends.  rows is 1, unless the run was labeled once for a span of equal
+/// rows.  The runs of a component are in reading order (by y, then x).
+/// Requires: k < ImageComponentsCount(c), j < ImageComponentNumRuns(c, k).
+void ImageComponentRun(const ImageComponents c, uint32 k, uint32 j, uint32 *x,
+                       uint32 *y, uint32 *len, uint32 *rows);
+
+/// Destroy the components.
+/// Requires: valid pointer to valid components.
+/// Ensures: *cp==NULL.
+void ImageComponentsDestroy(ImageComponents *cp);
+
 /// Boolean Operations on image pixels
 
 /// These functions apply boolean operations to images,
@@ -119,11 +352,96 @@ Image ImageOR(const Image img1, const Image img2);
 
 Image ImageXOR(const Image img1, const Image img2);
 
+/// Destination-passing forms.
+/// These functions store the result in an existing image, dst,
+/// which is overwritten (whatever its size), instead of returning a new one.
+/// dst keeps the room of its own row table and runs for the result, and
+/// grows it only if needed: so, repeated on images of the same size (e.g.,
+/// the frames of a video), they allocate no memory in steady state.
+/// (Runs of dst shared with other images are never overwritten.)
+/// With several threads (see ImageSetThreads), the rows each thread builds
+/// vary from call to call: the room of dst may grow in the first few calls.
+/// dst may be one of the operands.
+///
+/// ImageNEGInto (like ImageNEG) shares the rows of img: no runs are copied.
+
+void ImageNEGInto(Image dst, const Image img);
+
+void ImageANDInto(Image dst, const Image img1, const Image img2);
+
+void ImageORInto(Image dst, const Image img1, const Image img2);
+
+void ImageXORInto(Image dst, const Image img1, const Image img2);
+
+/// In-place negation: img is changed.
+void ImageNEGInPlace(Image img);
+
+/// Boolean operators, for ImageBoolOp.
+/// Each operator is given by its truth table: bit (2*p1 + p2) holds
+/// the result for pixel p1 of img1 and pixel p2 of img2.
+/// (So any value from 0 to 15 is a valid operator.)
+#define BOOL_FALSE 0x0     // 0
+#define BOOL_NOR 0x1       // ~(p1 | p2)
+#define BOOL_NOTAND 0x2    // ~p1 & p2
+#define BOOL_NOT1 0x3      // ~p1
+#define BOOL_ANDNOT 0x4    // p1 & ~p2
+#define BOOL_NOT2 0x5      // ~p2
+#define BOOL_XOR 0x6       // p1 ^ p2
+#define BOOL_NAND 0x7      // ~(p1 & p2)
+#define BOOL_AND 0x8       // p1 & p2
+#define BOOL_XNOR 0x9      // ~(p1 ^ p2)
+#define BOOL_SECOND 0xA    // p2
+#define BOOL_IMPLIES 0xB   // ~p1 | p2
+#define BOOL_FIRST 0xC     // p1
+#define BOOL_IMPLIEDBY 0xD // p1 | ~p2
+#define BOOL_OR 0xE        // p1 | p2
+#define BOOL_TRUE 0xF      // 1
+
+/// Combine img1 and img2 pixel by pixel with the boolean operator op.
+/// Requires: both images have the same size, op <= 0xF.
+Image ImageBoolOp(const Image img1, const Image img2, uint8 op);
+
+/// ImageBoolOp into dst (see ImageANDInto).
+void ImageBoolOpInto(Image dst, const Image img1, const Image img2, uint8 op);
+
+/// Reductions, for ImageReduce.
+#define REDUCE_AND 0      // BLACK where all inputs are BLACK
+#define REDUCE_OR 1       // BLACK where some input is BLACK
+#define REDUCE_XOR 2      // BLACK where an odd number of inputs are BLACK
+#define REDUCE_MAJORITY 3 // BLACK where more than half the inputs are BLACK
+
+/// Reduce the k images imgs[0..k-1] to one, pixel by pixel, with op.
+/// The images are combined in a single sweep (a k-way merge of their runs),
+/// without building intermediate images.
+/// Requires: k > 0, all images have the same size, op is a REDUCE_* value.
+Image ImageReduce(const Image imgs[], uint32 k, uint8 op);
+
+/// ImageReduce into dst (see ImageANDInto).
+void ImageReduceInto(Image dst, const Image imgs[], uint32 k, uint8 op);
+
+/// Evaluate a boolean expression over the k images imgs[0..k-1],
+/// pixel by pixel, in a single sweep, without building intermediate images.
+/// In expr, the images are named by the letters A, B, C, ... (A is imgs[0]),
+/// and may be combined with ~, &, ^, | (with the precedence of C),
+/// parentheses and the constants 0 (WHITE) and 1 (BLACK).
+/// Example: "(A & B) | ~C".
+/// Requires: 0 < k <= 26, all images have the same size, expr is valid.
+Image ImageEval(const Image imgs[], uint32 k, const char *expr);
+
+/// ImageEval into dst (see ImageANDInto).
+void ImageEvalInto(Image dst, const Image imgs[], uint32 k, const char *expr);
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
 /// returning a new image as a result.
 ///
+/// The mirrors of a loaded or computed image are views: they share the
+/// rows of img and only record the new orientation, in O(1).  Boolean
+/// operations and ImageSave read views directly; other operations resolve
+/// a left-right flip once, when they first read the rows.
+/// (Mirrors of pattern images are built row by row.)
+///
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 
@@ -135,6 +453,14 @@ Image ImageXOR(const Image img1, const Image img2);
 /// (The caller is responsible for destroying the returned image!)
 Image ImageHorizontalMirror(const Image img);
 
+/// Horizontal mirror into dst (see ImageANDInto).
+/// dst shares the rows of img: no runs are copied.
+void ImageHorizontalMirrorInto(Image dst, const Image img);
+
+/// In-place horizontal mirror: img is changed.
+/// Only the orientation of img is flipped.
+void ImageHorizontalMirrorInPlace(Image img);
+
 /// Mirror an image = flip left-right.
 /// Returns a mirrored version of the image.
 /// Ensures: The original img is not modified.
@@ -143,6 +469,14 @@ Image ImageHorizontalMirror(const Image img);
 /// (The caller is responsible for destroying the returned image!)
 Image ImageVerticalMirror(const Image img);
 
+/// Vertical mirror into dst (see ImageANDInto).
+/// dst shares the rows of img: no runs are copied.
+void ImageVerticalMirrorInto(Image dst, const Image img);
+
+/// In-place vertical mirror: img is changed.
+/// Only the orientation of img is flipped.
+void ImageVerticalMirrorInPlace(Image img);
+
 /// Replicate img2 at the bottom of imag1, creating a larger image
 /// Requires: the width of the two images must be the same.
 /// Returns the new larger image.
@@ -152,6 +486,10 @@ Image ImageVerticalMirror(const Image img);
 /// (The caller is responsible for destroying the returned image!)
 Image ImageReplicateAtBottom(const Image img1, const Image img2);
 
+/// Replicate at bottom into dst (see ImageANDInto).
+/// dst shares the rows of img1 and img2: no runs are copied.
+void ImageReplicateAtBottomInto(Image dst, const Image img1, const Image img2);
+
 /// Replicate img2 to the right of imag1, creating a larger image
 /// Requires: the height of the two images must be the same.
 /// Returns the new larger image.
@@ -161,4 +499,119 @@ Image ImageReplicateAtBottom(const Image img1, const Image img2);
 /// (The caller is responsible for destroying the returned image!)
 Image ImageReplicateAtRight(const Image img1, const Image img2);
 
+/// Replicate at right into dst (see ImageANDInto).
+void ImageReplicateAtRightInto(Image dst, const Image img1, const Image img2);
+
+/// Crop an image: get the rectangle of w x h pixels with its top-left
+/// corner at column x of row y.
+/// Only the rows of the rectangle are read, and only the runs of each row
+/// that overlap it (trimmed at its left and right edges).  A row costs:
+/// - stored by its transitions (see ImageSetEdgeRows):
+///   O(log runs + runs in the rectangle), by binary search;
+/// - stored as runs: O(log runs + runs in the rectangle), by binary search
+///   of sampled prefix sums of its runs, kept in img the first time the row
+///   is cropped (that crop reads all the runs of the row);
+/// - stored as a bitset: O(bytes of the rectangle).
+/// A crop of the full width shares the rows of img: no runs are copied.
+/// (As it may change img, it must not run while other threads read img.)
+/// Requires: w > 0, h > 0, x + w <= width and y + h <= height.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageCrop(const Image img, uint32 x, uint32 y, uint32 w, uint32 h);
+
+/// Morphology
+
+/// These functions apply rectangular morphology, by the box of w x h
+/// pixels, returning a new image as a result.
+/// The box of pixel (x, y) covers the columns [x - w/2, x + (w-1)/2] of
+/// the rows [y - h/2, y + (h-1)/2] (it is centered, for odd sizes).
+/// They work on the runs of the rows: the runs of one color are widened
+/// over the runs of the other, which shrink (and vanish, merging the runs
+/// around them); then the rows in reach of each row are merged with OR
+/// (or AND).  A row costs the runs of the (at most h) rows in its box, and
+/// vertical spans of equal rows (see ImageSetRowSpans) are merged once.
+/// Requires: w > 0 and h > 0.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+
+/// Dilate an image: a pixel is BLACK if any pixel in its box is BLACK
+/// (pixels beyond the borders are WHITE).
+Image ImageDilate(const Image img, uint32 w, uint32 h);
+
+/// Erode an image: a pixel is BLACK if all the pixels in its box are BLACK
+/// (pixels beyond the borders are BLACK: the erosion is the negative of
+/// the dilation of the negative, and does not eat into the image from its
+/// borders).
+Image ImageErode(const Image img, uint32 w, uint32 h);
+
+/// Open an image: erode it, then dilate the result by the reflected box.
+/// (BLACK regions narrower than the box are removed; the others are kept.)
+Image ImageOpen(const Image img, uint32 w, uint32 h);
+
+/// Close an image: dilate it, then erode the result by the reflected box.
+/// (WHITE gaps narrower than the box are filled; the others are kept.)
+Image ImageClose(const Image img, uint32 w, uint32 h);
+
+/// Streaming pipelines.
+/// For images too large to be loaded, even in RLE form, rows can be
+/// processed one at a time, flowing through a pipeline of streams:
+/// a source (a PBM file, or an image), operators chained after it, and a
+/// sink (ImageStreamSave) that pulls the rows through the pipeline.
+/// A pipeline needs memory for a few rows only, whatever the height of
+/// the images.  E.g.:
+///   ImageStream s = ImageStreamAND(ImageStreamLoad("a.pbm"),
+///                                  ImageStreamLoad("b.pbm"));
+///   ImageStreamSave(s, "out.pbm");
+///   ImageStreamDestroy(&s);
+/// Only operations that build each row from the same rows of their
+/// operands can be streamed (not, e.g., the horizontal mirror).
+
+/// Open a stream of the rows of a raw PBM file.
+/// (The caller is responsible for destroying the returned stream!)
+ImageStream ImageStreamLoad(const char *filename);
+
+/// Open a stream of the rows of an image (e.g., a pattern), which are
+/// shared, not copied: img must outlive the stream.
+/// (The caller is responsible for destroying the returned stream!)
+ImageStream ImageStreamOfImage(const Image img);
+
+/// Stream operators.
+/// Each one takes its input streams, which must not have produced any row
+/// yet, and returns a new stream; the inputs are destroyed with it, and
+/// must not be used otherwise.
+/// Requires: the same sizes as the image operations.
+ImageStream ImageStreamNEG(ImageStream s);
+
+ImageStream ImageStreamAND(ImageStream s1, ImageStream s2);
+
+ImageStream ImageStreamOR(ImageStream s1, ImageStream s2);
+
+ImageStream ImageStreamXOR(ImageStream s1, ImageStream s2);
+
+ImageStream ImageStreamBoolOp(ImageStream s1, ImageStream s2, uint8 op);
+
+ImageStream ImageStreamVerticalMirror(ImageStream s);
+
+ImageStream ImageStreamReplicateAtBottom(ImageStream s1, ImageStream s2);
+
+ImageStream ImageStreamReplicateAtRight(ImageStream s1, ImageStream s2);
+
+int ImageStreamWidth(const ImageStream s);
+
+int ImageStreamHeight(const ImageStream s);
+
+/// Run a stream: pull all its rows through the pipeline, and write them to
+/// a PBM file.  Afterwards, the stream may only be destroyed.
+/// On success, returns nonzero.
+/// On failure, returns 0, and
+/// a partial and invalid file may be left in the system.
+int ImageStreamSave(ImageStream s, const char *filename);
+
+/// Destroy a stream, with its input streams.
+/// Requires: valid pointer to a valid stream.
+/// Ensures: *sp==NULL.
+void ImageStreamDestroy(ImageStream *sp);
+
 #endif
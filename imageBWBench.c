@@ -0,0 +1,1381 @@
+// imageBWBench - Benchmarks for the imageBW module.
+//
+// This program measures the throughput of imageBW operations,
+// comparing them, where it makes sense, with reference implementations
+// of the former approaches.
+//
+// List of arguments passed in:
+//
+// variant : holds the benchmark that will be run
+//
+// Arguments passed in for the "arena" variant
+// w : width of the test images
+// h : height of the test images
+// s : square edge of the chessboard pattern used as test image
+// reps : number of load/op/destroy repetitions
+//
+// Arguments passed in for the "load", "mmap" and "boolop" variants
+// w : width of the test image
+// h : height of the test image
+// r : mean run length of the random test image
+// reps : number of load (or operation) repetitions
+// The "reduce" variant takes one more argument, k, the number of images
+// that are intersected.
+// The "into" and "pool" variants take the same arguments as "boolop".
+// The "spans" variant takes one more argument, b, the percentage of blank
+// rows of its test pages (in bands of 32 rows); in the other rows, each
+// random row is repeated a few times, as in lines of text.
+// The "edges" variant takes the same arguments as "boolop", and stores no
+// bitset rows, so the rows keep their (high) run counts.
+// The "metrics" variant takes the same arguments as "boolop": it counts
+// the pixels that differ between two images with the former approach
+// (XOR them, and count the BLACK pixels of the result) and by merging their
+// runs, and also times the mask scores (IoU, Dice, precision, recall).
+// The "dedup" variant takes w, h, r and m: it compares an image with m
+// stored images that differ from it in their last two rows only, the first
+// time (when their fingerprints are computed) and then reps more times.
+// The "label" variant takes the same arguments as "spans": it labels the
+// connected components of a page on a dense bitmap (the former approach)
+// and on the runs of the image.
+// The "morph" variant takes one more argument than "spans", k: it dilates,
+// erodes, opens and closes a page by a k x k box on a dense bitmap (the
+// former approach) and on the runs of the image.
+// The "crop" variant takes w, h, r, t and reps: it crops a random image into
+// t x t tiles, with rows stored as runs (searched by their marks, once the
+// first tile of a row marks it), as transition positions (binary searched)
+// and in the default mix of runs and bitsets.
+// The "density" variant takes w, h and reps only: it sweeps the mean run
+// length of random images from long runs down to single-pixel noise.
+// The "threads" variant takes one more argument, t, the maximum number of
+// threads: the operations are timed (wall clock) with 1, 2, 4, ..., t threads.
+// The "mmap" variant keeps its (possibly multi-GB) input file,
+// bench_input.pbm, and reuses it in later runs: remove it to change w, h, r.
+//
+// Output: one line per implementation, with the cpu time (in seconds)
+// spent on each phase, and the rows (or MB of input) processed per second.
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "imageBW.h"
+#include "instrumentation.h"
+
+#define BENCH_FILE "bench_input.pbm"
+
+// Check a condition and if false, print failmsg and exit.
+static void check(int condition, const char *failmsg)
+{
+  if (!condition)
+  {
+    perror(failmsg);
+    exit(errno || 255);
+  }
+}
+
+/// Reference implementation of the former image layout:
+/// one malloc'ed int array per RLE row, terminated by -1.
+
+typedef struct
+{
+  uint32 width;
+  uint32 height;
+  int **row;
+} LegacyImage;
+
+static int *LegacyCompressRow(uint32 width, const uint8 *bytes)
+{
+  // count the runs first, as the former CompressRow() did
+  uint32 num_runs = 1;
+  for (uint32 x = 1; x < width; x++)
+  {
+    uint8 a = (bytes[(x - 1) / 8] >> (7 - (x - 1) % 8)) & 1;
+    uint8 b = (bytes[x / 8] >> (7 - x % 8)) & 1;
+    num_runs += (a != b);
+  }
+  int *row = malloc((num_runs + 2) * sizeof(int));
+  check(row != NULL, "malloc");
+  int value = (bytes[0] >> 7) & 1;
+  row[0] = value;
+  uint32 k = 1;
+  int len = 0;
+  for (uint32 x = 0; x < width; x++)
+  {
+    int b = (bytes[x / 8] >> (7 - x % 8)) & 1;
+    if (b != value)
+    {
+      row[k++] = len;
+      len = 0;
+      value = b;
+    }
+    len++;
+  }
+  row[k++] = len;
+  row[k] = -1;
+  return row;
+}
+
+static LegacyImage *LegacyLoad(const char *filename)
+{
+  FILE *f = fopen(filename, "rb");
+  check(f != NULL, "Open failed");
+  int w, h;
+  check(fscanf(f, "P4 %d %d", &w, &h) == 2 && fgetc(f) != EOF, "Header");
+  LegacyImage *img = malloc(sizeof(LegacyImage));
+  check(img != NULL, "malloc");
+  img->width = w;
+  img->height = h;
+  img->row = malloc(h * sizeof(int *));
+  check(img->row != NULL, "malloc");
+  int nbytes = (w + 7) / 8;
+  uint8 *bytes = malloc(nbytes);
+  check(bytes != NULL, "malloc");
+  for (int i = 0; i < h; i++)
+  {
+    check(fread(bytes, 1, nbytes, f) == (size_t)nbytes, "Reading pixels");
+    img->row[i] = LegacyCompressRow(w, bytes);
+  }
+  free(bytes);
+  fclose(f);
+  return img;
+}
+
+static int *LegacyRowAND(const int *arr1, const int *arr2, uint32 width)
+{
+  int *rslt = malloc((width + 2) * sizeof(int)); // allocate for worst case
+  check(rslt != NULL, "malloc");
+  uint32 i1 = 2, i2 = 2, k = 1;
+  int v1 = arr1[0], v2 = arr2[0];
+  int len1 = arr1[1], len2 = arr2[1];
+  int prev = -1;
+  rslt[0] = v1 & v2;
+  while (len1 > 0 && len2 > 0)
+  {
+    int v = v1 & v2;
+    int minlen = (len1 < len2) ? len1 : len2;
+    if (k == 1 || v != prev)
+      rslt[k++] = minlen;
+    else
+      rslt[k - 1] += minlen;
+    len1 -= minlen;
+    len2 -= minlen;
+    if (len1 == 0 && arr1[i1] != -1)
+    {
+      v1 ^= 1;
+      len1 = arr1[i1++];
+    }
+    if (len2 == 0 && arr2[i2] != -1)
+    {
+      v2 ^= 1;
+      len2 = arr2[i2++];
+    }
+    prev = v;
+  }
+  rslt[k++] = -1;
+  int *temp = realloc(rslt, k * sizeof(int));
+  check(temp != NULL, "realloc");
+  return temp;
+}
+
+static LegacyImage *LegacyAND(const LegacyImage *img1, const LegacyImage *img2)
+{
+  LegacyImage *img = malloc(sizeof(LegacyImage));
+  check(img != NULL, "malloc");
+  img->width = img1->width;
+  img->height = img1->height;
+  img->row = malloc(img->height * sizeof(int *));
+  check(img->row != NULL, "malloc");
+  for (uint32 i = 0; i < img->height; i++)
+  {
+    img->row[i] = LegacyRowAND(img1->row[i], img2->row[i], img->width);
+  }
+  return img;
+}
+
+static void LegacyDestroy(LegacyImage *img)
+{
+  for (uint32 i = 0; i < img->height; i++)
+  {
+    free(img->row[i]);
+  }
+  free(img->row);
+  free(img);
+}
+
+// Reference implementation of the former PBM row decoding:
+// unpack the bits into one byte per pixel, then scan the RAW row twice,
+// to count the runs and to emit them into runs[].
+// Returns the number of runs.
+static uint32 LegacyDecodeRow(uint32 width, const uint8 *bytes, uint8 *raw_row,
+                              uint32 *runs)
+{
+  uint32 nbytes = (width + 7) / 8;
+  for (uint32 b = 0; b < nbytes; b++)
+  {
+    for (int offset = 0; offset < 8; offset++)
+    {
+      raw_row[8 * b + offset] = (bytes[b] >> (7 - offset)) & 1;
+    }
+  }
+  uint32 num_runs = 1;
+  for (uint32 x = 1; x < width; x++)
+  {
+    num_runs += raw_row[x] != raw_row[x - 1];
+  }
+  uint32 k = 0, len = 1;
+  for (uint32 x = 1; x < width; x++)
+  {
+    if (raw_row[x] != raw_row[x - 1])
+    {
+      runs[k++] = len;
+      len = 0;
+    }
+    len++;
+  }
+  runs[k++] = len;
+  assert(k == num_runs);
+  return num_runs;
+}
+
+// Load a PBM file with the former row decoding, discarding the runs
+// Returns the total number of runs.
+static size_t LegacyDecodeFile(const char *filename)
+{
+  FILE *f = fopen(filename, "rb");
+  check(f != NULL, "Open failed");
+  int w, h;
+  check(fscanf(f, "P4 %d %d", &w, &h) == 2 && fgetc(f) != EOF, "Header");
+  uint32 nbytes = (w + 7) / 8;
+  uint8 *bytes = malloc(nbytes);
+  uint8 *raw_row = malloc(8 * nbytes);
+  uint32 *runs = malloc(w * sizeof(uint32));
+  check(bytes != NULL && raw_row != NULL && runs != NULL, "malloc");
+  size_t total = 0;
+  for (int i = 0; i < h; i++)
+  {
+    check(fread(bytes, 1, nbytes, f) == nbytes, "Reading pixels");
+    total += LegacyDecodeRow(w, bytes, raw_row, runs);
+  }
+  free(runs);
+  free(raw_row);
+  free(bytes);
+  fclose(f);
+  return total;
+}
+
+// Load a PBM file as a dense bitmap, one byte per pixel
+// (The caller frees the returned pixels.)
+static uint8 *LegacyUnpackFile(const char *filename, uint32 *w, uint32 *h)
+{
+  FILE *f = fopen(filename, "rb");
+  check(f != NULL, "Open failed");
+  check(fscanf(f, "P4 %u %u", w, h) == 2 && fgetc(f) != EOF, "Header");
+  uint32 nbytes = (*w + 7) / 8;
+  uint8 *bytes = malloc(nbytes);
+  uint8 *pixels = malloc((size_t)8 * nbytes * *h);
+  check(bytes != NULL && pixels != NULL, "malloc");
+  for (uint32 i = 0; i < *h; i++)
+  {
+    check(fread(bytes, 1, nbytes, f) == nbytes, "Reading pixels");
+    uint8 *raw_row = pixels + (size_t)i * *w;
+    for (uint32 x = 0; x < *w; x++)
+    {
+      raw_row[x] = (bytes[x / 8] >> (7 - x % 8)) & 1;
+    }
+  }
+  free(bytes);
+  fclose(f);
+  return pixels;
+}
+
+// Get the root of label a, halving the path on the way
+static uint32 LegacyFind(uint32 *parent, uint32 a)
+{
+  while (parent[a] != a)
+  {
+    parent[a] = parent[parent[a]];
+    a = parent[a];
+  }
+  return a;
+}
+
+// Reference pixel-based labeling of a dense bitmap (the classic two-pass
+// algorithm): each BLACK pixel takes the label of a BLACK neighbour above
+// or to its left (joining their labels), or a new one; then the labels
+// are resolved, pixel by pixel.
+// Returns the number of components.
+static uint32 LegacyLabel(const uint8 *pixels, uint32 w, uint32 h,
+                          int connectivity)
+{
+  uint32 *label = malloc((size_t)w * h * sizeof(uint32));
+  uint32 *parent = malloc(((size_t)w * h / 2 + 2) * sizeof(uint32));
+  check(label != NULL && parent != NULL, "malloc");
+  parent[0] = 0; // (label 0: WHITE)
+  uint32 n = 1;
+  for (uint32 y = 0; y < h; y++)
+  {
+    for (uint32 x = 0; x < w; x++)
+    {
+      size_t p = (size_t)y * w + x;
+      label[p] = 0;
+      if (!pixels[p])
+      {
+        continue;
+      }
+      // The neighbours seen before: left, up, and up-left, up-right (8)
+      uint32 nb[4] = {0, 0, 0, 0};
+      nb[0] = x > 0 ? label[p - 1] : 0;
+      nb[1] = y > 0 ? label[p - w] : 0;
+      if (connectivity == 8 && y > 0)
+      {
+        nb[2] = x > 0 ? label[p - w - 1] : 0;
+        nb[3] = x + 1 < w ? label[p - w + 1] : 0;
+      }
+      for (int k = 0; k < 4; k++)
+      {
+        if (nb[k] == 0)
+        {
+          continue;
+        }
+        if (label[p] == 0)
+        {
+          label[p] = nb[k];
+        }
+        else
+        {
+          uint32 a = LegacyFind(parent, label[p]);
+          uint32 b = LegacyFind(parent, nb[k]);
+          parent[a > b ? a : b] = a < b ? a : b;
+        }
+      }
+      if (label[p] == 0)
+      {
+        parent[n] = n;
+        label[p] = n++;
+      }
+    }
+  }
+  uint32 count = 0;
+  for (uint32 a = 1; a < n; a++)
+  {
+    parent[a] = parent[a] == a ? ++count : parent[parent[a]];
+  }
+  for (size_t p = 0; p < (size_t)w * h; p++)
+  {
+    label[p] = parent[label[p]];
+  }
+  free(parent);
+  free(label);
+  return count;
+}
+
+// Reference dense dilation (grow = 1) or erosion (grow = 0) of a bitmap,
+// one byte per pixel, by the box of the columns [x - left, x + right] and
+// the rows [y - up, y + down] of each pixel (x, y), as ImageDilate and
+// ImageErode: a row pass then a column pass, each pixel scanning its window
+// (The caller frees the returned pixels.)
+static uint8 *LegacyMorph(const uint8 *pixels, uint32 w, uint32 h, uint8 grow,
+                          uint32 left, uint32 right, uint32 up, uint32 down)
+{
+  uint8 *rows = malloc((size_t)w * h);
+  uint8 *out = malloc((size_t)w * h);
+  check(rows != NULL && out != NULL, "malloc");
+  for (uint32 y = 0; y < h; y++)
+  {
+    const uint8 *in = pixels + (size_t)y * w;
+    for (uint32 x = 0; x < w; x++)
+    {
+      uint32 x0 = x > left ? x - left : 0;
+      uint32 x1 = right < w - 1 - x ? x + right : w - 1;
+      uint8 v = grow ^ 1;
+      for (uint32 xx = x0; xx <= x1 && v != grow; xx++)
+      {
+        v = in[xx] == grow ? grow : v;
+      }
+      rows[(size_t)y * w + x] = v;
+    }
+  }
+  for (uint32 y = 0; y < h; y++)
+  {
+    uint32 y0 = y > up ? y - up : 0;
+    uint32 y1 = down < h - 1 - y ? y + down : h - 1;
+    for (uint32 x = 0; x < w; x++)
+    {
+      uint8 v = grow ^ 1;
+      for (uint32 yy = y0; yy <= y1 && v != grow; yy++)
+      {
+        v = rows[(size_t)yy * w + x] == grow ? grow : v;
+      }
+      out[(size_t)y * w + x] = v;
+    }
+  }
+  free(rows);
+  return out;
+}
+
+/// Test inputs
+
+// Write a w x h PBM file with random runs of mean length r
+// (run lengths uniform in [1, 2r-1])
+static void WriteRandomPBM(const char *filename, uint32 w, uint32 h, uint32 r)
+{
+  FILE *f = fopen(filename, "wb");
+  check(f != NULL, "Open failed");
+  fprintf(f, "P4\n%u %u\n", w, h);
+  uint32 nbytes = (w + 7) / 8;
+  uint8 *bytes = malloc(nbytes);
+  check(bytes != NULL, "malloc");
+  srand(1);
+  for (uint32 i = 0; i < h; i++)
+  {
+    memset(bytes, 0, nbytes);
+    int value = rand() & 1;
+    for (uint32 x = 0; x < w;)
+    {
+      uint32 end = x + 1 + rand() % (2 * r - 1);
+      if (end > w)
+      {
+        end = w;
+      }
+      for (; x < end; x++)
+      {
+        bytes[x / 8] |= value << (7 - x % 8);
+      }
+      value ^= 1;
+    }
+    check(fwrite(bytes, 1, nbytes, f) == nbytes, "Writing pixels");
+  }
+  free(bytes);
+  fclose(f);
+}
+
+// Write a w x h PBM page: bands of 32 rows are blank with probability
+// b/100, and the other rows are random rows of mean run length r, each
+// repeated 1 to 4 times
+static void WritePagePBM(const char *filename, uint32 w, uint32 h, uint32 r,
+                         uint32 b, unsigned seed)
+{
+  FILE *f = fopen(filename, "wb");
+  check(f != NULL, "Open failed");
+  fprintf(f, "P4\n%u %u\n", w, h);
+  uint32 nbytes = (w + 7) / 8;
+  uint8 *bytes = malloc(nbytes);
+  check(bytes != NULL, "malloc");
+  srand(seed);
+  int blank = 0;
+  uint32 repeat = 0;
+  for (uint32 i = 0; i < h; i++)
+  {
+    if (i % 32 == 0)
+    {
+      blank = (uint32)(rand() % 100) < b;
+    }
+    if (blank)
+    {
+      memset(bytes, 0, nbytes);
+      repeat = 0;
+    }
+    else if (repeat > 0)
+    {
+      repeat--; // the same row again
+    }
+    else
+    {
+      memset(bytes, 0, nbytes);
+      int value = rand() & 1;
+      for (uint32 x = 0; x < w;)
+      {
+        uint32 end = x + 1 + rand() % (2 * r - 1);
+        if (end > w)
+        {
+          end = w;
+        }
+        for (; x < end; x++)
+        {
+          bytes[x / 8] |= value << (7 - x % 8);
+        }
+        value ^= 1;
+      }
+      repeat = rand() % 4;
+    }
+    check(fwrite(bytes, 1, nbytes, f) == nbytes, "Writing pixels");
+  }
+  free(bytes);
+  fclose(f);
+}
+
+/// Benchmarks
+
+// Elapsed (wall clock) time in seconds, for benchmarks that wait for I/O
+static double wall_time(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + 1e-9 * t.tv_nsec;
+}
+
+// Print a result line: times of the three phases and rows per second
+static void PrintPhases(const char *name, uint32 rows, double tload,
+                        double top, double tdestroy)
+{
+  double total = tload + top + tdestroy;
+  printf("%-8s\t%12.6f\t%12.6f\t%12.6f\t%15.0f\n", name, tload, top, tdestroy,
+         total > 0 ? rows / total : 0.0);
+}
+
+// Compare the arena image layout with the former per-row malloc layout
+static void BenchArena(uint32 w, uint32 h, uint32 s, int reps)
+{
+  Image pattern = ImageCreateChessboard(w, h, s, BLACK);
+  ImageSave(pattern, BENCH_FILE);
+  ImageDestroy(&pattern);
+
+  double tload = 0.0, top = 0.0, tdestroy = 0.0;
+  for (int r = 0; r < reps; r++)
+  {
+    double t0 = cpu_time();
+    LegacyImage *a = LegacyLoad(BENCH_FILE);
+    LegacyImage *b = LegacyLoad(BENCH_FILE);
+    double t1 = cpu_time();
+    LegacyImage *c = LegacyAND(a, b);
+    double t2 = cpu_time();
+    LegacyDestroy(a);
+    LegacyDestroy(b);
+    LegacyDestroy(c);
+    double t3 = cpu_time();
+    tload += t1 - t0;
+    top += t2 - t1;
+    tdestroy += t3 - t2;
+  }
+  printf("#%-7s\t%12s\t%12s\t%12s\t%15s\n", "layout", "load", "and",
+         "destroy", "rows/s");
+  PrintPhases("per-row", 3 * h * reps, tload, top, tdestroy);
+
+  tload = top = tdestroy = 0.0;
+  for (int r = 0; r < reps; r++)
+  {
+    double t0 = cpu_time();
+    Image a = ImageLoad(BENCH_FILE);
+    Image b = ImageLoad(BENCH_FILE);
+    double t1 = cpu_time();
+    Image c = ImageAND(a, b);
+    double t2 = cpu_time();
+    ImageDestroy(&a);
+    ImageDestroy(&b);
+    ImageDestroy(&c);
+    double t3 = cpu_time();
+    tload += t1 - t0;
+    top += t2 - t1;
+    tdestroy += t3 - t2;
+  }
+  PrintPhases("arena", 3 * h * reps, tload, top, tdestroy);
+
+  remove(BENCH_FILE);
+}
+
+// Compare ImageLoad with the former unpack-and-scan row decoding
+static void BenchLoad(uint32 w, uint32 h, uint32 r, int reps)
+{
+  WriteRandomPBM(BENCH_FILE, w, h, r);
+  double mb = ((double)(w + 7) / 8 * h) / (1 << 20);
+
+  double tlegacy = 0.0;
+  for (int k = 0; k < reps; k++)
+  {
+    double t0 = cpu_time();
+    LegacyDecodeFile(BENCH_FILE);
+    tlegacy += cpu_time() - t0;
+  }
+
+  double tload = 0.0;
+  for (int k = 0; k < reps; k++)
+  {
+    double t0 = cpu_time();
+    Image img = ImageLoad(BENCH_FILE);
+    tload += cpu_time() - t0;
+    ImageDestroy(&img);
+  }
+
+  printf("#%-7s\t%12s\t%12s\n", "loader", "time", "MB/s");
+  printf("%-8s\t%12.6f\t%12.1f\n", "unpack", tlegacy,
+         tlegacy > 0 ? reps * mb / tlegacy : 0.0);
+  printf("%-8s\t%12.6f\t%12.1f\n", "packed", tload,
+         tload > 0 ? reps * mb / tload : 0.0);
+
+  remove(BENCH_FILE);
+}
+
+// Compare loading with stdio and with a memory mapping
+// The input file is kept, so that large inputs need to be written only once.
+static void BenchMmap(uint32 w, uint32 h, uint32 r, int reps)
+{
+  FILE *f = fopen(BENCH_FILE, "rb");
+  if (f == NULL)
+  {
+    WriteRandomPBM(BENCH_FILE, w, h, r);
+  }
+  else
+  {
+    fclose(f); // reuse the input of a previous run
+  }
+  double mb = ((double)(w + 7) / 8 * h) / (1 << 20);
+
+  printf("#%-7s\t%12s\t%12s\t%12s\n", "loader", "cpu", "wall", "MB/s");
+  const char *name[2] = {"stdio", "mmap"};
+  for (int mapped = 0; mapped < 2; mapped++)
+  {
+    ImageSetMappedLoad(mapped);
+    double tcpu = 0.0, twall = 0.0;
+    for (int k = 0; k < reps; k++)
+    {
+      double c0 = cpu_time();
+      double w0 = wall_time();
+      Image img = ImageLoad(BENCH_FILE);
+      twall += wall_time() - w0;
+      tcpu += cpu_time() - c0;
+      ImageDestroy(&img);
+    }
+    printf("%-8s\t%12.6f\t%12.6f\t%12.1f\n", name[mapped], tcpu, twall,
+           twall > 0 ? reps * mb / twall : 0.0);
+  }
+  ImageSetMappedLoad(1);
+}
+
+// Time ImageAND, ImageOR, ImageXOR and ImageBoolOp (for each of the
+// 16 operators) on two random images
+static void BenchBoolOp(uint32 w, uint32 h, uint32 r, int reps)
+{
+  WriteRandomPBM(BENCH_FILE, w, h, r);
+  Image a = ImageLoad(BENCH_FILE);
+  WriteRandomPBM(BENCH_FILE, w, h, r + 1);
+  Image b = ImageLoad(BENCH_FILE);
+  remove(BENCH_FILE);
+
+  printf("#%-7s\t%12s\t%15s\n", "op", "time", "rows/s");
+  for (int op = -3; op < 16; op++)
+  {
+    double t = 0.0;
+    for (int k = 0; k < reps; k++)
+    {
+      double t0 = cpu_time();
+      Image c = op == -3   ? ImageAND(a, b)
+                : op == -2 ? ImageOR(a, b)
+                : op == -1 ? ImageXOR(a, b)
+                           : ImageBoolOp(a, b, op);
+      t += cpu_time() - t0;
+      ImageDestroy(&c);
+    }
+    char name[16];
+    const char *named[3] = {"and", "or", "xor"};
+    if (op < 0)
+    {
+      snprintf(name, sizeof(name), "%s", named[op + 3]);
+    }
+    else
+    {
+      snprintf(name, sizeof(name), "bool%d", op);
+    }
+    printf("%-8s\t%12.6f\t%15.0f\n", name, t, t > 0 ? reps * h / t : 0.0);
+  }
+  ImageDestroy(&a);
+  ImageDestroy(&b);
+}
+
+// Intersect (and XOR) k random images: with k-1 calls to ImageAND
+// (or ImageXOR), and with a single ImageReduce
+static void BenchReduce(uint32 w, uint32 h, uint32 r, uint32 k, int reps)
+{
+  Image *imgs = malloc(k * sizeof(Image));
+  check(imgs != NULL, "malloc");
+  for (uint32 j = 0; j < k; j++)
+  {
+    WriteRandomPBM(BENCH_FILE, w, h, r + j);
+    imgs[j] = ImageLoad(BENCH_FILE);
+  }
+  remove(BENCH_FILE);
+
+  printf("#%-7s\t%12s\t%15s\n", "method", "time", "run bytes");
+  const char *name[4] = {"and", "and-k", "xor", "xor-k"};
+  for (int method = 0; method < 4; method++)
+  {
+    int xor = method / 2;
+    int fused = method % 2;
+    double t = 0.0;
+    unsigned long mem = 0;
+    for (int n = 0; n < reps; n++)
+    {
+      unsigned long m0 = InstrCount[2]; // memspace: bytes allocated for runs
+      double t0 = cpu_time();
+      Image c;
+      if (fused)
+      {
+        c = ImageReduce(imgs, k, xor ? REDUCE_XOR : REDUCE_AND);
+      }
+      else
+      {
+        c = xor ? ImageXOR(imgs[0], imgs[1]) : ImageAND(imgs[0], imgs[1]);
+        for (uint32 j = 2; j < k; j++)
+        {
+          Image next = xor ? ImageXOR(c, imgs[j]) : ImageAND(c, imgs[j]);
+          ImageDestroy(&c);
+          c = next;
+        }
+      }
+      t += cpu_time() - t0;
+      mem += InstrCount[2] - m0;
+      ImageDestroy(&c);
+    }
+    printf("%-8s\t%12.6f\t%15lu\n", name[method], t, mem / reps);
+  }
+  for (uint32 j = 0; j < k; j++)
+  {
+    ImageDestroy(&imgs[j]);
+  }
+  free(imgs);
+}
+
+// Time ImageAND, ImageXOR, ImageLoad and ImageSave on random images
+// with 1, 2, 4, ..., t threads
+static void BenchThreads(uint32 w, uint32 h, uint32 r, int t, int reps)
+{
+  WriteRandomPBM(BENCH_FILE, w, h, r);
+  Image a = ImageLoad(BENCH_FILE);
+  WriteRandomPBM(BENCH_FILE, w, h, r + 1);
+  Image b = ImageLoad(BENCH_FILE);
+
+  printf("#%-7s\t%12s\t%12s\t%12s\t%12s\t%8s\n", "threads", "and", "xor",
+         "load", "save", "speedup");
+  double base = 0.0;
+  for (int n = 1; n <= t; n = (n < t && 2 * n > t) ? t : 2 * n)
+  {
+    ImageSetThreads(n);
+    double time[4] = {0.0, 0.0, 0.0, 0.0};
+    for (int k = 0; k < reps; k++)
+    {
+      double t0 = wall_time();
+      Image c = ImageAND(a, b);
+      double t1 = wall_time();
+      Image d = ImageXOR(a, b);
+      double t2 = wall_time();
+      Image e = ImageLoad(BENCH_FILE);
+      double t3 = wall_time();
+      ImageSave(e, BENCH_FILE);
+      double t4 = wall_time();
+      time[0] += t1 - t0;
+      time[1] += t2 - t1;
+      time[2] += t3 - t2;
+      time[3] += t4 - t3;
+      ImageDestroy(&c);
+      ImageDestroy(&d);
+      ImageDestroy(&e);
+    }
+    double total = time[0] + time[1] + time[2] + time[3];
+    if (n == 1)
+    {
+      base = total;
+    }
+    printf("%-8d\t%12.6f\t%12.6f\t%12.6f\t%12.6f\t%8.2f\n", n, time[0],
+           time[1], time[2], time[3], total > 0 ? base / total : 0.0);
+  }
+  remove(BENCH_FILE);
+  ImageDestroy(&a);
+  ImageDestroy(&b);
+}
+
+// Time a loop of ImageAND (and of ImageVerticalMirror) over random frames,
+// returning new images, and storing them into the same image
+static void BenchInto(uint32 w, uint32 h, uint32 r, int reps)
+{
+  WriteRandomPBM(BENCH_FILE, w, h, r);
+  Image a = ImageLoad(BENCH_FILE);
+  WriteRandomPBM(BENCH_FILE, w, h, r + 1);
+  Image b = ImageLoad(BENCH_FILE);
+  remove(BENCH_FILE);
+
+  printf("#%-15s\t%12s\t%15s\n", "method", "time", "run bytes");
+  const char *name[4] = {"and", "and-into", "vmirror", "vmirror-inplace"};
+  for (int method = 0; method < 4; method++)
+  {
+    Image dst = ImageCreate(1, 1, WHITE);
+    Image frame = ImageVerticalMirror(a); // (a private copy, to mirror in place)
+    unsigned long m0 = InstrCount[2]; // memspace: bytes allocated for runs
+    double t0 = cpu_time();
+    for (int k = 0; k < reps; k++)
+    {
+      Image c = NULL;
+      switch (method)
+      {
+      case 0:
+        c = ImageAND(a, b);
+        break;
+      case 1:
+        ImageANDInto(dst, a, b);
+        break;
+      case 2:
+        c = ImageVerticalMirror(frame);
+        break;
+      default:
+        ImageVerticalMirrorInPlace(frame);
+        break;
+      }
+      ImageDestroy(&c);
+    }
+    double t = cpu_time() - t0;
+    printf("%-16s\t%12.6f\t%15lu\n", name[method], t, InstrCount[2] - m0);
+    ImageDestroy(&frame);
+    ImageDestroy(&dst);
+  }
+  ImageDestroy(&a);
+  ImageDestroy(&b);
+}
+
+// Time a create/op/destroy loop over random frames (an expression whose
+// temporaries are destroyed right away), without and with the block pool
+static void BenchPool(uint32 w, uint32 h, uint32 r, int reps)
+{
+  WriteRandomPBM(BENCH_FILE, w, h, r);
+  Image a = ImageLoad(BENCH_FILE);
+  WriteRandomPBM(BENCH_FILE, w, h, r + 1);
+  Image b = ImageLoad(BENCH_FILE);
+  remove(BENCH_FILE);
+
+  printf("#%-15s\t%12s\t%12s\t%12s\n", "method", "time", "hits", "misses");
+  const char *name[2] = {"malloc", "pool"};
+  for (int pooling = 0; pooling < 2; pooling++)
+  {
+    ImageSetPooling(pooling);
+    unsigned long hits0, misses0, hits, misses;
+    size_t held;
+    ImageGetPoolStats(&hits0, &misses0, &held);
+    double t0 = cpu_time();
+    for (int k = 0; k < reps; k++)
+    {
+      Image c = ImageAND(a, b);
+      Image d = ImageXOR(c, a);
+      Image e = ImageNEG(d);
+      Image f = ImageVerticalMirror(e);
+      ImageDestroy(&c);
+      ImageDestroy(&d);
+      ImageDestroy(&e);
+      ImageDestroy(&f);
+    }
+    double t = cpu_time() - t0;
+    ImageGetPoolStats(&hits, &misses, &held);
+    printf("%-16s\t%12.6f\t%12lu\t%12lu\n", name[pooling], t, hits - hits0,
+           misses - misses0);
+  }
+  ImageDestroy(&a);
+  ImageDestroy(&b);
+}
+
+// Load two pages with blank bands and repeated rows, and time AND and OR,
+// with every row stored separately and with vertical spans
+static void BenchSpans(uint32 w, uint32 h, uint32 r, uint32 b, int reps)
+{
+  printf("#%-15s\t%12s\t%12s\t%12s\t%12s\n", "method", "load", "and", "or",
+         "bytes");
+  const char *name[2] = {"rows", "spans"};
+  for (int spans = 0; spans < 2; spans++)
+  {
+    ImageSetRowSpans(spans);
+    WritePagePBM(BENCH_FILE, w, h, r, b, 1);
+    double t0 = cpu_time();
+    Image a = ImageLoad(BENCH_FILE);
+    double tload = cpu_time() - t0;
+    WritePagePBM(BENCH_FILE, w, h, r + 1, b, 2);
+    Image c = ImageLoad(BENCH_FILE);
+    remove(BENCH_FILE);
+
+    double tand = 0.0, tor = 0.0;
+    size_t bytes = ImageMemorySize(a) + ImageMemorySize(c);
+    for (int k = 0; k < reps; k++)
+    {
+      t0 = cpu_time();
+      Image d = ImageAND(a, c);
+      tand += cpu_time() - t0;
+      t0 = cpu_time();
+      Image e = ImageOR(a, c);
+      tor += cpu_time() - t0;
+      if (k == 0)
+      {
+        bytes += ImageMemorySize(d) + ImageMemorySize(e);
+      }
+      ImageDestroy(&d);
+      ImageDestroy(&e);
+    }
+    printf("%-16s\t%12.6f\t%12.6f\t%12.6f\t%12zu\n", name[spans], tload, tand,
+           tor, bytes);
+    ImageDestroy(&a);
+    ImageDestroy(&c);
+  }
+  ImageSetRowSpans(1);
+}
+
+// Sweep the density of random images (mean run length r, from long runs to
+// noise), and time AND and XOR with every row stored as runs and with dense
+// rows stored as bitsets: the crossover is where the bitset rows start
+static void BenchDensity(uint32 w, uint32 h, int reps)
+{
+  const uint32 runs[] = {256, 128, 64, 32, 16, 12, 8, 6, 4, 3, 2, 1};
+  printf("#%-7s\t%-8s\t%12s\t%12s\t%12s\t%12s\n", "r", "method", "bitset",
+         "and", "xor", "bytes");
+  for (size_t n = 0; n < sizeof(runs) / sizeof(runs[0]); n++)
+  {
+    const char *name[2] = {"runs", "hybrid"};
+    for (int bits = 0; bits < 2; bits++)
+    {
+      ImageSetBitsetRows(bits);
+      WriteRandomPBM(BENCH_FILE, w, h, runs[n]);
+      Image a = ImageLoad(BENCH_FILE);
+      WriteRandomPBM(BENCH_FILE, w, h, runs[n] + 1);
+      Image b = ImageLoad(BENCH_FILE);
+      remove(BENCH_FILE);
+
+      double tand = 0.0, txor = 0.0;
+      size_t bytes = ImageMemorySize(a) + ImageMemorySize(b);
+      for (int k = 0; k < reps; k++)
+      {
+        double t0 = cpu_time();
+        Image c = ImageAND(a, b);
+        tand += cpu_time() - t0;
+        t0 = cpu_time();
+        Image d = ImageXOR(a, b);
+        txor += cpu_time() - t0;
+        ImageDestroy(&c);
+        ImageDestroy(&d);
+      }
+      printf("%-8u\t%-8s\t%12u\t%12.6f\t%12.6f\t%12zu\n", runs[n], name[bits],
+             ImageBitsetRowCount(a) + ImageBitsetRowCount(b), tand, txor, bytes);
+      ImageDestroy(&a);
+      ImageDestroy(&b);
+    }
+  }
+  ImageSetBitsetRows(1);
+}
+
+// Time XOR, AND and random pixel lookups on two random images, with their
+// rows stored by run lengths and by transition positions
+// (Bitset rows are disabled: dense rows stay runs or transitions.)
+static void BenchEdges(uint32 w, uint32 h, uint32 r, int reps)
+{
+  printf("#%-15s\t%12s\t%12s\t%12s\t%15s\n", "method", "xor", "and",
+         "pixels", "pixels/s");
+  const char *name[2] = {"runs", "edges"};
+  const uint32 lookups = 1000000;
+  ImageSetBitsetRows(0);
+  for (int edges = 0; edges < 2; edges++)
+  {
+    ImageSetEdgeRows(edges);
+    WriteRandomPBM(BENCH_FILE, w, h, r);
+    Image a = ImageLoad(BENCH_FILE);
+    WriteRandomPBM(BENCH_FILE, w, h, r + 1);
+    Image b = ImageLoad(BENCH_FILE);
+    remove(BENCH_FILE);
+
+    double txor = 0.0, tand = 0.0;
+    for (int k = 0; k < reps; k++)
+    {
+      double t0 = cpu_time();
+      Image c = ImageXOR(a, b);
+      txor += cpu_time() - t0;
+      t0 = cpu_time();
+      Image d = ImageAND(a, b);
+      tand += cpu_time() - t0;
+      ImageDestroy(&c);
+      ImageDestroy(&d);
+    }
+
+    srand(3);
+    uint32 black = 0;
+    double t0 = cpu_time();
+    for (uint32 n = 0; n < lookups; n++)
+    {
+      black += ImageGetPixel(a, rand() % w, rand() % h);
+    }
+    double tpix = cpu_time() - t0;
+    printf("%-16s\t%12.6f\t%12.6f\t%12.6f\t%15.0f\t# %u black\n",
+           name[edges], txor, tand, tpix, tpix > 0 ? lookups / tpix : 0.0,
+           black);
+    ImageDestroy(&a);
+    ImageDestroy(&b);
+  }
+  ImageSetEdgeRows(0);
+  ImageSetBitsetRows(1);
+}
+
+// Compare counting the pixels that differ between two images on their XOR
+// with counting them on the runs of the images (no result image)
+static void BenchMetrics(uint32 w, uint32 h, uint32 r, int reps)
+{
+  WriteRandomPBM(BENCH_FILE, w, h, r);
+  Image a = ImageLoad(BENCH_FILE);
+  WriteRandomPBM(BENCH_FILE, w, h, r + 1);
+  Image b = ImageLoad(BENCH_FILE);
+  remove(BENCH_FILE);
+
+  printf("#%-11s\t%12s\t%15s\n", "method", "time", "rows/s");
+  const char *name[3] = {"xor+count", "diff", "scores"};
+  uint64 diff[2] = {0, 0};
+  for (int method = 0; method < 3; method++)
+  {
+    double t0 = cpu_time();
+    for (int k = 0; k < reps; k++)
+    {
+      if (method == 0)
+      {
+        Image c = ImageXOR(a, b);
+        diff[0] = ImageCountBlack(c);
+        ImageDestroy(&c);
+      }
+      else if (method == 1)
+      {
+        diff[1] = ImageCountDiff(a, b);
+      }
+      else
+      {
+        double iou, dice, precision, recall;
+        ImageMaskScores(a, b, &iou, &dice, &precision, &recall);
+      }
+    }
+    double t = cpu_time() - t0;
+    printf("%-12s\t%12.6f\t%15.0f\n", name[method], t,
+           t > 0 ? reps * h / t : 0.0);
+  }
+  assert(diff[0] == diff[1]);
+  ImageDestroy(&a);
+  ImageDestroy(&b);
+}
+
+// Compare an image with many stored images, which differ from it in their
+// last two rows only (the worst case for a row by row comparison): the first
+// time, and again, once the fingerprints of the images are known
+static void BenchDedup(uint32 w, uint32 h, uint32 r, uint32 m, int reps)
+{
+  WriteRandomPBM(BENCH_FILE, w, h - 2, r);
+  Image top = ImageLoad(BENCH_FILE);
+  remove(BENCH_FILE);
+  Image *stored = malloc(m * sizeof(Image));
+  check(stored != NULL, "malloc");
+  uint32 n = 2 * (w - 1); // (the number of distinct rows with one change)
+  for (uint32 k = 0; k < m; k++)
+  {
+    Image rows[2];
+    for (int j = 0; j < 2; j++)
+    {
+      uint32 x = (j == 0 ? k % n : k / n % n); // the row with a change at x
+      Image left = ImageCreate(x % (w - 1) + 1, 1, x / (w - 1));
+      Image right = ImageCreate(w - 1 - x % (w - 1), 1, !(x / (w - 1)));
+      rows[j] = ImageReplicateAtRight(left, right);
+      ImageDestroy(&left);
+      ImageDestroy(&right);
+    }
+    Image last = ImageReplicateAtBottom(rows[0], rows[1]);
+    stored[k] = ImageReplicateAtBottom(top, last);
+    ImageDestroy(&last);
+    ImageDestroy(&rows[0]);
+    ImageDestroy(&rows[1]);
+  }
+  Image last = ImageCreate(w, 2, WHITE);
+  Image img = ImageReplicateAtBottom(top, last);
+  ImageDestroy(&last);
+
+  printf("#%-7s\t%12s\t%15s\n", "pass", "time", "compares/s");
+  uint32 equal = 0;
+  double t0 = cpu_time();
+  for (uint32 k = 0; k < m; k++)
+  {
+    equal += ImageIsEqual(img, stored[k]);
+  }
+  double t = cpu_time() - t0;
+  printf("%-8s\t%12.6f\t%15.0f\n", "first", t, t > 0 ? m / t : 0.0);
+  t0 = cpu_time();
+  for (int n = 0; n < reps; n++)
+  {
+    for (uint32 k = 0; k < m; k++)
+    {
+      equal += ImageIsEqual(img, stored[k]);
+    }
+  }
+  t = cpu_time() - t0;
+  printf("%-8s\t%12.6f\t%15.0f\t# %u equal\n", "cached", t,
+         t > 0 ? (double)reps * m / t : 0.0, equal);
+
+  for (uint32 k = 0; k < m; k++)
+  {
+    ImageDestroy(&stored[k]);
+  }
+  free(stored);
+  ImageDestroy(&img);
+  ImageDestroy(&top);
+}
+
+// Label the BLACK pixels of a page with blank bands and repeated rows
+// (4- and 8-connectivity) on a dense bitmap, pixel by pixel, and on the
+// runs of the loaded image
+static void BenchLabel(uint32 w, uint32 h, uint32 r, uint32 b, int reps)
+{
+  WritePagePBM(BENCH_FILE, w, h, r, b, 1);
+  printf("#%-15s\t%12s\t%12s\t%12s\t%15s\n", "method", "load", "label",
+         "components", "rows/s");
+  for (int connectivity = 4; connectivity <= 8; connectivity += 4)
+  {
+    double tload = 0.0, tlabel = 0.0;
+    uint32 count[2] = {0, 0};
+    for (int k = 0; k < reps; k++)
+    {
+      uint32 pw, ph;
+      double t0 = cpu_time();
+      uint8 *pixels = LegacyUnpackFile(BENCH_FILE, &pw, &ph);
+      double t1 = cpu_time();
+      count[0] = LegacyLabel(pixels, pw, ph, connectivity);
+      tlabel += cpu_time() - t1;
+      tload += t1 - t0;
+      free(pixels);
+    }
+    char name[16];
+    snprintf(name, sizeof(name), "pixels-%d", connectivity);
+    printf("%-16s\t%12.6f\t%12.6f\t%12u\t%15.0f\n", name, tload, tlabel,
+           count[0], tlabel > 0 ? reps * h / tlabel : 0.0);
+
+    tload = tlabel = 0.0;
+    for (int k = 0; k < reps; k++)
+    {
+      double t0 = cpu_time();
+      Image img = ImageLoad(BENCH_FILE);
+      double t1 = cpu_time();
+      ImageComponents c = ImageLabelComponents(img, connectivity);
+      tlabel += cpu_time() - t1;
+      tload += t1 - t0;
+      count[1] = ImageComponentsCount(c);
+      ImageComponentsDestroy(&c);
+      ImageDestroy(&img);
+    }
+    snprintf(name, sizeof(name), "runs-%d", connectivity);
+    printf("%-16s\t%12.6f\t%12.6f\t%12u\t%15.0f\n", name, tload, tlabel,
+           count[1], tlabel > 0 ? reps * h / tlabel : 0.0);
+    assert(count[0] == count[1]);
+  }
+  remove(BENCH_FILE);
+}
+
+// Dilate, erode, open and close a page with blank bands and repeated rows
+// by a k x k box, on a dense bitmap, pixel by pixel, and on the runs of
+// the loaded image
+static void BenchMorph(uint32 w, uint32 h, uint32 r, uint32 b, uint32 k,
+                       int reps)
+{
+  WritePagePBM(BENCH_FILE, w, h, r, b, 1);
+  printf("#%-7s\t%12s\t%12s\t%12s\t%12s\t%12s\n", "method", "load", "dilate",
+         "erode", "open", "close");
+  uint32 a = k / 2, c = (k - 1) / 2; // the reach of the box, and reflected
+  uint64 black[2][4];
+  for (int method = 0; method < 2; method++)
+  {
+    double tload = 0.0, t[4] = {0.0, 0.0, 0.0, 0.0};
+    for (int n = 0; n < reps; n++)
+    {
+      double t0 = cpu_time();
+      if (method == 0)
+      {
+        uint32 pw, ph;
+        uint8 *pixels = LegacyUnpackFile(BENCH_FILE, &pw, &ph);
+        tload += cpu_time() - t0;
+        for (int op = 0; op < 4; op++)
+        {
+          t0 = cpu_time();
+          uint8 grow = (op == 0 || op == 3); // (of the first pass)
+          uint8 *out = LegacyMorph(pixels, pw, ph, grow, a, c, a, c);
+          if (op >= 2)
+          {
+            uint8 *second = LegacyMorph(out, pw, ph, grow ^ 1, c, a, c, a);
+            free(out);
+            out = second;
+          }
+          t[op] += cpu_time() - t0;
+          black[0][op] = 0;
+          for (size_t p = 0; p < (size_t)pw * ph; p++)
+          {
+            black[0][op] += out[p];
+          }
+          free(out);
+        }
+        free(pixels);
+      }
+      else
+      {
+        Image img = ImageLoad(BENCH_FILE);
+        tload += cpu_time() - t0;
+        Image (*morph[4])(const Image, uint32, uint32) = {
+            ImageDilate, ImageErode, ImageOpen, ImageClose};
+        for (int op = 0; op < 4; op++)
+        {
+          t0 = cpu_time();
+          Image out = morph[op](img, k, k);
+          t[op] += cpu_time() - t0;
+          black[1][op] = ImageCountBlack(out);
+          ImageDestroy(&out);
+        }
+        ImageDestroy(&img);
+      }
+    }
+    printf("%-8s\t%12.6f\t%12.6f\t%12.6f\t%12.6f\t%12.6f\n",
+           method == 0 ? "pixels" : "runs", tload, t[0], t[1], t[2], t[3]);
+  }
+  for (int op = 0; op < 4; op++)
+  {
+    assert(black[0][op] == black[1][op]);
+  }
+  remove(BENCH_FILE);
+}
+
+// Crop a random image into t x t tiles, with each of the row forms
+static void BenchCrop(uint32 w, uint32 h, uint32 r, uint32 t, int reps)
+{
+  printf("#%-15s\t%12s\t%15s\n", "method", "crop", "tiles/s");
+  const char *name[3] = {"runs", "edges", "hybrid"};
+  uint32 tw = w / t, th = h / t;
+  assert(tw > 0 && th > 0);
+  WriteRandomPBM(BENCH_FILE, w, h, r);
+  uint64 black[3];
+  for (int form = 0; form < 3; form++)
+  {
+    ImageSetBitsetRows(form == 2);
+    ImageSetEdgeRows(form == 1);
+    Image img = ImageLoad(BENCH_FILE);
+    double tcrop = 0.0;
+    black[form] = 0;
+    for (int n = 0; n < reps; n++)
+    {
+      for (uint32 y = 0; y + th <= h; y += th)
+      {
+        for (uint32 x = 0; x + tw <= w; x += tw)
+        {
+          double t0 = cpu_time();
+          Image tile = ImageCrop(img, x, y, tw, th);
+          tcrop += cpu_time() - t0;
+          black[form] += ImageCountBlack(tile);
+          ImageDestroy(&tile);
+        }
+      }
+    }
+    double tiles = (double)reps * t * t;
+    printf("%-16s\t%12.6f\t%15.0f\n", name[form], tcrop,
+           tcrop > 0 ? tiles / tcrop : 0.0);
+    ImageDestroy(&img);
+  }
+  assert(black[0] == black[1] && black[1] == black[2]);
+  ImageSetEdgeRows(0);
+  ImageSetBitsetRows(1);
+  remove(BENCH_FILE);
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc < 2)
+  {
+    fprintf(stderr, "Usage: %s variant [args...]\n"
+                    "  %s arena w h s reps\n"
+                    "  %s load w h r reps\n"
+                    "  %s mmap w h r reps\n"
+                    "  %s boolop w h r reps\n"
+                    "  %s reduce w h r k reps\n"
+                    "  %s threads w h r t reps\n"
+                    "  %s into w h r reps\n"
+                    "  %s pool w h r reps\n"
+                    "  %s spans w h r b reps\n"
+                    "  %s density w h reps\n"
+                    "  %s edges w h r reps\n"
+                    "  %s metrics w h r reps\n"
+                    "  %s dedup w h r m reps\n"
+                    "  %s label w h r b reps\n"
+                    "  %s morph w h r b k reps\n"
+                    "  %s crop w h r t reps\n",
+            argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0],
+            argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0],
+            argv[0], argv[0], argv[0]);
+    return 1;
+  }
+
+  ImageInit();
+
+  if (strcmp(argv[1], "arena") == 0 && argc == 6)
+  {
+    BenchArena(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), atoi(argv[5]));
+  }
+  else if (strcmp(argv[1], "load") == 0 && argc == 6)
+  {
+    BenchLoad(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), atoi(argv[5]));
+  }
+  else if (strcmp(argv[1], "mmap") == 0 && argc == 6)
+  {
+    BenchMmap(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), atoi(argv[5]));
+  }
+  else if (strcmp(argv[1], "boolop") == 0 && argc == 6)
+  {
+    BenchBoolOp(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), atoi(argv[5]));
+  }
+  else if (strcmp(argv[1], "reduce") == 0 && argc == 7)
+  {
+    BenchReduce(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), atoi(argv[5]),
+                atoi(argv[6]));
+  }
+  else if (strcmp(argv[1], "into") == 0 && argc == 6)
+  {
+    BenchInto(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), atoi(argv[5]));
+  }
+  else if (strcmp(argv[1], "pool") == 0 && argc == 6)
+  {
+    BenchPool(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), atoi(argv[5]));
+  }
+  else if (strcmp(argv[1], "spans") == 0 && argc == 7)
+  {
+    BenchSpans(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), atoi(argv[5]),
+               atoi(argv[6]));
+  }
+  else if (strcmp(argv[1], "edges") == 0 && argc == 6)
+  {
+    BenchEdges(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), atoi(argv[5]));
+  }
+  else if (strcmp(argv[1], "metrics") == 0 && argc == 6)
+  {
+    BenchMetrics(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), atoi(argv[5]));
+  }
+  else if (strcmp(argv[1], "dedup") == 0 && argc == 7)
+  {
+    BenchDedup(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), atoi(argv[5]),
+               atoi(argv[6]));
+  }
+  else if (strcmp(argv[1], "label") == 0 && argc == 7)
+  {
+    BenchLabel(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), atoi(argv[5]),
+               atoi(argv[6]));
+  }
+  else if (strcmp(argv[1], "morph") == 0 && argc == 8)
+  {
+    BenchMorph(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), atoi(argv[5]),
+               atoi(argv[6]), atoi(argv[7]));
+  }
+  else if (strcmp(argv[1], "crop") == 0 && argc == 7)
+  {
+    BenchCrop(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), atoi(argv[5]),
+              atoi(argv[6]));
+  }
+  else if (strcmp(argv[1], "density") == 0 && argc == 5)
+  {
+    BenchDensity(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]));
+  }
+  else if (strcmp(argv[1], "threads") == 0 && argc == 7)
+  {
+    BenchThreads(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]), atoi(argv[5]),
+                 atoi(argv[6]));
+  }
+  else
+  {
+    fprintf(stderr, "Unknown variant or wrong arguments '%s'.\n", argv[1]);
+    return 1;
+  }
+
+  return 0;
+}
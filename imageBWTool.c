@@ -30,34 +30,88 @@ static const char *USAGE =
     "  Most operations apply to CURR and some also use PRED.\n"
     "\n"
     "FILES:\n"
-    "  Currently, only image files in binary PBM format are accepted.\n"
+    "  Image files in binary PBM format are accepted, and image files in\n"
+    "  the native RLE format, named with the .rle extension.\n"
     "  Input file names must be distinct from operation names.\n"
     "\n"
     "OPERATIONS:\n"
     "  FILE            Load image from PBM file named FILE.\n"
-    "  save FILE       Save CURR to PBM file named FILE.\n"
+    "  save FILE       Save CURR to PBM file named FILE (RLE file if *.rle).\n"
+    "  strip F,N FILE  Load N rows of RLE file FILE, from row F on.\n"
     "  info            Show information on CURR (size).\n"
     "  tic             Reset instrumentation counters and times.\n"
     "  toc             Print instrumentation counters and times.\n"
+    "  intern          Store repeated rows once in the images created next.\n"
+    "  threads N       Split the rows of the next operations across N threads.\n"
+    "  nopool          Free the memory of destroyed images right away.\n"
+    "  pool            Show statistics of the block pool (hits, misses, held).\n"
+    "  nospans         Store every row of the images created next separately\n"
+    "                  (no vertical spans of equal rows).\n"
+    "  nobitset        Store every row of the images created next as runs\n"
+    "                  (no bitset rows, even for dense rows).\n"
+    "  edges           Store the rows of the images created next by the\n"
+    "                  positions of their color transitions.\n"
+    "  pixel X,Y       Print the pixel at column X of row Y of CURR.\n"
+    "  black           Count the BLACK pixels of CURR.\n"
+    "  diff            Count the pixels that differ between PREV and CURR.\n"
+    "  scores          Score the mask PREV against the ground truth CURR\n"
+    "                  (IoU, Dice, precision and recall).\n"
+    "  score LIST      Score each pair of PBM (or RLE) files PRED TRUTH listed\n"
+    "                  in LIST, one pair per line, printing a line per pair:\n"
+    "                    PRED TRUTH diff IoU Dice precision recall\n"
+    "                  and their means (lines starting with # are skipped).\n"
     "\n"
     "  create W,H,C    Create new image with WxH pixels, color C.\n"
     "  chess W,H,E,C   Create new chessboard image with WxH pixels,"
     "                  squares with edge E, first color C.\n"
+    "  stripes W,H,S,V,C  Create new image with WxH pixels, stripes of\n"
+    "                  width S, vertical if V, first color C.\n"
+    "  grid W,H,S,T,C  Create new image with WxH pixels, lines with\n"
+    "                  spacing S, thickness T, color C.\n"
     "\n"
     "  raw             Print RAW representation of CURR.\n"
     "  rle             Print RLE representation of CURR.\n"
     "\n"
     "  equal           PREV == CURR?\n"
+    "  hash            Print the fingerprint of CURR.\n"
+    "  label C         Label the connected components of the BLACK pixels\n"
+    "                  of CURR, with C-connectivity (4 or 8), printing the\n"
+    "                  area, bounding box and runs of each one.\n"
     "\n"
     "  neg             Neg CURR.\n"
     "  and             PREV and CURR.\n"
     "  or              PREV or CURR.\n"
     "  xor             PREV xor CURR.\n"
+    "  bool T          PREV op CURR, for the operator with truth table T\n"
+    "                  (bit 2*p+c of T is the result for pixels p, c).\n"
+    "  reduce OP,K     Reduce the last K images with OP, one of\n"
+    "                  and, or, xor, maj (majority).\n"
+    "  expr K,E        Evaluate expression E over the last K images,\n"
+    "                  named A, B, ... (e.g. \"3,(A&B)|~C\").\n"
     "\n"
     "  hmirror         Horizontal mirror CURR (flip top-bottom).\n"
     "  vmirror         Vertical mirror CURR (flip left-right).\n"
     "  repb            Replicate CURR at the bottom of PREV.\n"
     "  repr            Replicate CURR at the right of PREV.\n"
+    "  crop X,Y,W,H    Crop the WxH pixels of CURR from column X of row Y.\n"
+    "  dilate W,H      Dilate CURR by a box of WxH pixels.\n"
+    "  erode W,H       Erode CURR by a box of WxH pixels.\n"
+    "  open W,H        Open CURR (erode, then dilate) by a box of WxH pixels.\n"
+    "  close W,H       Close CURR (dilate, then erode) by a box of WxH\n"
+    "                  pixels.\n"
+    "\n"
+    "  into J,OP       Apply OP (neg, and, or, xor, hmirror, vmirror, repb or\n"
+    "                  repr) as above, storing the result in image IJ.\n"
+    "  inplace OP      Apply OP (neg, hmirror or vmirror) to CURR, in place.\n"
+    "\n"
+    "  stream          Run the rest of the pipeline in streaming mode:\n"
+    "                  rows flow one at a time from the files to save, so\n"
+    "                  images need not fit in memory.  Only FILE, info,\n"
+    "                  create, neg, and, or, xor, bool, vmirror, repb, repr\n"
+    "                  and save are available, and each operation consumes\n"
+    "                  its operands: the buffer works as a stack of streams\n"
+    "                  (save consumes CURR), e.g.\n"
+    "                    stream in.pbm other.pbm and save out.pbm\n"
     "\n"
     "OPERANDS:\n"
     "  FILE            A filename\n"
@@ -82,6 +136,237 @@ static char *errors[] = {
 // Also, the program does not test every module function, but you may easily
 // add new operations for that purpose.
 
+// Run the operations av[k], ..., av[ac-1] in streaming mode (see USAGE).
+// Returns an error code (see errors[]).
+static int RunStreams(FILE *log, int k, int ac, char *av[])
+{
+  const int N = 10;
+  ImageStream s[N]; // the stream stack
+  int n = 0;        // number of streams in it
+  Image img[N];     // the images of ImageStreamOfImage sources
+  int m = 0;        // number of images
+
+  int err = 0;
+  for (; k < ac && err == 0; k++)
+  {
+    const char *binary[5] = {"and", "or", "xor", "repb", "repr"};
+    int op = 0;
+    while (op < 5 && strcmp(av[k], binary[op]) != 0)
+    {
+      op++;
+    }
+    if (strcmp(av[k], "info") == 0)
+    {
+      if (n < 1)
+      {
+        err = 2;
+        break;
+      } // enough input streams?
+      fprintf(log, "Info on S%d\n", n - 1);
+      fprintf(log, "# Size: %dx%d\n", ImageStreamWidth(s[n - 1]),
+              ImageStreamHeight(s[n - 1]));
+    }
+    else if (strcmp(av[k], "create") == 0)
+    {
+      if (++k >= ac)
+      {
+        err = 1;
+        break;
+      } // enough arguments?
+      if (n >= N || m >= N)
+      {
+        err = 3;
+        break;
+      } // enough space for output?
+      uint32 w, h, c;
+      if (sscanf(av[k], "%u,%u,%u", &w, &h, &c) != 3 || c > 1)
+      {
+        err = 4;
+        break;
+      }
+      fprintf(log, "ImageStreamOfImage(ImageCreate(%u, %u, %u)) -> S%d\n", w,
+              h, c, n);
+      img[m] = ImageCreate(w, h, (uint8)c);
+      s[n++] = ImageStreamOfImage(img[m++]);
+    }
+    else if (strcmp(av[k], "neg") == 0 || strcmp(av[k], "vmirror") == 0)
+    {
+      if (n < 1)
+      {
+        err = 2;
+        break;
+      } // enough input streams?
+      if (av[k][0] == 'n')
+      {
+        fprintf(log, "ImageStreamNEG(S%d) -> S%d\n", n - 1, n - 1);
+        s[n - 1] = ImageStreamNEG(s[n - 1]);
+      }
+      else
+      {
+        fprintf(log, "ImageStreamVerticalMirror(S%d) -> S%d\n", n - 1, n - 1);
+        s[n - 1] = ImageStreamVerticalMirror(s[n - 1]);
+      }
+    }
+    else if (op < 5 || strcmp(av[k], "bool") == 0)
+    {
+      uint32 t = 0; // truth table (of bool)
+      if (op == 5)
+      {
+        if (++k >= ac)
+        {
+          err = 1;
+          break;
+        } // enough arguments?
+        if (sscanf(av[k], "%u", &t) != 1 || t > 15)
+        {
+          err = 4;
+          break;
+        }
+      }
+      if (n < 2)
+      {
+        err = 2;
+        break;
+      } // enough input streams?
+      ImageStream s1 = s[n - 2], s2 = s[n - 1];
+      int same_width = ImageStreamWidth(s1) == ImageStreamWidth(s2);
+      int same_height = ImageStreamHeight(s1) == ImageStreamHeight(s2);
+      if (!(op == 3 ? same_width : op == 4 ? same_height : same_width && same_height))
+      {
+        err = 4;
+        break;
+      } // precondition check!
+      const char *funcs[6] = {"ImageStreamAND", "ImageStreamOR",
+                              "ImageStreamXOR", "ImageStreamReplicateAtBottom",
+                              "ImageStreamReplicateAtRight", "ImageStreamBoolOp"};
+      if (op == 5)
+      {
+        fprintf(log, "%s(S%d, S%d, %u) -> S%d\n", funcs[op], n - 2, n - 1, t,
+                n - 2);
+      }
+      else
+      {
+        fprintf(log, "%s(S%d, S%d) -> S%d\n", funcs[op], n - 2, n - 1, n - 2);
+      }
+      switch (op)
+      {
+      case 0:
+        s1 = ImageStreamAND(s1, s2);
+        break;
+      case 1:
+        s1 = ImageStreamOR(s1, s2);
+        break;
+      case 2:
+        s1 = ImageStreamXOR(s1, s2);
+        break;
+      case 3:
+        s1 = ImageStreamReplicateAtBottom(s1, s2);
+        break;
+      case 4:
+        s1 = ImageStreamReplicateAtRight(s1, s2);
+        break;
+      default:
+        s1 = ImageStreamBoolOp(s1, s2, (uint8)t);
+        break;
+      }
+      s[--n - 1] = s1;
+    }
+    else if (strcmp(av[k], "save") == 0)
+    {
+      if (++k >= ac)
+      {
+        err = 1;
+        break;
+      } // enough arguments?
+      if (n < 1)
+      {
+        err = 2;
+        break;
+      } // enough input streams?
+      fprintf(log, "ImageStreamSave(S%d, \"%s\")\n", n - 1, av[k]);
+      ImageStreamSave(s[n - 1], av[k]);
+      fprintf(log, "ImageStreamDestroy(S%d)\n", n - 1);
+      ImageStreamDestroy(&s[--n]);
+    }
+    else
+    { // image file
+      if (n >= N)
+      {
+        err = 3;
+        break;
+      }
+      fprintf(log, "ImageStreamLoad(\"%s\") -> S%d\n", av[k], n);
+      s[n++] = ImageStreamLoad(av[k]);
+    }
+  }
+
+  // Destroy remaining streams, and then the images they refer to
+  while (n > 0)
+  {
+    fprintf(log, "ImageStreamDestroy(S%d)\n", n - 1);
+    ImageStreamDestroy(&s[--n]);
+  }
+  while (m > 0)
+  {
+    ImageDestroy(&img[--m]);
+  }
+  return err;
+}
+
+// Score each pair of mask files PRED TRUTH listed in file list, one pair
+// per line (see USAGE), printing a line per pair and the mean scores.
+// Returns an error code (see errors[]).
+static int RunScores(FILE *log, const char *list)
+{
+  FILE *f = fopen(list, "r");
+  if (f == NULL)
+  {
+    perror(list);
+    return 4;
+  }
+  char line[2 * 4096 + 16];
+  char pred[4096], truth[4096];
+  uint32 pairs = 0, skipped = 0;
+  double sum[4] = {0.0, 0.0, 0.0, 0.0}; // IoU, Dice, precision, recall
+  while (fgets(line, sizeof(line), f) != NULL)
+  {
+    if (line[0] == '#' || sscanf(line, "%4095s %4095s", pred, truth) != 2)
+    {
+      continue; // (comment or blank line)
+    }
+    Image p = ImageLoad(pred);
+    Image t = ImageLoad(truth);
+    if (ImageWidth(p) != ImageWidth(t) || ImageHeight(p) != ImageHeight(t))
+    {
+      fprintf(log, "# %s %s: different sizes\n", pred, truth);
+      skipped++;
+    }
+    else
+    {
+      uint64 counts[4];
+      double s[4];
+      ImageCountPairs(p, t, counts);
+      ImageMaskScores(p, t, &s[0], &s[1], &s[2], &s[3]);
+      fprintf(log, "%s %s %" PRIu64 " %.6f %.6f %.6f %.6f\n", pred, truth,
+              counts[1] + counts[2], s[0], s[1], s[2], s[3]);
+      for (int j = 0; j < 4; j++)
+      {
+        sum[j] += s[j];
+      }
+      pairs++;
+    }
+    ImageDestroy(&p);
+    ImageDestroy(&t);
+  }
+  fclose(f);
+
+  double n = pairs > 0 ? pairs : 1;
+  fprintf(log, "# Pairs: %u Skipped: %u\n", pairs, skipped);
+  fprintf(log, "# Mean IoU: %.6f Dice: %.6f Precision: %.6f Recall: %.6f\n",
+          sum[0] / n, sum[1] / n, sum[2] / n, sum[3] / n);
+  return 0;
+}
+
 int main(int ac, char *av[])
 {
   if (ac <= 1)
@@ -116,6 +401,7 @@ int main(int ac, char *av[])
       w = ImageWidth(img[n - 1]);
       h = ImageHeight(img[n - 1]);
       fprintf(log, "# Size: %ux%u\n", w, h);
+      fprintf(log, "# Bitset rows: %u\n", ImageBitsetRowCount(img[n - 1]));
     }
     else if (strcmp(av[k], "tic") == 0)
     {
@@ -125,6 +411,141 @@ int main(int ac, char *av[])
     {
       InstrPrint();
     }
+    else if (strcmp(av[k], "intern") == 0)
+    {
+      fprintf(log, "ImageSetRowInterning(1)\n");
+      ImageSetRowInterning(1);
+    }
+    else if (strcmp(av[k], "threads") == 0)
+    {
+      if (++k >= ac)
+      {
+        err = 1;
+        break;
+      } // enough arguments?
+      int t; // number of threads
+      if (sscanf(av[k], "%d", &t) != 1)
+      {
+        err = 4;
+        break;
+      } // valid operand?
+      fprintf(log, "ImageSetThreads(%d)\n", t);
+      ImageSetThreads(t);
+    }
+    else if (strcmp(av[k], "stream") == 0)
+    {
+      err = RunStreams(log, k + 1, ac, av);
+      break;
+    }
+    else if (strcmp(av[k], "nopool") == 0)
+    {
+      fprintf(log, "ImageSetPooling(0)\n");
+      ImageSetPooling(0);
+    }
+    else if (strcmp(av[k], "nospans") == 0)
+    {
+      fprintf(log, "ImageSetRowSpans(0)\n");
+      ImageSetRowSpans(0);
+    }
+    else if (strcmp(av[k], "nobitset") == 0)
+    {
+      fprintf(log, "ImageSetBitsetRows(0)\n");
+      ImageSetBitsetRows(0);
+    }
+    else if (strcmp(av[k], "edges") == 0)
+    {
+      fprintf(log, "ImageSetEdgeRows(1)\n");
+      ImageSetEdgeRows(1);
+    }
+    else if (strcmp(av[k], "pixel") == 0)
+    {
+      if (++k >= ac)
+      {
+        err = 1;
+        break;
+      } // enough arguments?
+      if (n < 1)
+      {
+        err = 2;
+        break;
+      } // enough input images?
+      uint32 x, y;
+      if (sscanf(av[k], "%u,%u", &x, &y) != 2 ||
+          x >= (uint32)ImageWidth(img[n - 1]) ||
+          y >= (uint32)ImageHeight(img[n - 1]))
+      {
+        err = 4;
+        break;
+      } // valid operand?
+      fprintf(log, "ImageGetPixel(I%d, %u, %u) -> %d\n", n - 1, x, y,
+              ImageGetPixel(img[n - 1], x, y));
+    }
+    else if (strcmp(av[k], "black") == 0)
+    {
+      if (n < 1)
+      {
+        err = 2;
+        break;
+      } // enough input images?
+      fprintf(log, "ImageCountBlack(I%d) -> %" PRIu64 "\n", n - 1,
+              ImageCountBlack(img[n - 1]));
+    }
+    else if (strcmp(av[k], "diff") == 0)
+    {
+      if (n < 2)
+      {
+        err = 2;
+        break;
+      } // enough input images?
+      if (ImageWidth(img[n - 2]) != ImageWidth(img[n - 1]) ||
+          ImageHeight(img[n - 2]) != ImageHeight(img[n - 1]))
+      {
+        err = 4;
+        break;
+      } // same size?
+      fprintf(log, "ImageCountDiff(I%d, I%d) -> %" PRIu64 "\n", n - 2, n - 1,
+              ImageCountDiff(img[n - 2], img[n - 1]));
+    }
+    else if (strcmp(av[k], "scores") == 0)
+    {
+      if (n < 2)
+      {
+        err = 2;
+        break;
+      } // enough input images?
+      if (ImageWidth(img[n - 2]) != ImageWidth(img[n - 1]) ||
+          ImageHeight(img[n - 2]) != ImageHeight(img[n - 1]))
+      {
+        err = 4;
+        break;
+      } // same size?
+      double iou, dice, precision, recall;
+      ImageMaskScores(img[n - 2], img[n - 1], &iou, &dice, &precision, &recall);
+      fprintf(log, "ImageMaskScores(I%d, I%d) -> IoU: %.6f Dice: %.6f "
+              "Precision: %.6f Recall: %.6f\n", n - 2, n - 1, iou, dice,
+              precision, recall);
+    }
+    else if (strcmp(av[k], "score") == 0)
+    {
+      if (++k >= ac)
+      {
+        err = 1;
+        break;
+      } // enough arguments?
+      err = RunScores(log, av[k]);
+      if (err > 0)
+      {
+        break;
+      }
+    }
+    else if (strcmp(av[k], "pool") == 0)
+    {
+      unsigned long hits, misses;
+      size_t held;
+      ImageGetPoolStats(&hits, &misses, &held);
+      fprintf(log, "Block pool\n");
+      fprintf(log, "# Hits: %lu Misses: %lu Held: %zu\n", hits, misses, held);
+    }
     else if (strcmp(av[k], "create") == 0)
     {
       if (++k >= ac)
@@ -183,6 +604,64 @@ int main(int ac, char *av[])
       // InstrPrint();
       n++;
     }
+    else if (strcmp(av[k], "stripes") == 0)
+    {
+      if (++k >= ac)
+      {
+        err = 1;
+        break;
+      } // enough arguments?
+      if (n >= N)
+      {
+        err = 3;
+        break;
+      } // enough space for output?
+      uint32 s; // stripe width
+      uint32 v; // vertical?
+      uint32 c; // color
+      if (sscanf(av[k], "%u,%u,%u,%u,%u", &w, &h, &s, &v, &c) != 5)
+      {
+        err = 4;
+        break;
+      }
+      if (c > 1 || s == 0)
+      {
+        err = 4;
+        break;
+      } // precondition check!
+      fprintf(log, "ImageCreateStripes(%u, %u, %u, %u, %u) -> I%d\n", w, h, s, v, c, n);
+      img[n] = ImageCreateStripes(w, h, s, (int)v, (uint8)c);
+      n++;
+    }
+    else if (strcmp(av[k], "grid") == 0)
+    {
+      if (++k >= ac)
+      {
+        err = 1;
+        break;
+      } // enough arguments?
+      if (n >= N)
+      {
+        err = 3;
+        break;
+      } // enough space for output?
+      uint32 s; // line spacing
+      uint32 t; // line thickness
+      uint32 c; // color
+      if (sscanf(av[k], "%u,%u,%u,%u,%u", &w, &h, &s, &t, &c) != 5)
+      {
+        err = 4;
+        break;
+      }
+      if (c > 1 || t == 0 || t >= s)
+      {
+        err = 4;
+        break;
+      } // precondition check!
+      fprintf(log, "ImageCreateGrid(%u, %u, %u, %u, %u) -> I%d\n", w, h, s, t, c, n);
+      img[n] = ImageCreateGrid(w, h, s, t, (uint8)c);
+      n++;
+    }
     else if (strcmp(av[k], "raw") == 0)
     {
       if (n < 1)
@@ -214,6 +693,48 @@ int main(int ac, char *av[])
       int eq = ImageIsEqual(img[n - 2], img[n - 1]);
       fprintf(log, "%d\n", eq);
     }
+    else if (strcmp(av[k], "hash") == 0)
+    {
+      if (n < 1)
+      {
+        err = 2;
+        break;
+      } // enough input images?
+      fprintf(log, "ImageHash(I%d) -> %016" PRIx64 "\n", n - 1,
+              ImageHash(img[n - 1]));
+    }
+    else if (strcmp(av[k], "label") == 0)
+    {
+      if (++k >= ac)
+      {
+        err = 1;
+        break;
+      } // enough arguments?
+      if (n < 1)
+      {
+        err = 2;
+        break;
+      } // enough input images?
+      int conn;
+      if (sscanf(av[k], "%d", &conn) != 1 || (conn != 4 && conn != 8))
+      {
+        err = 4;
+        break;
+      } // valid operand?
+      ImageComponents c = ImageLabelComponents(img[n - 1], conn);
+      uint32 count = ImageComponentsCount(c);
+      fprintf(log, "ImageLabelComponents(I%d, %d) -> %u components\n", n - 1,
+              conn, count);
+      for (uint32 j = 0; j < count; j++)
+      {
+        uint32 x, y, w, h;
+        ImageComponentBox(c, j, &x, &y, &w, &h);
+        fprintf(log, "# %u: area %" PRIu64 " box %u,%u %ux%u runs %u\n", j,
+                ImageComponentArea(c, j), x, y, w, h,
+                ImageComponentNumRuns(c, j));
+      }
+      ImageComponentsDestroy(&c);
+    }
     else if (strcmp(av[k], "neg") == 0)
     {
       if (n < 1)
@@ -279,6 +800,101 @@ int main(int ac, char *av[])
       img[n] = ImageXOR(img[n - 2], img[n - 1]);
       n++;
     }
+    else if (strcmp(av[k], "bool") == 0)
+    {
+      if (++k >= ac)
+      {
+        err = 1;
+        break;
+      } // enough arguments?
+      if (n < 2)
+      {
+        err = 2;
+        break;
+      } // enough input images?
+      if (n >= N)
+      {
+        err = 3;
+        break;
+      } // enough space for output?
+      uint32 t; // truth table
+      if (sscanf(av[k], "%u", &t) != 1 || t > 15)
+      {
+        err = 4;
+        break;
+      }
+      fprintf(log, "ImageBoolOp(I%d, I%d, %u) -> I%d\n", n - 2, n - 1, t, n);
+      img[n] = ImageBoolOp(img[n - 2], img[n - 1], (uint8)t);
+      n++;
+    }
+    else if (strcmp(av[k], "reduce") == 0)
+    {
+      if (++k >= ac)
+      {
+        err = 1;
+        break;
+      } // enough arguments?
+      char name[8];
+      uint32 m; // number of input images
+      if (sscanf(av[k], "%7[a-z],%u", name, &m) != 2 || m == 0)
+      {
+        err = 4;
+        break;
+      }
+      const char *ops[4] = {"and", "or", "xor", "maj"};
+      uint8 op = 0;
+      while (op < 4 && strcmp(name, ops[op]) != 0)
+      {
+        op++;
+      }
+      if (op == 4)
+      {
+        err = 4;
+        break;
+      }
+      if (n < (int)m)
+      {
+        err = 2;
+        break;
+      } // enough input images?
+      if (n >= N)
+      {
+        err = 3;
+        break;
+      } // enough space for output?
+      fprintf(log, "ImageReduce(I%d..I%d, %s) -> I%d\n", n - m, n - 1, name, n);
+      img[n] = ImageReduce(img + n - m, m, op);
+      n++;
+    }
+    else if (strcmp(av[k], "expr") == 0)
+    {
+      if (++k >= ac)
+      {
+        err = 1;
+        break;
+      } // enough arguments?
+      uint32 m; // number of input images
+      int len;  // length of the "K," prefix
+      if (sscanf(av[k], "%u,%n", &m, &len) != 1 || m == 0 || m > 26)
+      {
+        err = 4;
+        break;
+      }
+      if (n < (int)m)
+      {
+        err = 2;
+        break;
+      } // enough input images?
+      if (n >= N)
+      {
+        err = 3;
+        break;
+      } // enough space for output?
+      fprintf(log, "ImageEval(I%d..I%d, \"%s\") -> I%d\n", n - m, n - 1,
+              av[k] + len, n);
+      img[n] = ImageEval(img + n - m, m, av[k] + len);
+      n++;
+    }
     else if (strcmp(av[k], "hmirror") == 0)
     {
       if (n < 1)
@@ -295,6 +911,108 @@ int main(int ac, char *av[])
       img[n] = ImageHorizontalMirror(img[n - 1]);
       n++;
     }
+    else if (strcmp(av[k], "into") == 0)
+    {
+      if (++k >= ac)
+      {
+        err = 1;
+        break;
+      } // enough arguments?
+      int j;
+      char name[16];
+      if (sscanf(av[k], "%d,%15s", &j, name) != 2 || j < 0 || j >= n)
+      {
+        err = 4;
+        break;
+      } // valid operand?
+      const char *ops[8] = {"neg", "hmirror", "vmirror", "and",
+                            "or", "xor", "repb", "repr"};
+      const char *funcs[8] = {"NEG", "HorizontalMirror", "VerticalMirror", "AND",
+                              "OR", "XOR", "ReplicateAtBottom", "ReplicateAtRight"};
+      int op = 0;
+      while (op < 8 && strcmp(name, ops[op]) != 0)
+      {
+        op++;
+      }
+      if (op == 8)
+      {
+        err = 4;
+        break;
+      }
+      if (n < (op < 3 ? 1 : 2))
+      {
+        err = 2;
+        break;
+      } // enough input images?
+      if (op < 3)
+      {
+        fprintf(log, "Image%sInto(I%d, I%d)\n", funcs[op], j, n - 1);
+      }
+      else
+      {
+        fprintf(log, "Image%sInto(I%d, I%d, I%d)\n", funcs[op], j, n - 2, n - 1);
+      }
+      switch (op)
+      {
+      case 0:
+        ImageNEGInto(img[j], img[n - 1]);
+        break;
+      case 1:
+        ImageHorizontalMirrorInto(img[j], img[n - 1]);
+        break;
+      case 2:
+        ImageVerticalMirrorInto(img[j], img[n - 1]);
+        break;
+      case 3:
+        ImageANDInto(img[j], img[n - 2], img[n - 1]);
+        break;
+      case 4:
+        ImageORInto(img[j], img[n - 2], img[n - 1]);
+        break;
+      case 5:
+        ImageXORInto(img[j], img[n - 2], img[n - 1]);
+        break;
+      case 6:
+        ImageReplicateAtBottomInto(img[j], img[n - 2], img[n - 1]);
+        break;
+      default:
+        ImageReplicateAtRightInto(img[j], img[n - 2], img[n - 1]);
+        break;
+      }
+    }
+    else if (strcmp(av[k], "inplace") == 0)
+    {
+      if (++k >= ac)
+      {
+        err = 1;
+        break;
+      } // enough arguments?
+      if (n < 1)
+      {
+        err = 2;
+        break;
+      } // enough input images?
+      if (strcmp(av[k], "neg") == 0)
+      {
+        fprintf(log, "ImageNEGInPlace(I%d)\n", n - 1);
+        ImageNEGInPlace(img[n - 1]);
+      }
+      else if (strcmp(av[k], "hmirror") == 0)
+      {
+        fprintf(log, "ImageHorizontalMirrorInPlace(I%d)\n", n - 1);
+        ImageHorizontalMirrorInPlace(img[n - 1]);
+      }
+      else if (strcmp(av[k], "vmirror") == 0)
+      {
+        fprintf(log, "ImageVerticalMirrorInPlace(I%d)\n", n - 1);
+        ImageVerticalMirrorInPlace(img[n - 1]);
+      }
+      else
+      {
+        err = 4;
+        break;
+      }
+    }
     else if (strcmp(av[k], "vmirror") == 0)
     {
       if (n < 1)
@@ -343,6 +1061,75 @@ int main(int ac, char *av[])
       img[n] = ImageReplicateAtRight(img[n - 2], img[n - 1]);
       n++;
     }
+    else if (strcmp(av[k], "crop") == 0)
+    {
+      if (++k >= ac)
+      {
+        err = 1;
+        break;
+      } // enough arguments?
+      if (n < 1)
+      {
+        err = 2;
+        break;
+      } // enough input images?
+      if (n >= N)
+      {
+        err = 3;
+        break;
+      } // enough space for output?
+      uint32 x, y, w, h;
+      uint32 width = ImageWidth(img[n - 1]), height = ImageHeight(img[n - 1]);
+      if (sscanf(av[k], "%u,%u,%u,%u", &x, &y, &w, &h) != 4 || w == 0 ||
+          h == 0 || w > width || h > height || x > width - w ||
+          y > height - h)
+      {
+        err = 4;
+        break;
+      } // valid operand?
+      fprintf(log, "ImageCrop(I%d, %u, %u, %u, %u) -> I%d\n", n - 1, x, y, w, h,
+              n);
+      img[n] = ImageCrop(img[n - 1], x, y, w, h);
+      n++;
+    }
+    else if (strcmp(av[k], "dilate") == 0 || strcmp(av[k], "erode") == 0 ||
+             strcmp(av[k], "open") == 0 || strcmp(av[k], "close") == 0)
+    {
+      const char *name = av[k];
+      if (++k >= ac)
+      {
+        err = 1;
+        break;
+      } // enough arguments?
+      if (n < 1)
+      {
+        err = 2;
+        break;
+      } // enough input images?
+      if (n >= N)
+      {
+        err = 3;
+        break;
+      } // enough space for output?
+      uint32 w, h;
+      if (sscanf(av[k], "%u,%u", &w, &h) != 2 || w == 0 || h == 0)
+      {
+        err = 4;
+        break;
+      } // valid operand?
+      const char *ops[4] = {"dilate", "erode", "open", "close"};
+      const char *funcs[4] = {"Dilate", "Erode", "Open", "Close"};
+      Image (*morph[4])(const Image, uint32, uint32) = {
+          ImageDilate, ImageErode, ImageOpen, ImageClose};
+      int op = 0;
+      while (strcmp(name, ops[op]) != 0)
+      {
+        op++;
+      }
+      fprintf(log, "Image%s(I%d, %u, %u) -> I%d\n", funcs[op], n - 1, w, h, n);
+      img[n] = morph[op](img[n - 1], w, h);
+      n++;
+    }
     else if (strcmp(av[k], "save") == 0)
     {
       if (++k >= ac)
@@ -358,6 +1145,30 @@ int main(int ac, char *av[])
       fprintf(log, "ImageSave(I%d, \"%s\")\n", n - 1, av[k]);
       ImageSave(img[n - 1], av[k]);
     }
+    else if (strcmp(av[k], "strip") == 0)
+    {
+      if (k + 2 >= ac)
+      {
+        err = 1;
+        break;
+      } // enough arguments?
+      if (n >= N)
+      {
+        err = 3;
+        break;
+      } // enough space for output?
+      uint32 first, count;
+      if (sscanf(av[++k], "%u,%u", &first, &count) != 2)
+      {
+        err = 4;
+        break;
+      }
+      k++;
+      fprintf(log, "ImageLoadRLERows(\"%s\", %u, %u) -> I%d\n", av[k], first,
+              count, n);
+      img[n] = ImageLoadRLERows(av[k], first, count);
+      n++;
+    }
     else
     { // image file
       if (n >= N)